@@ -1,11 +1,13 @@
 #pragma once
 
 #include <sgEngine.h>
+#include <cassert>
 
 class MapCreator {
 private:
     sg::Renderer* _renderer;
     sg::Object3D* _mapObj;
+    sg::PotentiallyVisibleSet* _visibilitySet;
     std::vector<sg::Plane> _planes;
 
     void InitPlanes() {
@@ -30,10 +32,29 @@ public:
         _mapObj->Lit = true;
         _mapObj->ReceivesShadows = true;
         _mapObj->PerformFrustumCheck = false;
+        // the walls shadow the enemies and the folds of the cave, they never move so they're drawn once into the static shadow caches
+        _mapObj->CastsShadows = true;
+        _mapObj->Static = true;
+
+        // the stomach only occludes itself, the ambient light stays dynamic and picks up the baked occlusion
+        sg::LightmapBaker baker;
+        baker.AddOccluder(_mapObj);
+        baker.Bake(_mapObj, "res/models/stomach.lightmap");
+        // the level is drawn cluster by cluster, each view only gets the parts in front of it and facing it
+        _mapObj->GetModel()->BuildClusters(256);
 
         renderer->AddObject(_mapObj);
+        assert(renderer->InStaticShadowCache(_mapObj));
+        // the cave walls hide the enemies behind them
+        renderer->AddOccluder(_mapObj, 1.0f);
 
         InitPlanes();
+        // the cells fill the volume the player can move in, enemies are culled by the cell they are in
+        _visibilitySet = new sg::PotentiallyVisibleSet();
+        _visibilitySet->SetPlanes(_planes);
+        _visibilitySet->AddOccluder(_mapObj);
+        _visibilitySet->Build(_mapObj, "res/models/stomach.pvs");
+        renderer->SetVisibilitySet(_visibilitySet);
 	}
 
     glm::vec3 GetValidPosition(glm::vec3 oldPos) {
@@ -48,6 +69,8 @@ public:
     }
 
 	~MapCreator() {
+        _renderer->SetVisibilitySet(NULL);
+        delete(_visibilitySet);
         delete(_mapObj);
 	}
 };
\ No newline at end of file
@@ -50,6 +50,9 @@ public:
 		_spotLightLeft->SetGlobalPosition(glm::vec3(-0.354049f, 0.238036f, -0.886109f));
 		_spotLightLeft->SetColor(glm::vec3(1.0, 1.0, 0.8));
 		_spotLightLeft->SetMapTexture("res/lightMask.jpg");
+		// near 0.05 / far 300 are only the outer limits, the shadow view is fitted to the scene every frame
+		_spotLightRight->SetShadowFitting(true);
+		_spotLightLeft->SetShadowFitting(true);
 
 		_mainCamera = new sg::Camera3D(1.5f, (float)resx / resy, 0.05f, 3000.0f);
 		_mainCamera->SetLocalPosition(glm::vec3(0, 1, 2));
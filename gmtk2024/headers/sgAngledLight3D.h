@@ -9,7 +9,9 @@ namespace sg {
 	class AngledLight3D : public View3D, public ShadowedLight3D {
 	private:
 		glm::mat4 _shadowMatrix;
-		sg::FrameBuffer *_depthBuffer;
+		glm::mat4 _shadowViewProjection;
+		Frustum _shadowFrustum;
+		bool _shadowFitting;
 
 		void SetBoundingBox() {
 			const float farPlane = GetFarPlane();
@@ -46,34 +48,67 @@ namespace sg {
 		void UpdateView() override {
 			View3D::UpdateView();
 
-			glm::mat4 viewProj = GetProjection() * glm::translate(glm::vec3(0, 0, 0.05f)) * GetView();
-			_shadowMatrix = glm::translate(glm::vec3(0.5f, 0.5f, 0.5f)) * glm::scale(glm::vec3(0.5f, 0.5f, 0.5f)) * viewProj;
+			SetShadowProjection(GetProjection(), GetFrustum());
 			SetBoundingBox();
 		}
 
+		void SetShadowProjection(const glm::mat4& projection, const Frustum& frustum) {
+			glm::mat4 viewProj = projection * glm::translate(glm::vec3(0, 0, 0.05f)) * GetView();
+			_shadowMatrix = glm::translate(glm::vec3(0.5f, 0.5f, 0.5f)) * glm::scale(glm::vec3(0.5f, 0.5f, 0.5f)) * viewProj;
+			_shadowViewProjection = projection * GetView();
+			_shadowFrustum = frustum;
+		}
+
 	public:
 		AngledLight3D(int width, int height, float fov, float aspectRatio, float nearPlane, float farPlane) : View3D(fov, aspectRatio, nearPlane, farPlane) {
 			_shadowMatrix = glm::mat4(1);
-			_depthBuffer = new sg::FrameBuffer(width, height, false, true, false, false);
+			_shadowViewProjection = GetViewProjection();
+			_shadowFrustum = GetFrustum();
+			_shadowFitting = false;
 			SetShadowWidth(width);
 			SetShadowHeight(height);
 		}
 
-		GLuint GetShadowTexture() {
-			return _depthBuffer->depthMap;
+		glm::mat4 GetShadow() {
+			UpdateWorld();
+			return _shadowMatrix;
 		}
 
-		sg::FrameBuffer GetShadowBuffer() const {
-			return *_depthBuffer;
+		// View and frustum of the shadow pass, narrower than the light's own when fitting is on
+		glm::mat4 GetShadowViewProjection() {
+			UpdateWorld();
+			return _shadowViewProjection;
 		}
 
-		glm::mat4 GetShadow() const {
-			return _shadowMatrix;
+		Frustum GetShadowFrustum() {
+			UpdateWorld();
+			return _shadowFrustum;
+		}
+
+		// When on, the renderer fits the near and far planes (and the extents of orthographic lights)
+		// to the visible receivers and the casters in front of them every frame
+		void SetShadowFitting(bool fitting) {
+			_shadowFitting = fitting;
+			if (!fitting) ResetShadowBounds();
+		}
+
+		bool IsShadowFitting() const {
+			return _shadowFitting;
+		}
+
+		void ResetShadowBounds() {
+			SetShadowProjection(GetProjection(), GetFrustum());
 		}
 
-		~AngledLight3D() {
-			_depthBuffer->FreeTextures();
-			delete(_depthBuffer);
+		// Distances along the light direction; halfSize is only used by orthographic lights
+		void FitShadowBounds(float nearPlane, float farPlane, glm::vec2 halfSize) {
+			float fov = GetFov();
+			float aspectRatio = GetAspectRatio();
+			if (IsOrthographic()) {
+				fov = halfSize.y / 2;
+				aspectRatio = halfSize.x / halfSize.y;
+			}
+			SetShadowProjection(BuildProjection(fov, aspectRatio, nearPlane, farPlane), BuildFrustum(fov, aspectRatio, nearPlane, farPlane));
 		}
 	};
 }
\ No newline at end of file
@@ -8,6 +8,15 @@ namespace sg {
 		glm::vec3 _direction;
 		float _distance;
 
+		// Cascades split the camera frustum up to the shadow distance, each one gets its own orthographic view
+		int _nCascades;
+		float _cascadeLambda;
+		float _shadowDistance;
+		glm::vec4 _cascadeSplits;
+		glm::mat4 _cascadeViewProjections[SG_MAX_CASCADES];
+		glm::mat4 _cascadeShadowMatrices[SG_MAX_CASCADES];
+		Frustum _cascadeFrustums[SG_MAX_CASCADES];
+
 		void UpdateCoords() {
 			SetLocalPosition(-_direction * _distance);
 			LookAtLocal(glm::vec3(0,0,0));
@@ -17,6 +26,7 @@ namespace sg {
 	protected:
 		void UpdateProjectionMatrix() override {
 			SetOrthographic();
+			UpdateView();
 		}
 
 	public:
@@ -26,6 +36,9 @@ namespace sg {
 			_direction = glm::normalize(direction);
 			_distance = distance;
 			_lightType = TypeDirectionalLight;
+			_nCascades = 1;
+			_cascadeLambda = 0.75f;
+			_shadowDistance = 200;
 			UpdateCoords();
 		}
 
@@ -38,5 +51,102 @@ namespace sg {
 			_distance = distance;
 			UpdateCoords();
 		}
+
+		// 1 keeps the fixed projection of the light, 2 to SG_MAX_CASCADES follow the camera
+		void SetCascades(int nCascades) {
+			_nCascades = glm::clamp(nCascades, 1, SG_MAX_CASCADES);
+		}
+
+		int GetCascades() const {
+			return _nCascades;
+		}
+
+		// 0 splits the depth range evenly, 1 logarithmically
+		void SetCascadeSplitLambda(float lambda) {
+			_cascadeLambda = glm::clamp(lambda, 0.0f, 1.0f);
+		}
+
+		// Camera distance covered by the cascades, nothing farther gets shadows
+		void SetShadowDistance(float distance) {
+			_shadowDistance = distance;
+		}
+
+		float GetShadowDistance() const {
+			return _shadowDistance;
+		}
+
+		// Splits the view of the camera and fits one orthographic view around each slice. The views are sized by
+		// the bounding sphere of the slice, so they don't change size when the camera turns. Their origin still has to be
+		// snapped with SnapCascade once the size of the shadow map is known
+		void FitCascades(View3D* camera) {
+			float nearPlane = camera->GetNearPlane();
+			float farPlane = glm::min(camera->GetFarPlane(), _shadowDistance);
+			float tanHalfV = tanf(camera->GetFov() * .5f);
+			float tanHalfH = tanHalfV * camera->GetAspectRatio();
+			glm::vec3 position = camera->GetGlobalPosition();
+			glm::vec3 forward = camera->GlobalForward();
+			glm::vec3 right = camera->GlobalRight();
+			glm::vec3 up = camera->GlobalUp();
+
+			glm::vec3 lightUp = glm::abs(_direction.y) > 0.99f ? glm::vec3(0, 0, 1) : glm::vec3(0, 1, 0);
+			float sliceNear = nearPlane;
+			for (int c = 0; c < _nCascades; c++) {
+				float t = (float)(c + 1) / _nCascades;
+				float logSplit = nearPlane * powf(farPlane / nearPlane, t);
+				float uniformSplit = nearPlane + (farPlane - nearPlane) * t;
+				float sliceFar = _cascadeLambda * logSplit + (1 - _cascadeLambda) * uniformSplit;
+				_cascadeSplits[c] = sliceFar;
+
+				glm::vec3 corners[8];
+				glm::vec3 center = glm::vec3(0);
+				for (int k = 0; k < 8; k++) {
+					float depth = (k & 4) ? sliceFar : sliceNear;
+					float x = ((k & 1) ? 1.0f : -1.0f) * depth * tanHalfH;
+					float y = ((k & 2) ? 1.0f : -1.0f) * depth * tanHalfV;
+					corners[k] = position + forward * depth + right * x + up * y;
+					center += corners[k] / 8.0f;
+				}
+				float radius = 0;
+				for (int k = 0; k < 8; k++) radius = glm::max(radius, glm::distance(center, corners[k]));
+				radius = glm::ceil(radius * 16.0f) / 16.0f;
+
+				// pulled back by the light distance so casters between the light and the slice are in the view
+				glm::mat4 view = glm::lookAt(center - _direction * (_distance + radius), center, lightUp);
+				glm::mat4 projection = glm::ortho(-radius, radius, -radius, radius, 0.0f, _distance + 2 * radius);
+
+				_cascadeViewProjections[c] = projection * view;
+				_cascadeShadowMatrices[c] = glm::translate(glm::vec3(0.5f, 0.5f, 0.5f)) * glm::scale(glm::vec3(0.5f, 0.5f, 0.5f)) *
+					projection * glm::translate(glm::vec3(0, 0, 0.05f)) * view;
+				_cascadeFrustums[c] = Frustum::FromMatrix(_cascadeViewProjections[c]);
+				sliceNear = sliceFar;
+			}
+		}
+
+		// Moves a cascade view so that the world origin falls on a whole texel of a resolution x resolution map,
+		// the shadows then don't shimmer when the camera moves. The shift is a fraction of a texel
+		static void SnapCascade(int resolution, glm::mat4& viewProjection, glm::mat4& shadowMatrix, Frustum& frustum) {
+			glm::vec2 origin = glm::vec2(viewProjection * glm::vec4(0, 0, 0, 1)) * (resolution / 2.0f);
+			glm::vec2 offset = (glm::round(origin) - origin) * (2.0f / resolution);
+			viewProjection = glm::translate(glm::vec3(offset, 0)) * viewProjection;
+			// the shadow matrix maps clip space to [0, 1], half the shift
+			shadowMatrix = glm::translate(glm::vec3(offset * 0.5f, 0)) * shadowMatrix;
+			frustum = Frustum::FromMatrix(viewProjection);
+		}
+
+		glm::vec4 GetCascadeSplits() const {
+			return _cascadeSplits;
+		}
+
+		glm::mat4 GetCascadeViewProjection(int cascade) const {
+			return _cascadeViewProjections[cascade];
+		}
+
+		glm::mat4 GetCascadeShadow(int cascade) const {
+			return _cascadeShadowMatrices[cascade];
+		}
+
+		Frustum GetCascadeFrustum(int cascade) const {
+			return _cascadeFrustums[cascade];
+		}
 	};
 }
\ No newline at end of file
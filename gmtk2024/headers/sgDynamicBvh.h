@@ -0,0 +1,339 @@
+#pragma once
+
+#include <glm/glm/glm.hpp>
+#include <vector>
+#include <algorithm>
+#include <cfloat>
+#include <sgStructures.h>
+
+namespace sg {
+	// Bounding volume hierarchy over world space boxes that is updated in place, items are the caller's ints.
+	// Leaves keep the box grown by a margin so small moves don't touch the tree, insertions pick the sibling
+	// that adds the least surface area and rotations keep the tree balanced (the scheme of Box2D's dynamic tree)
+	class DynamicBvh {
+	public:
+		static const int Null = -1;
+
+	private:
+		struct Node {
+			glm::vec3 boundsMin;
+			glm::vec3 boundsMax;
+			// next free node while on the free list
+			int parent;
+			int left;
+			int right;
+			// leaves are at 0, free nodes at -1
+			int height;
+			int item;
+
+			bool IsLeaf() const {
+				return left == Null;
+			}
+		};
+
+		std::vector<Node> _nodes;
+		int _root;
+		int _free;
+		float _margin;
+		std::vector<int> _stack;
+
+		static float Area(glm::vec3 boundsMin, glm::vec3 boundsMax) {
+			glm::vec3 size = boundsMax - boundsMin;
+			return 2 * (size.x * size.y + size.y * size.z + size.z * size.x);
+		}
+
+		static float UnionArea(const Node& a, glm::vec3 boundsMin, glm::vec3 boundsMax) {
+			return Area(glm::min(a.boundsMin, boundsMin), glm::max(a.boundsMax, boundsMax));
+		}
+
+		int Allocate() {
+			if (_free == Null) {
+				_nodes.push_back(Node());
+				_free = (int)_nodes.size() - 1;
+				_nodes[_free].parent = Null;
+			}
+			int index = _free;
+			_free = _nodes[index].parent;
+			Node& node = _nodes[index];
+			node.parent = Null;
+			node.left = Null;
+			node.right = Null;
+			node.height = 0;
+			node.item = 0;
+			return index;
+		}
+
+		void Release(int index) {
+			_nodes[index].parent = _free;
+			_nodes[index].height = -1;
+			_free = index;
+		}
+
+		void Refit(int index) {
+			Node& node = _nodes[index];
+			const Node& left = _nodes[node.left];
+			const Node& right = _nodes[node.right];
+			node.boundsMin = glm::min(left.boundsMin, right.boundsMin);
+			node.boundsMax = glm::max(left.boundsMax, right.boundsMax);
+			node.height = 1 + glm::max(left.height, right.height);
+		}
+
+		void ReplaceChild(int parent, int oldChild, int newChild) {
+			if (parent == Null) {
+				_root = newChild;
+			} else if (_nodes[parent].left == oldChild) {
+				_nodes[parent].left = newChild;
+			} else {
+				_nodes[parent].right = newChild;
+			}
+		}
+
+		// Lifts the taller child of a in its place when the two sides differ by more than one level, returns the subtree root
+		int Balance(int a) {
+			Node& nodeA = _nodes[a];
+			if (nodeA.IsLeaf() || nodeA.height < 2) return a;
+			int b = nodeA.left;
+			int c = nodeA.right;
+			int balance = _nodes[c].height - _nodes[b].height;
+			if (balance > 1) return Rotate(a, c, false);
+			if (balance < -1) return Rotate(a, b, true);
+			return a;
+		}
+
+		// up is the child of a that becomes the subtree root, a keeps its other child and takes the shorter child of up
+		int Rotate(int a, int up, bool upIsLeft) {
+			Node& nodeA = _nodes[a];
+			Node& nodeUp = _nodes[up];
+			int tall = nodeUp.left;
+			int shortChild = nodeUp.right;
+			if (_nodes[tall].height < _nodes[shortChild].height) std::swap(tall, shortChild);
+
+			nodeUp.parent = nodeA.parent;
+			ReplaceChild(nodeA.parent, a, up);
+			nodeA.parent = up;
+			nodeUp.left = a;
+			nodeUp.right = tall;
+			if (upIsLeft) {
+				nodeA.left = shortChild;
+			} else {
+				nodeA.right = shortChild;
+			}
+			_nodes[shortChild].parent = a;
+			_nodes[tall].parent = up;
+			Refit(a);
+			Refit(up);
+			return up;
+		}
+
+		void InsertLeaf(int leaf) {
+			if (_root == Null) {
+				_root = leaf;
+				_nodes[leaf].parent = Null;
+				return;
+			}
+
+			// walk down while splitting below the node is cheaper than pairing the leaf with it
+			glm::vec3 boundsMin = _nodes[leaf].boundsMin;
+			glm::vec3 boundsMax = _nodes[leaf].boundsMax;
+			int index = _root;
+			while (!_nodes[index].IsLeaf()) {
+				const Node& node = _nodes[index];
+				float combined = UnionArea(node, boundsMin, boundsMax);
+				float cost = 2 * combined;
+				// every ancestor grows by the same amount whichever child is picked
+				float inherited = 2 * (combined - Area(node.boundsMin, node.boundsMax));
+				const Node& left = _nodes[node.left];
+				const Node& right = _nodes[node.right];
+				float leftCost = UnionArea(left, boundsMin, boundsMax) + inherited;
+				if (!left.IsLeaf()) leftCost -= Area(left.boundsMin, left.boundsMax);
+				float rightCost = UnionArea(right, boundsMin, boundsMax) + inherited;
+				if (!right.IsLeaf()) rightCost -= Area(right.boundsMin, right.boundsMax);
+				if (cost < leftCost && cost < rightCost) break;
+				index = leftCost < rightCost ? node.left : node.right;
+			}
+
+			int sibling = index;
+			int oldParent = _nodes[sibling].parent;
+			int parent = Allocate();
+			_nodes[parent].parent = oldParent;
+			_nodes[parent].left = sibling;
+			_nodes[parent].right = leaf;
+			ReplaceChild(oldParent, sibling, parent);
+			_nodes[sibling].parent = parent;
+			_nodes[leaf].parent = parent;
+			Refit(parent);
+
+			for (index = oldParent; index != Null; index = _nodes[index].parent) {
+				index = Balance(index);
+				Refit(index);
+			}
+		}
+
+		void RemoveLeaf(int leaf) {
+			if (leaf == _root) {
+				_root = Null;
+				return;
+			}
+			int parent = _nodes[leaf].parent;
+			int grandParent = _nodes[parent].parent;
+			int sibling = _nodes[parent].left == leaf ? _nodes[parent].right : _nodes[parent].left;
+			ReplaceChild(grandParent, parent, sibling);
+			_nodes[sibling].parent = grandParent;
+			Release(parent);
+
+			for (int index = grandParent; index != Null; index = _nodes[index].parent) {
+				index = Balance(index);
+				Refit(index);
+			}
+		}
+
+		// -1 outside, 0 crossing, 1 inside
+		static int Classify(const Frustum& frustum, const Node& node) {
+			const Plane* planes[6] = { &frustum.leftFace, &frustum.rightFace, &frustum.topFace, &frustum.bottomFace, &frustum.nearFace, &frustum.farFace };
+			glm::vec3 center = (node.boundsMin + node.boundsMax) * 0.5f;
+			glm::vec3 extents = (node.boundsMax - node.boundsMin) * 0.5f;
+			int result = 1;
+			for (int i = 0; i < 6; i++) {
+				float r = glm::dot(extents, glm::abs(planes[i]->normal));
+				float distance = glm::dot(planes[i]->normal, center) - planes[i]->distance;
+				if (distance < -r) return -1;
+				if (distance < r) result = 0;
+			}
+			return result;
+		}
+
+		static bool HitsRay(const Node& node, glm::vec3 origin, glm::vec3 inverseDirection, float maxDistance) {
+			glm::vec3 t0 = (node.boundsMin - origin) * inverseDirection;
+			glm::vec3 t1 = (node.boundsMax - origin) * inverseDirection;
+			glm::vec3 tMin = glm::min(t0, t1);
+			glm::vec3 tMax = glm::max(t0, t1);
+			float enter = glm::max(glm::max(tMin.x, tMin.y), glm::max(tMin.z, 0.0f));
+			float exit = glm::min(glm::min(tMax.x, tMax.y), glm::min(tMax.z, maxDistance));
+			return enter <= exit;
+		}
+
+		// Walks the tree from the root, accept(node) returns -1 to skip the subtree, 1 to take all of it and 0 to look inside
+		template <typename Accept>
+		void Query(Accept accept, std::vector<int>& result) {
+			if (_root == Null) return;
+			_stack.clear();
+			_stack.push_back(_root);
+			while (!_stack.empty()) {
+				int index = _stack.back();
+				_stack.pop_back();
+				const Node& node = _nodes[index];
+				int test = accept(node);
+				if (test < 0) continue;
+				if (node.IsLeaf()) {
+					result.push_back(node.item);
+				} else if (test > 0) {
+					AddLeaves(index, result);
+				} else {
+					_stack.push_back(node.left);
+					_stack.push_back(node.right);
+				}
+			}
+		}
+
+		void AddLeaves(int index, std::vector<int>& result) {
+			size_t base = _stack.size();
+			_stack.push_back(index);
+			while (_stack.size() > base) {
+				const Node& node = _nodes[_stack.back()];
+				_stack.pop_back();
+				if (node.IsLeaf()) {
+					result.push_back(node.item);
+				} else {
+					_stack.push_back(node.left);
+					_stack.push_back(node.right);
+				}
+			}
+		}
+
+	public:
+		DynamicBvh(float margin = 1.0f) {
+			_root = Null;
+			_free = Null;
+			_margin = margin;
+		}
+
+		// How far a box can move before its leaf is reinserted, applies to the next inserts and moves
+		void SetMargin(float margin) {
+			_margin = margin;
+		}
+
+		void Clear() {
+			_nodes.clear();
+			_root = Null;
+			_free = Null;
+		}
+
+		int GetHeight() const {
+			return _root == Null ? 0 : _nodes[_root].height;
+		}
+
+		// Returns the proxy that identifies the item in Remove and Move
+		int Insert(int item, glm::vec3 boundsMin, glm::vec3 boundsMax) {
+			int leaf = Allocate();
+			_nodes[leaf].boundsMin = boundsMin - _margin;
+			_nodes[leaf].boundsMax = boundsMax + _margin;
+			_nodes[leaf].item = item;
+			InsertLeaf(leaf);
+			return leaf;
+		}
+
+		void Remove(int proxy) {
+			RemoveLeaf(proxy);
+			Release(proxy);
+		}
+
+		// Reinserts the leaf if the box left its grown one, or shrank well inside it. Returns true if the tree changed
+		bool Move(int proxy, glm::vec3 boundsMin, glm::vec3 boundsMax) {
+			const Node& leaf = _nodes[proxy];
+			bool contained = glm::all(glm::lessThanEqual(leaf.boundsMin, boundsMin)) && glm::all(glm::greaterThanEqual(leaf.boundsMax, boundsMax));
+			bool loose = glm::any(glm::lessThan(leaf.boundsMin, boundsMin - 4 * _margin)) || glm::any(glm::greaterThan(leaf.boundsMax, boundsMax + 4 * _margin));
+			if (contained && !loose) return false;
+			RemoveLeaf(proxy);
+			_nodes[proxy].boundsMin = boundsMin - _margin;
+			_nodes[proxy].boundsMax = boundsMax + _margin;
+			InsertLeaf(proxy);
+			return true;
+		}
+
+		int GetItem(int proxy) const {
+			return _nodes[proxy].item;
+		}
+
+		void SetItem(int proxy, int item) {
+			_nodes[proxy].item = item;
+		}
+
+		// The queries append the items whose grown box passes the test, callers do the exact test where it matters
+
+		void QueryBox(glm::vec3 boundsMin, glm::vec3 boundsMax, std::vector<int>& result) {
+			Query([&](const Node& node) {
+				if (glm::any(glm::lessThan(node.boundsMax, boundsMin)) || glm::any(glm::greaterThan(node.boundsMin, boundsMax))) return -1;
+				return 0;
+			}, result);
+		}
+
+		void QueryFrustum(const Frustum& frustum, std::vector<int>& result) {
+			Query([&](const Node& node) { return Classify(frustum, node); }, result);
+		}
+
+		void QuerySphere(glm::vec3 center, float radius, std::vector<int>& result) {
+			Query([&](const Node& node) {
+				glm::vec3 closest = glm::clamp(center, node.boundsMin, node.boundsMax);
+				if (glm::dot(closest - center, closest - center) > radius * radius) return -1;
+				// the farthest corner inside the sphere means the whole box is
+				glm::vec3 farthest = glm::max(glm::abs(node.boundsMin - center), glm::abs(node.boundsMax - center));
+				return glm::dot(farthest, farthest) <= radius * radius ? 1 : 0;
+			}, result);
+		}
+
+		void QueryRay(glm::vec3 origin, glm::vec3 direction, float maxDistance, std::vector<int>& result) {
+			glm::vec3 inverseDirection = 1.0f / direction;
+			Query([&](const Node& node) { return HitsRay(node, origin, inverseDirection, maxDistance) ? 0 : -1; }, result);
+		}
+	};
+}
\ No newline at end of file
@@ -11,6 +11,7 @@
 #include <sgPointLight3D.h>
 #include <sgDirectionalLight3D.h>
 #include <sgAmbientLight.h>
+#include <sgLightmapBaker.h>
 #include <sgUtils.h>
 #include <sgRenderer.h>
 #include <sgInputManager.h>
\ No newline at end of file
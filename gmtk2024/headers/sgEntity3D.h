@@ -1,253 +1,324 @@
 #pragma once
 #include <sgTransform.h>
 #include <list>
+#include <algorithm>
+#include <vector>
+#include <chrono>
+#include <iostream>
 
 namespace sg {
+	// The local transform is the one that is stored, the global one is resolved from the parents when it is read.
+	// A change only flags the entity and its subtree, so any number of changes in a frame costs one resolve per entity
 	class Entity3D {
 	protected:
 		Transform _localTransform;
 		Transform _globalTransform;
 		Entity3D* _parent;
 		std::list<Entity3D*> _children;
+		// set by every change of the global transform, the state derived from it waits for UpdateWorld
+		bool _worldDirty;
 
 	private:
 		static unsigned int nextId;
 		int _id;
+		// _globalTransform is out of date. The whole subtree of a flagged entity is flagged too
+		bool _globalDirty;
 
-		void LocalTransformFromGlobal() {
-			LocalRotationFromGlobal(false);
-			LocalScaleFromGlobal(false);
-			LocalPositionFromGlobal(false);
-			UpdateGlobalTransformInChildren();
-		}
-
-		void GlobalTransformFromLocal() {
-			GlobalRotationFromLocal(false);
-			GlobalScaleFromLocal(false);
-			GlobalPositionFromLocal(false);
-			UpdateGlobalTransformInChildren();
-		}
-
-		glm::mat3 LocalRotationToGlobalMatrix() {
-			glm::mat3 matrix = glm::mat3();
-			matrix[0][0] = _parent->_globalTransform.right.x;
-			matrix[1][0] = _parent->_globalTransform.right.y;
-			matrix[2][0] = -_parent->_globalTransform.right.z;
-			matrix[0][1] = _parent->_globalTransform.up.x;
-			matrix[1][1] = _parent->_globalTransform.up.y;
-			matrix[2][1] = -_parent->_globalTransform.up.z;
-			matrix[0][2] = _parent->_globalTransform.forward.x;
-			matrix[1][2] = _parent->_globalTransform.forward.y;
-			matrix[2][2] = -_parent->_globalTransform.forward.z;
-			return matrix;
-		}
-
-		glm::mat3 LocalPositionToGlobalMatrix() {
-			glm::mat3 matrix = glm::mat3();
-
-			matrix[0][0] = _parent->_globalTransform.scale.x * _parent->GlobalRight().x;
-			matrix[1][0] = _parent->_globalTransform.scale.x * _parent->GlobalRight().y;
-			matrix[2][0] = _parent->_globalTransform.scale.x * _parent->GlobalRight().z;
-			matrix[0][1] = _parent->_globalTransform.scale.y * _parent->GlobalUp().x;
-			matrix[1][1] = _parent->_globalTransform.scale.y * _parent->GlobalUp().y;
-			matrix[2][1] = _parent->_globalTransform.scale.y * _parent->GlobalUp().z;
-			matrix[0][2] = _parent->_globalTransform.scale.z * _parent->GlobalForward().x;
-			matrix[1][2] = _parent->_globalTransform.scale.z * _parent->GlobalForward().y;
-			matrix[2][2] = _parent->_globalTransform.scale.z * _parent->GlobalForward().z;
-			return matrix;
+		// Local positions are measured along the right, up and forward axes of the parent, in its scale
+		static glm::vec3 LocalToGlobalPosition(const Transform& parent, glm::vec3 position) {
+			return parent.position + parent.rotation * (parent.scale * glm::vec3(position.x, position.y, -position.z));
 		}
 
-	protected:
-
-		virtual void LocalRotationFromGlobal(bool updateChildren = true) {
-			if (_parent == NULL) {
-				_localTransform.forward = _globalTransform.forward;
-				_localTransform.right = _globalTransform.right;
-				_localTransform.up = _globalTransform.up;
-			} else {
-				glm::mat3 toGlob = LocalRotationToGlobalMatrix();
-				glm::mat3 toLoc = glm::inverse(toGlob);
-				_localTransform.forward = toLoc * GlobalForward();
-				_localTransform.right = toLoc * GlobalRight();
-				_localTransform.up = toLoc * GlobalUp();
-			}
-
-			if (updateChildren) UpdateGlobalTransformInChildren();
+		static glm::vec3 GlobalToLocalPosition(const Transform& parent, glm::vec3 position) {
+			glm::vec3 local = (glm::inverse(parent.rotation) * (position - parent.position)) / parent.scale;
+			return glm::vec3(local.x, local.y, -local.z);
 		}
 
-		virtual void LocalScaleFromGlobal(bool updateChildren = true) {
-			if (_parent == NULL) {
-				_localTransform.scale = _globalTransform.scale;
-			} else {
-				_localTransform.scale = _globalTransform.scale / _parent->_globalTransform.scale;
-			}
+		static void Compose(const Transform& parent, const Transform& local, Transform& global) {
+			global.position = LocalToGlobalPosition(parent, local.position);
+			global.rotation = parent.rotation * local.rotation;
+			global.scale = parent.scale * local.scale;
+		}
 
-			if (updateChildren) UpdateGlobalTransformInChildren();
+		// The parent has to be resolved already
+		void ResolveFromParent() {
+			if (_parent == NULL) _globalTransform = _localTransform;
+			else Compose(_parent->_globalTransform, _localTransform, _globalTransform);
+			_globalDirty = false;
 		}
 
-		virtual void LocalPositionFromGlobal(bool updateChildren = true) {
-			if (_parent == NULL) {
-				_localTransform.position = _globalTransform.position;
-			} else {
-				glm::mat3 toGlob = LocalPositionToGlobalMatrix();
-				_localTransform.position = glm::inverse(toGlob) * (GetGlobalPosition() - _parent->GetGlobalPosition());
-			}
+		// Only the chain up to the first resolved parent, for a single read
+		void ResolveGlobal() {
+			if (!_globalDirty) return;
+			if (_parent != NULL) _parent->ResolveGlobal();
+			ResolveFromParent();
+		}
 
-			if (updateChildren) UpdateGlobalTransformInChildren();
+		// The whole dirty subtree from its top, parents before children, so every entity in it is resolved once
+		void ResolveSubtree() {
+			Entity3D* top = this;
+			while (top->_parent != NULL && top->_parent->_globalDirty) top = top->_parent;
+			top->ResolveDown();
 		}
 
-		virtual void GlobalRotationFromLocal(bool updateChildren = true) {
-			if (_parent == NULL) {
-				_globalTransform.forward = LocalForward();
-				_globalTransform.right = LocalRight();
-				_globalTransform.up = LocalUp();
-			} else {
-				glm::mat3 toGlob = LocalRotationToGlobalMatrix();
-				_globalTransform.forward = toGlob * LocalForward();
-				_globalTransform.right = toGlob * LocalRight();
-				_globalTransform.up = toGlob * LocalUp();
+		void ResolveDown() {
+			ResolveFromParent();
+			for (auto const& child : _children) {
+				if (child->_globalDirty) child->ResolveDown();
 			}
-
-			if (updateChildren) UpdateGlobalTransformInChildren();
 		}
 
-		virtual void GlobalScaleFromLocal(bool updateChildren = true) {
-			if (_parent == NULL) {
-				_globalTransform.scale = _localTransform.scale;
-			} else {
-				_globalTransform.scale = _localTransform.scale * _parent->_globalTransform.scale;
+	protected:
+
+		// After a change of the local transform. Stops at flagged entities, their subtrees already are
+		void GlobalChanged() {
+			if (_globalDirty) return;
+			_globalDirty = true;
+			_worldDirty = true;
+			for (auto const& child : _children) {
+				child->GlobalChanged();
 			}
+		}
 
-			if (updateChildren) UpdateGlobalTransformInChildren();
+		const Transform& GetGlobalTransform() {
+			ResolveGlobal();
+			return _globalTransform;
 		}
 
-		virtual void GlobalPositionFromLocal(bool updateChildren = true) {
+		// Global edits are made on a copy of the global transform and written back here, the global one stays resolved
+		void SetGlobalTransform(const Transform& global) {
 			if (_parent == NULL) {
-				_globalTransform.position = _localTransform.position;
+				_localTransform = global;
 			} else {
-				glm::mat3 toGlob = LocalPositionToGlobalMatrix();
-				_globalTransform.position = _parent->GetGlobalPosition() + toGlob * GetLocalPosition();
+				const Transform& parent = _parent->GetGlobalTransform();
+				_localTransform.position = GlobalToLocalPosition(parent, global.position);
+				_localTransform.rotation = glm::normalize(glm::inverse(parent.rotation) * global.rotation);
+				_localTransform.scale = global.scale / parent.scale;
 			}
-
-			if (updateChildren) UpdateGlobalTransformInChildren();
-		}
-
-		void UpdateGlobalTransformInChildren() {
+			_globalTransform = global;
+			_globalDirty = false;
+			_worldDirty = true;
 			for (auto const& child : _children) {
-				child->GlobalTransformFromLocal();
+				child->GlobalChanged();
 			}
 		}
 
+		// World matrices and whatever else follows the global transform
+		virtual void RebuildWorld() {}
+
 	public:
 
 		Entity3D() : _id(nextId++) {
 			_parent = NULL;
+			_worldDirty = true;
+			_globalDirty = false;
+		}
+
+		virtual ~Entity3D() {}
+
+		// Rebuilds the derived state once after any number of transform changes. The renderer runs it on the whole scene
+		// at the start of every snapshot, the getters of that state run it for the reads in between. A dirty entity resolves
+		// its whole dirty subtree, so the rest of the scene finds it resolved
+		void UpdateWorld() {
+			if (_globalDirty) ResolveSubtree();
+			if (!_worldDirty) return;
+			_worldDirty = false;
+			RebuildWorld();
 		}
 
 		#pragma region Local
 
-		virtual void TranslateLocal(float x, float y, float z) { _localTransform.Translate(x, y, z); GlobalPositionFromLocal(); }
-		virtual void TranslateLocal(glm::vec3 vec) { _localTransform.Translate(vec); GlobalPositionFromLocal(); }
-		virtual void SetLocalPosition(float x, float y, float z) { _localTransform.position = glm::vec3(x, y, z); GlobalPositionFromLocal(); }
-		virtual void SetLocalPosition(glm::vec3 pos) { _localTransform.position = pos; GlobalPositionFromLocal(); }
+		virtual void TranslateLocal(float x, float y, float z) { _localTransform.Translate(x, y, z); GlobalChanged(); }
+		virtual void TranslateLocal(glm::vec3 vec) { _localTransform.Translate(vec); GlobalChanged(); }
+		virtual void SetLocalPosition(float x, float y, float z) { _localTransform.position = glm::vec3(x, y, z); GlobalChanged(); }
+		virtual void SetLocalPosition(glm::vec3 pos) { _localTransform.position = pos; GlobalChanged(); }
 		glm::vec3 GetLocalPosition() { return _localTransform.position; }
 
-		virtual void RotateLocal(float x, float y, float z) { _localTransform.Rotate(x, y, z); GlobalRotationFromLocal(); }
-		virtual void RotateLocal(glm::vec3 axis, float angle) { _localTransform.Rotate(axis, angle); GlobalRotationFromLocal(); }
-		virtual void RotateAroundLocal(glm::vec3 axis, glm::vec3 point, float angle) {
-			_localTransform.RotateAround(axis, point, angle);
-			GlobalRotationFromLocal();
-			GlobalPositionFromLocal();
-		}
-		virtual void SetLocalRotation(float x, float y, float z) { _localTransform.ResetRotation();  _localTransform.Rotate(x, y, z); GlobalRotationFromLocal(); }
-		virtual void ResetLocalRotation() { _localTransform.ResetRotation(); GlobalRotationFromLocal(); }
+		virtual void RotateLocal(float x, float y, float z) { _localTransform.Rotate(x, y, z); GlobalChanged(); }
+		virtual void RotateLocal(glm::vec3 axis, float angle) { _localTransform.Rotate(axis, angle); GlobalChanged(); }
+		virtual void RotateAroundLocal(glm::vec3 axis, glm::vec3 point, float angle) { _localTransform.RotateAround(axis, point, angle); GlobalChanged(); }
+		virtual void SetLocalRotation(float x, float y, float z) { _localTransform.ResetRotation();  _localTransform.Rotate(x, y, z); GlobalChanged(); }
+		virtual void ResetLocalRotation() { _localTransform.ResetRotation(); GlobalChanged(); }
 
-		virtual void LookAtLocal(glm::vec3 target, glm::vec3 up) { _localTransform.LookAt(target, up); GlobalRotationFromLocal(); }
+		virtual void LookAtLocal(glm::vec3 target, glm::vec3 up) { _localTransform.LookAt(target, up); GlobalChanged(); }
 		virtual void LookAtLocal(glm::vec3 target) {
 			glm::vec3 up = glm::vec3(0, 1, 0);
 			if (glm::abs(glm::dot(glm::normalize(target - _localTransform.position), up)) > 0.999f) { up = glm::vec3(0, 0, 1); }
-			_localTransform.LookAt(target, up);
-			GlobalRotationFromLocal();
+			LookAtLocal(target, up);
 		}
 
-		virtual void ScaleLocal(float x, float y, float z) { _localTransform.Scale(x, y, z); GlobalScaleFromLocal(); }
-		virtual void ScaleLocal(glm::vec3 scale) { _localTransform.Scale(scale); GlobalScaleFromLocal(); }
-		virtual void SetLocalScale(float x, float y, float z) { _localTransform.scale = glm::vec3(x, y, z); GlobalScaleFromLocal(); }
-		virtual void SetLocalScale(glm::vec3 scale) { _localTransform.scale = scale; GlobalScaleFromLocal(); }
-		virtual void SetLocalUniformScale(float s) { _localTransform.scale = glm::vec3(s, s, s); GlobalScaleFromLocal(); }
+		virtual void ScaleLocal(float x, float y, float z) { _localTransform.Scale(x, y, z); GlobalChanged(); }
+		virtual void ScaleLocal(glm::vec3 scale) { _localTransform.Scale(scale); GlobalChanged(); }
+		virtual void SetLocalScale(float x, float y, float z) { _localTransform.scale = glm::vec3(x, y, z); GlobalChanged(); }
+		virtual void SetLocalScale(glm::vec3 scale) { _localTransform.scale = scale; GlobalChanged(); }
+		virtual void SetLocalUniformScale(float s) { _localTransform.scale = glm::vec3(s, s, s); GlobalChanged(); }
 		glm::vec3 GetLocalScale() { return _localTransform.scale; }
 
-		glm::vec3 LocalForward() { return _localTransform.forward; }
-		glm::vec3 LocalUp() { return _localTransform.up; }
-		glm::vec3 LocalRight() { return _localTransform.right; }
+		glm::vec3 LocalForward() { return _localTransform.Forward(); }
+		glm::vec3 LocalUp() { return _localTransform.Up(); }
+		glm::vec3 LocalRight() { return _localTransform.Right(); }
+		glm::quat GetLocalRotation() { return _localTransform.rotation; }
 
 		#pragma endregion
 
 		#pragma region Global
 
-		virtual void TranslateGlobal(float x, float y, float z) { _globalTransform.Translate(x, y, z); LocalPositionFromGlobal(); }
-		virtual void TranslateGlobal(glm::vec3 vec) { _globalTransform.Translate(vec); LocalPositionFromGlobal(); }
-		virtual void SetGlobalPosition(float x, float y, float z) { _globalTransform.position = glm::vec3(x, y, z); LocalPositionFromGlobal(); }
-		virtual void SetGlobalPosition(glm::vec3 pos) { _globalTransform.position = pos; LocalPositionFromGlobal(); }
-		virtual glm::vec3 GetGlobalPosition() { return _globalTransform.position; }
+		virtual void TranslateGlobal(float x, float y, float z) { TranslateGlobal(glm::vec3(x, y, z)); }
+		virtual void TranslateGlobal(glm::vec3 vec) { Transform global = GetGlobalTransform(); global.Translate(vec); SetGlobalTransform(global); }
+		virtual void SetGlobalPosition(float x, float y, float z) { SetGlobalPosition(glm::vec3(x, y, z)); }
+		virtual void SetGlobalPosition(glm::vec3 pos) { Transform global = GetGlobalTransform(); global.position = pos; SetGlobalTransform(global); }
+		virtual glm::vec3 GetGlobalPosition() { return GetGlobalTransform().position; }
 
-		virtual void RotateGlobal(float x, float y, float z) { _globalTransform.Rotate(x, y, z); LocalRotationFromGlobal(); }
-		virtual void RotateGlobal(glm::vec3 axis, float angle) { _globalTransform.Rotate(axis, angle); LocalRotationFromGlobal(); }
+		virtual void RotateGlobal(float x, float y, float z) { Transform global = GetGlobalTransform(); global.Rotate(x, y, z); SetGlobalTransform(global); }
+		virtual void RotateGlobal(glm::vec3 axis, float angle) { Transform global = GetGlobalTransform(); global.Rotate(axis, angle); SetGlobalTransform(global); }
 		virtual void RotateAroundGlobal(glm::vec3 axis, glm::vec3 point, float angle) {
-			_globalTransform.RotateAround(axis, point, angle);
-			LocalRotationFromGlobal();
-			LocalPositionFromGlobal();
+			Transform global = GetGlobalTransform();
+			global.RotateAround(axis, point, angle);
+			SetGlobalTransform(global);
+		}
+		virtual void SetGlobalRotation(float x, float y, float z) {
+			Transform global = GetGlobalTransform();
+			global.ResetRotation();
+			global.Rotate(x, y, z);
+			SetGlobalTransform(global);
 		}
-		virtual void SetGlobalRotation(float x, float y, float z) { _globalTransform.ResetRotation();  _globalTransform.Rotate(x, y, z); LocalRotationFromGlobal(); }
-		virtual void ResetGlobalRotation() { _globalTransform.ResetRotation(); LocalRotationFromGlobal(); }
+		virtual void ResetGlobalRotation() { Transform global = GetGlobalTransform(); global.ResetRotation(); SetGlobalTransform(global); }
 
-		virtual void LookAtGlobal(glm::vec3 target, glm::vec3 up) { _globalTransform.LookAt(target, up); LocalRotationFromGlobal(); }
+		virtual void LookAtGlobal(glm::vec3 target, glm::vec3 up) { Transform global = GetGlobalTransform(); global.LookAt(target, up); SetGlobalTransform(global); }
 		virtual void LookAtGlobal(glm::vec3 target) {
 			glm::vec3 up = glm::vec3(0, 1, 0);
-			if (glm::abs(glm::dot(glm::normalize(target - _globalTransform.position), up)) > 0.999f) { up = glm::vec3(0, 0, 1); }
-			_globalTransform.LookAt(target, up);
-			LocalRotationFromGlobal();
+			if (glm::abs(glm::dot(glm::normalize(target - GetGlobalPosition()), up)) > 0.999f) { up = glm::vec3(0, 0, 1); }
+			LookAtGlobal(target, up);
 		}
 
-		virtual void ScaleGlobal(float x, float y, float z) { _globalTransform.Scale(x, y, z); LocalScaleFromGlobal(); }
-		virtual void ScaleGlobal(glm::vec3 scale) { _globalTransform.Scale(scale); LocalScaleFromGlobal(); }
-		virtual void SetGlobalScale(float x, float y, float z) { _globalTransform.scale = glm::vec3(x, y, z); LocalScaleFromGlobal(); }
-		virtual void SetGlobalScale(glm::vec3 scale) { _globalTransform.scale = scale; LocalScaleFromGlobal(); }
-		virtual void SetGlobalUniformScale(float s) { _globalTransform.scale = glm::vec3(s, s, s); LocalScaleFromGlobal(); }
-		glm::vec3 GetGlobalScale() { return _globalTransform.scale; }
+		virtual void ScaleGlobal(float x, float y, float z) { ScaleGlobal(glm::vec3(x, y, z)); }
+		virtual void ScaleGlobal(glm::vec3 scale) { Transform global = GetGlobalTransform(); global.Scale(scale); SetGlobalTransform(global); }
+		virtual void SetGlobalScale(float x, float y, float z) { SetGlobalScale(glm::vec3(x, y, z)); }
+		virtual void SetGlobalScale(glm::vec3 scale) { Transform global = GetGlobalTransform(); global.scale = scale; SetGlobalTransform(global); }
+		virtual void SetGlobalUniformScale(float s) { SetGlobalScale(glm::vec3(s, s, s)); }
+		glm::vec3 GetGlobalScale() { return GetGlobalTransform().scale; }
 
-		glm::vec3 GlobalForward() { return _globalTransform.forward; }
-		glm::vec3 GlobalUp() { return _globalTransform.up; }
-		glm::vec3 GlobalRight() { return _globalTransform.right; }
+		glm::vec3 GlobalForward() { return GetGlobalTransform().Forward(); }
+		glm::vec3 GlobalUp() { return GetGlobalTransform().Up(); }
+		glm::vec3 GlobalRight() { return GetGlobalTransform().Right(); }
+		glm::quat GetGlobalRotation() { return GetGlobalTransform().rotation; }
 
 		#pragma endregion
 
 		void AddChild(Entity3D* child, bool keepLocal) {
 			if (std::find(_children.begin(), _children.end(), child) == _children.end()) {
+				Transform global = child->GetGlobalTransform();
 				_children.push_back(child);
 				child->_parent = this;
 				if (keepLocal) {
-					child->GlobalTransformFromLocal();
+					child->GlobalChanged();
 				} else {
-					child->LocalTransformFromGlobal();
+					child->SetGlobalTransform(global);
 				}
 			}
 		}
 
 		void RemoveChild(Entity3D* child, bool keepLocal) {
 			if (std::find(_children.begin(), _children.end(), child) != _children.end()) {
+				Transform global = child->GetGlobalTransform();
 				_children.remove(child);
 				child->_parent = NULL;
 				if (keepLocal) {
-					child->GlobalTransformFromLocal();
+					child->GlobalChanged();
 				} else {
-					child->LocalTransformFromGlobal();
+					child->SetGlobalTransform(global);
 				}
 			}
 		}
 
 		virtual void Start() {}
 		virtual void Update(double dt) {}
+
+		// Chains of entities as deep as depth, every entity turned and moved each frame. Times three ways of reading them:
+		// after every change, once per frame for everything, and only the leaves after the scene update with only the roots
+		// moving. The same runs on a reference that pushes every change down to the children at once, as this class used to
+		static void Benchmark(int depth = 64, int nChains = 256, int nFrames = 100) {
+			double lazyTimes[3], eagerTimes[3];
+			glm::vec3 lazyChecksum = RunBenchmark<Entity3D>(depth, nChains, nFrames, lazyTimes);
+			glm::vec3 eagerChecksum = RunBenchmark<EagerEntity>(depth, nChains, nFrames, eagerTimes);
+			const char* names[3] = { "read after every change", "read once per frame", "roots moved, leaves read" };
+			std::cout << "Transform hierarchy, " << nChains << " chains of " << depth << " entities, average of " << nFrames << " frames" << std::endl;
+			for (int i = 0; i < 3; i++) {
+				std::cout << "  " << names[i] << ": " << lazyTimes[i] << " ms, eager " << eagerTimes[i] << " ms" << std::endl;
+			}
+			float difference = glm::length(lazyChecksum - eagerChecksum) / glm::max(glm::length(eagerChecksum), 1.0f);
+			std::cout << "  (checksum " << lazyChecksum.x + lazyChecksum.y + lazyChecksum.z << ", relative difference " << difference << ")" << std::endl;
+		}
+
+	private:
+
+		// Updates the globals of the whole subtree on every change, only for the benchmark
+		struct EagerEntity {
+			Transform local;
+			Transform global;
+			EagerEntity* parent = NULL;
+			std::vector<EagerEntity*> children;
+
+			void Propagate() {
+				if (parent == NULL) global = local;
+				else Compose(parent->global, local, global);
+				for (int i = 0; i < children.size(); i++) children[i]->Propagate();
+			}
+
+			void AddChild(EagerEntity* child, bool /*keepLocal*/) { children.push_back(child); child->parent = this; child->Propagate(); }
+			void SetLocalPosition(glm::vec3 pos) { local.position = pos; Propagate(); }
+			void RotateLocal(glm::vec3 axis, float angle) { local.Rotate(axis, angle); Propagate(); }
+			void TranslateLocal(float x, float y, float z) { local.Translate(x, y, z); Propagate(); }
+			glm::vec3 GetGlobalPosition() { return global.position; }
+			void UpdateWorld() {}
+		};
+
+		template <class T>
+		static glm::vec3 RunBenchmark(int depth, int nChains, int nFrames, double times[3]) {
+			std::vector<T*> entities;
+			for (int c = 0; c < nChains; c++) {
+				T* parent = NULL;
+				for (int d = 0; d < depth; d++) {
+					T* entity = new T();
+					entity->SetLocalPosition(glm::vec3(0.5f, 0.1f * c, 1.0f));
+					if (parent != NULL) parent->AddChild(entity, true);
+					entities.push_back(entity);
+					parent = entity;
+				}
+			}
+
+			glm::vec3 checksum = glm::vec3(0);
+			auto start = std::chrono::high_resolution_clock::now();
+			for (int frame = 0; frame < nFrames; frame++) {
+				for (int i = 0; i < entities.size(); i++) {
+					entities[i]->RotateLocal(glm::vec3(0, 1, 0), 0.001f);
+					entities[i]->TranslateLocal(0, 0, 0.001f);
+					checksum += entities[i]->GetGlobalPosition();
+				}
+			}
+			auto eachEnd = std::chrono::high_resolution_clock::now();
+			for (int frame = 0; frame < nFrames; frame++) {
+				for (int i = 0; i < entities.size(); i++) {
+					entities[i]->RotateLocal(glm::vec3(0, 1, 0), 0.001f);
+					entities[i]->TranslateLocal(0, 0, 0.001f);
+				}
+				for (int i = 0; i < entities.size(); i++) checksum += entities[i]->GetGlobalPosition();
+			}
+			auto frameEnd = std::chrono::high_resolution_clock::now();
+			for (int frame = 0; frame < nFrames; frame++) {
+				for (int c = 0; c < nChains; c++) entities[c * depth]->RotateLocal(glm::vec3(0, 1, 0), 0.001f);
+				// what the renderer does at the start of every snapshot
+				for (int i = 0; i < entities.size(); i++) entities[i]->UpdateWorld();
+				for (int c = 0; c < nChains; c++) checksum += entities[c * depth + depth - 1]->GetGlobalPosition();
+			}
+			auto leavesEnd = std::chrono::high_resolution_clock::now();
+
+			times[0] = std::chrono::duration<double, std::milli>(eachEnd - start).count() / nFrames;
+			times[1] = std::chrono::duration<double, std::milli>(frameEnd - eachEnd).count() / nFrames;
+			times[2] = std::chrono::duration<double, std::milli>(leavesEnd - frameEnd).count() / nFrames;
+			for (int i = 0; i < entities.size(); i++) delete entities[i];
+			return checksum;
+		}
 	};
 	unsigned int Entity3D::nextId;
 }
\ No newline at end of file
@@ -0,0 +1,358 @@
+#pragma once
+
+#include <glm/glm/glm.hpp>
+#include <glm/glm/gtc/matrix_transform.hpp>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <random>
+#include <iostream>
+#include <sgStructures.h>
+
+// Every x64 cpu has SSE2, 32 bit builds have it with /arch:SSE2 (the MSVC default) or -msse2. AVX2 is compiled next to it
+// and picked at runtime, the shipped project doesn't build with /arch:AVX2
+#if defined(_M_X64) || defined(__x86_64__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define SG_CULL_SSE2
+#include <emmintrin.h>
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+// MSVC emits the AVX2 intrinsics without /arch:AVX2
+#define SG_CULL_AVX2_TARGET
+#else
+#define SG_CULL_AVX2_TARGET __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace sg {
+	// World space boxes as center and extents, one array per component so the kernels load a box per lane
+	struct BoxesSoA {
+		std::vector<float> centerX;
+		std::vector<float> centerY;
+		std::vector<float> centerZ;
+		std::vector<float> extentsX;
+		std::vector<float> extentsY;
+		std::vector<float> extentsZ;
+
+		int Size() const {
+			return (int)centerX.size();
+		}
+
+		void Resize(int n) {
+			centerX.resize(n);
+			centerY.resize(n);
+			centerZ.resize(n);
+			extentsX.resize(n);
+			extentsY.resize(n);
+			extentsZ.resize(n);
+		}
+
+		void Set(int i, glm::vec3 center, glm::vec3 extents) {
+			centerX[i] = center.x;
+			centerY[i] = center.y;
+			centerZ[i] = center.z;
+			extentsX[i] = extents.x;
+			extentsY[i] = extents.y;
+			extentsZ[i] = extents.z;
+		}
+	};
+
+	// Box against frustum tests over BoxesSoA, 8 boxes per instruction with AVX2, 4 with SSE2, one at a time otherwise.
+	// Same test as ObjectSnapshot::BoundsInFrustum. Nothing is shared between calls, threads can cull disjoint ranges at once
+	class FrustumCuller {
+	public:
+		// Filter takes the six faces of a point light at most
+		static const int MaxFrustums = 6;
+
+		enum Kernel {
+			KernelScalar,
+			KernelSSE2,
+			KernelAVX2
+		};
+
+	private:
+		// the six planes split by component, with the absolute normal for the projected extents
+		struct Planes {
+			float normalX[6];
+			float normalY[6];
+			float normalZ[6];
+			float absX[6];
+			float absY[6];
+			float absZ[6];
+			float distance[6];
+		};
+
+		static Planes Split(const Frustum& frustum) {
+			const Plane* faces[6] = { &frustum.leftFace, &frustum.rightFace, &frustum.topFace, &frustum.bottomFace, &frustum.nearFace, &frustum.farFace };
+			Planes planes;
+			for (int k = 0; k < 6; k++) {
+				planes.normalX[k] = faces[k]->normal.x;
+				planes.normalY[k] = faces[k]->normal.y;
+				planes.normalZ[k] = faces[k]->normal.z;
+				planes.absX[k] = glm::abs(faces[k]->normal.x);
+				planes.absY[k] = glm::abs(faces[k]->normal.y);
+				planes.absZ[k] = glm::abs(faces[k]->normal.z);
+				planes.distance[k] = faces[k]->distance;
+			}
+			return planes;
+		}
+
+		static bool TestBox(const Planes& planes, const BoxesSoA& boxes, int i) {
+			for (int k = 0; k < 6; k++) {
+				float distance = planes.normalX[k] * boxes.centerX[i] + planes.normalY[k] * boxes.centerY[i] + planes.normalZ[k] * boxes.centerZ[i] - planes.distance[k];
+				float radius = planes.absX[k] * boxes.extentsX[i] + planes.absY[k] * boxes.extentsY[i] + planes.absZ[k] * boxes.extentsZ[i];
+				if (distance + radius < 0) return false;
+			}
+			return true;
+		}
+
+#if defined(SG_CULL_SSE2)
+		// The lane loops are written out per kernel: with GCC the AVX2 code has to stay inside functions compiled for it
+		struct LanesAVX2 {
+			static const int Width = 8;
+
+			SG_CULL_AVX2_TARGET static __m256 Gather(const std::vector<float>& values, const int* indices) {
+				return _mm256_i32gather_ps(values.data(), _mm256_loadu_si256((const __m256i*)indices), 4);
+			}
+
+			// bit l set when the box in lane l is on the inner side of all six planes
+			SG_CULL_AVX2_TARGET static int Test(const Planes& planes, __m256 cx, __m256 cy, __m256 cz, __m256 ex, __m256 ey, __m256 ez) {
+				__m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+				for (int k = 0; k < 6; k++) {
+					__m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(planes.normalX[k]), cx), _mm256_mul_ps(_mm256_set1_ps(planes.normalY[k]), cy)), _mm256_mul_ps(_mm256_set1_ps(planes.normalZ[k]), cz));
+					distance = _mm256_sub_ps(distance, _mm256_set1_ps(planes.distance[k]));
+					__m256 radius = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(planes.absX[k]), ex), _mm256_mul_ps(_mm256_set1_ps(planes.absY[k]), ey)), _mm256_mul_ps(_mm256_set1_ps(planes.absZ[k]), ez));
+					inside = _mm256_and_ps(inside, _mm256_cmp_ps(_mm256_add_ps(distance, radius), _mm256_setzero_ps(), _CMP_GE_OQ));
+				}
+				return _mm256_movemask_ps(inside);
+			}
+
+			// Returns where the scalar tail starts
+			SG_CULL_AVX2_TARGET static int Cull(const Planes& planes, const BoxesSoA& boxes, int begin, int end, unsigned char* visible) {
+				int i = begin;
+				for (; i + Width <= end; i += Width) {
+					int mask = Test(planes, _mm256_loadu_ps(&boxes.centerX[i]), _mm256_loadu_ps(&boxes.centerY[i]), _mm256_loadu_ps(&boxes.centerZ[i]),
+						_mm256_loadu_ps(&boxes.extentsX[i]), _mm256_loadu_ps(&boxes.extentsY[i]), _mm256_loadu_ps(&boxes.extentsZ[i]));
+					for (int l = 0; l < Width; l++) visible[i - begin + l] = (mask >> l) & 1;
+				}
+				return i;
+			}
+
+			// the lanes are loaded before any index is written back and kept never passes i
+			SG_CULL_AVX2_TARGET static int Filter(const Planes* planes, int nFrustums, const BoxesSoA& boxes, int* indices, int count, int& kept) {
+				int i = 0;
+				for (; i + Width <= count; i += Width) {
+					const int* lanes = indices + i;
+					__m256 cx = Gather(boxes.centerX, lanes), cy = Gather(boxes.centerY, lanes), cz = Gather(boxes.centerZ, lanes);
+					__m256 ex = Gather(boxes.extentsX, lanes), ey = Gather(boxes.extentsY, lanes), ez = Gather(boxes.extentsZ, lanes);
+					int mask = 0;
+					for (int f = 0; f < nFrustums && mask != (1 << Width) - 1; f++) mask |= Test(planes[f], cx, cy, cz, ex, ey, ez);
+					int block[Width];
+					for (int l = 0; l < Width; l++) block[l] = lanes[l];
+					for (int l = 0; l < Width; l++) {
+						if ((mask >> l) & 1) indices[kept++] = block[l];
+					}
+				}
+				return i;
+			}
+		};
+
+		struct LanesSSE2 {
+			static const int Width = 4;
+
+			static __m128 Gather(const std::vector<float>& values, const int* indices) {
+				return _mm_set_ps(values[indices[3]], values[indices[2]], values[indices[1]], values[indices[0]]);
+			}
+
+			static int Test(const Planes& planes, __m128 cx, __m128 cy, __m128 cz, __m128 ex, __m128 ey, __m128 ez) {
+				__m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+				for (int k = 0; k < 6; k++) {
+					__m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(planes.normalX[k]), cx), _mm_mul_ps(_mm_set1_ps(planes.normalY[k]), cy)), _mm_mul_ps(_mm_set1_ps(planes.normalZ[k]), cz));
+					distance = _mm_sub_ps(distance, _mm_set1_ps(planes.distance[k]));
+					__m128 radius = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(planes.absX[k]), ex), _mm_mul_ps(_mm_set1_ps(planes.absY[k]), ey)), _mm_mul_ps(_mm_set1_ps(planes.absZ[k]), ez));
+					inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(distance, radius), _mm_setzero_ps()));
+				}
+				return _mm_movemask_ps(inside);
+			}
+
+			static int Cull(const Planes& planes, const BoxesSoA& boxes, int begin, int end, unsigned char* visible) {
+				int i = begin;
+				for (; i + Width <= end; i += Width) {
+					int mask = Test(planes, _mm_loadu_ps(&boxes.centerX[i]), _mm_loadu_ps(&boxes.centerY[i]), _mm_loadu_ps(&boxes.centerZ[i]),
+						_mm_loadu_ps(&boxes.extentsX[i]), _mm_loadu_ps(&boxes.extentsY[i]), _mm_loadu_ps(&boxes.extentsZ[i]));
+					for (int l = 0; l < Width; l++) visible[i - begin + l] = (mask >> l) & 1;
+				}
+				return i;
+			}
+
+			static int Filter(const Planes* planes, int nFrustums, const BoxesSoA& boxes, int* indices, int count, int& kept) {
+				int i = 0;
+				for (; i + Width <= count; i += Width) {
+					const int* lanes = indices + i;
+					__m128 cx = Gather(boxes.centerX, lanes), cy = Gather(boxes.centerY, lanes), cz = Gather(boxes.centerZ, lanes);
+					__m128 ex = Gather(boxes.extentsX, lanes), ey = Gather(boxes.extentsY, lanes), ez = Gather(boxes.extentsZ, lanes);
+					int mask = 0;
+					for (int f = 0; f < nFrustums && mask != (1 << Width) - 1; f++) mask |= Test(planes[f], cx, cy, cz, ex, ey, ez);
+					int block[Width];
+					for (int l = 0; l < Width; l++) block[l] = lanes[l];
+					for (int l = 0; l < Width; l++) {
+						if ((mask >> l) & 1) indices[kept++] = block[l];
+					}
+				}
+				return i;
+			}
+		};
+
+		// AVX2 needs the cpu to have it and the OS to save the ymm registers
+		static bool CpuHasAVX2() {
+#if defined(_MSC_VER)
+			int info[4];
+			__cpuid(info, 0);
+			if (info[0] < 7) return false;
+			__cpuid(info, 1);
+			bool osxsave = (info[2] & (1 << 27)) != 0;
+			bool avx = (info[2] & (1 << 28)) != 0;
+			if (!osxsave || !avx || (_xgetbv(0) & 6) != 6) return false;
+			__cpuidex(info, 7, 0);
+			return (info[1] & (1 << 5)) != 0;
+#else
+			__builtin_cpu_init();
+			return __builtin_cpu_supports("avx2") != 0;
+#endif
+		}
+#endif
+
+		static Kernel DetectKernel() {
+#if defined(SG_CULL_SSE2)
+			return CpuHasAVX2() ? KernelAVX2 : KernelSSE2;
+#else
+			return KernelScalar;
+#endif
+		}
+
+		static int CullWith(Kernel kernel, const Planes& planes, const BoxesSoA& boxes, int begin, int end, unsigned char* visible) {
+#if defined(SG_CULL_SSE2)
+			if (kernel == KernelAVX2) return LanesAVX2::Cull(planes, boxes, begin, end, visible);
+			if (kernel == KernelSSE2) return LanesSSE2::Cull(planes, boxes, begin, end, visible);
+#endif
+			return begin;
+		}
+
+		static void Cull(Kernel kernel, const Frustum& frustum, const BoxesSoA& boxes, int begin, int end, unsigned char* visible) {
+			Planes planes = Split(frustum);
+			int i = CullWith(kernel, planes, boxes, begin, end, visible);
+			for (; i < end; i++) visible[i - begin] = TestBox(planes, boxes, i) ? 1 : 0;
+		}
+
+	public:
+		// The widest kernel this cpu runs, detected once
+		static Kernel ActiveKernel() {
+			static const Kernel kernel = DetectKernel();
+			return kernel;
+		}
+
+		static const char* KernelName(Kernel kernel) {
+			switch (kernel) {
+			case KernelAVX2: return "AVX2";
+			case KernelSSE2: return "SSE2";
+			default: return "scalar";
+			}
+		}
+
+		// visible[i - begin] becomes 1 for the boxes in [begin, end) that touch the frustum and 0 for the others
+		static void Cull(const Frustum& frustum, const BoxesSoA& boxes, int begin, int end, unsigned char* visible) {
+			Cull(ActiveKernel(), frustum, boxes, begin, end, visible);
+		}
+
+		// Keeps the indices whose box touches any of the frustums, in their order, and returns how many are left
+		static int Filter(const Frustum* frustums, int nFrustums, const BoxesSoA& boxes, int* indices, int count) {
+			Planes planes[MaxFrustums];
+			for (int f = 0; f < nFrustums; f++) planes[f] = Split(frustums[f]);
+			int kept = 0;
+			int i = 0;
+#if defined(SG_CULL_SSE2)
+			if (ActiveKernel() == KernelAVX2) i = LanesAVX2::Filter(planes, nFrustums, boxes, indices, count, kept);
+			else if (ActiveKernel() == KernelSSE2) i = LanesSSE2::Filter(planes, nFrustums, boxes, indices, count, kept);
+#endif
+			for (; i < count; i++) {
+				bool inside = false;
+				for (int f = 0; f < nFrustums && !inside; f++) inside = TestBox(planes[f], boxes, indices[i]);
+				if (inside) indices[kept++] = indices[i];
+			}
+			return kept;
+		}
+
+		static int Filter(const Frustum& frustum, const BoxesSoA& boxes, int* indices, int count) {
+			return Filter(&frustum, 1, boxes, indices, count);
+		}
+
+		// Times every kernel the cpu runs against the scalar per object test they replace (boxes stored as center and extents,
+		// one plane at a time), then the active one split over all cores, and prints the results
+		static void Benchmark(int nBoxes = 100000, int nRuns = 200) {
+			struct Box {
+				glm::vec3 center;
+				glm::vec3 extents;
+			};
+			std::mt19937 random(1234);
+			std::uniform_real_distribution<float> position(-200.0f, 200.0f);
+			std::uniform_real_distribution<float> size(0.2f, 5.0f);
+			std::vector<Box> aos(nBoxes);
+			BoxesSoA soa;
+			soa.Resize(nBoxes);
+			for (int i = 0; i < nBoxes; i++) {
+				aos[i].center = glm::vec3(position(random), position(random), position(random));
+				aos[i].extents = glm::vec3(size(random), size(random), size(random));
+				soa.Set(i, aos[i].center, aos[i].extents);
+			}
+			glm::mat4 projection = glm::perspective(glm::radians(60.0f), 16.0f / 9.0f, 0.1f, 150.0f);
+			glm::mat4 view = glm::lookAt(glm::vec3(0, 0, 0), glm::vec3(1, 0.2f, 0.5f), glm::vec3(0, 1, 0));
+			Frustum frustum = Frustum::FromMatrix(projection * view);
+			const Plane* faces[6] = { &frustum.leftFace, &frustum.rightFace, &frustum.topFace, &frustum.bottomFace, &frustum.nearFace, &frustum.farFace };
+
+			std::vector<unsigned char> scalarVisible(nBoxes), kernelVisible(nBoxes), threadedVisible(nBoxes);
+			int nDifferent = 0;
+			auto start = std::chrono::high_resolution_clock::now();
+			for (int run = 0; run < nRuns; run++) {
+				for (int i = 0; i < nBoxes; i++) {
+					bool inside = true;
+					for (int k = 0; k < 6 && inside; k++) {
+						float r = glm::dot(aos[i].extents, glm::abs(faces[k]->normal));
+						inside = -r <= glm::dot(faces[k]->normal, aos[i].center) - faces[k]->distance;
+					}
+					scalarVisible[i] = inside ? 1 : 0;
+				}
+			}
+			auto scalarEnd = std::chrono::high_resolution_clock::now();
+			double scalarTime = std::chrono::duration<double, std::milli>(scalarEnd - start).count() / nRuns;
+			int nVisible = 0;
+			for (int i = 0; i < nBoxes; i++) nVisible += scalarVisible[i];
+			std::cout << "Frustum culling, " << nBoxes << " boxes, " << nVisible << " visible, average of " << nRuns << " runs" << std::endl;
+			std::cout << "  scalar: " << scalarTime << " ms" << std::endl;
+
+			for (int k = KernelScalar; k <= ActiveKernel(); k++) {
+				Kernel kernel = (Kernel)k;
+				auto kernelStart = std::chrono::high_resolution_clock::now();
+				for (int run = 0; run < nRuns; run++) Cull(kernel, frustum, soa, 0, nBoxes, kernelVisible.data());
+				double kernelTime = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - kernelStart).count() / nRuns;
+				std::cout << "  " << KernelName(kernel) << " SoA: " << kernelTime << " ms (" << scalarTime / kernelTime << "x)" << std::endl;
+				for (int i = 0; i < nBoxes; i++) nDifferent += scalarVisible[i] != kernelVisible[i];
+			}
+
+			auto threadedStart = std::chrono::high_resolution_clock::now();
+			int nThreads = glm::max((int)std::thread::hardware_concurrency(), 1);
+			std::vector<std::thread> threads;
+			for (int t = 0; t < nThreads; t++) {
+				threads.push_back(std::thread([&, t]() {
+					int begin = (int)((long long)nBoxes * t / nThreads);
+					int end = (int)((long long)nBoxes * (t + 1) / nThreads);
+					for (int run = 0; run < nRuns; run++) Cull(frustum, soa, begin, end, threadedVisible.data() + begin);
+				}));
+			}
+			for (int t = 0; t < nThreads; t++) threads[t].join();
+			double threadedTime = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - threadedStart).count() / nRuns;
+			for (int i = 0; i < nBoxes; i++) nDifferent += scalarVisible[i] != threadedVisible[i];
+			std::cout << "  " << KernelName(ActiveKernel()) << " on " << nThreads << " threads: " << threadedTime << " ms (" << scalarTime / threadedTime << "x)" << std::endl;
+			if (nDifferent > 0) std::cout << "  " << nDifferent << " boxes disagree with the scalar test" << std::endl;
+		}
+	};
+}
\ No newline at end of file
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <sgGLStateCache.h>
+
+namespace sg {
+	// Render targets of the deferred path: albedo and the shadow receiver flag, specular and shininess,
+	// view space normal and depth. Only touched from the render thread
+	struct GBuffer {
+		GLuint bufferIndex = 0;
+		GLuint albedoTexture = 0;
+		GLuint specularTexture = 0;
+		GLuint normalTexture = 0;
+		GLuint depthTexture = 0;
+		int width = 0;
+		int height = 0;
+		bool isValid = false;
+
+		GLuint CreateTexture(GLenum internalFormat, GLenum format, GLenum type) {
+			GLuint texture;
+			glGenTextures(1, &texture);
+			GLStateCache::Instance()->BindTexture(0, GL_TEXTURE_2D, texture);
+			glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, type, NULL);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+			return texture;
+		}
+
+		void Create(int w, int h) {
+			width = w;
+			height = h;
+			glGenFramebuffers(1, &bufferIndex);
+			GLStateCache::Instance()->BindFramebuffer(GL_FRAMEBUFFER, bufferIndex);
+
+			albedoTexture = CreateTexture(GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE);
+			specularTexture = CreateTexture(GL_RGBA16F, GL_RGBA, GL_FLOAT);
+			normalTexture = CreateTexture(GL_RGBA16F, GL_RGBA, GL_FLOAT);
+			depthTexture = CreateTexture(GL_DEPTH_COMPONENT32F, GL_DEPTH_COMPONENT, GL_FLOAT);
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, albedoTexture, 0);
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, specularTexture, 0);
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_2D, normalTexture, 0);
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthTexture, 0);
+
+			GLenum drawBuffers[3] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2 };
+			glDrawBuffers(3, drawBuffers);
+
+			isValid = (glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+		}
+
+		void Delete() {
+			if (bufferIndex == 0) return;
+			GLuint textures[4] = { albedoTexture, specularTexture, normalTexture, depthTexture };
+			GLStateCache::Instance()->DeleteTextures(4, textures);
+			GLStateCache::Instance()->DeleteFramebuffers(1, &bufferIndex);
+			bufferIndex = 0;
+			isValid = false;
+		}
+
+		// Recreates the targets when the window size changed
+		void Resize(int w, int h) {
+			if (bufferIndex != 0 && w == width && h == height) return;
+			Delete();
+			Create(w, h);
+		}
+	};
+}
\ No newline at end of file
@@ -0,0 +1,240 @@
+#pragma once
+
+#include <GL/glew.h>
+
+#define SG_MAX_TEXTURE_UNITS 32
+#define SG_N_TEXTURE_TARGETS 6
+
+namespace sg {
+	enum GLStateCall {
+		CallUseProgram = 0,
+		CallBindVertexArray,
+		CallBindBuffer,
+		CallActiveTexture,
+		CallBindTexture,
+		CallBindFramebuffer,
+		CallCount
+	};
+
+	struct GLStateCounters {
+		unsigned int issued[CallCount];
+		unsigned int skipped[CallCount];
+
+		GLStateCounters() {
+			Reset();
+		}
+
+		void Reset() {
+			for (int i = 0; i < CallCount; i++) {
+				issued[i] = 0;
+				skipped[i] = 0;
+			}
+		}
+
+		unsigned int TotalIssued() const {
+			unsigned int total = 0;
+			for (int i = 0; i < CallCount; i++) total += issued[i];
+			return total;
+		}
+
+		unsigned int TotalSkipped() const {
+			unsigned int total = 0;
+			for (int i = 0; i < CallCount; i++) total += skipped[i];
+			return total;
+		}
+	};
+
+	// Every bind that goes through here is compared with the last value we sent to the driver,
+	// calls that would not change anything are dropped and counted as skipped
+	class GLStateCache {
+	private:
+		static GLStateCache _instance;
+		static bool _initialized;
+
+		GLuint _program;
+		GLuint _vertexArray;
+		GLuint _arrayBuffer;
+		GLuint _uniformBuffer;
+		GLuint _drawFramebuffer;
+		GLuint _readFramebuffer;
+		GLuint _activeUnit;
+		GLuint _textures[SG_MAX_TEXTURE_UNITS][SG_N_TEXTURE_TARGETS];
+
+		GLStateCounters _frameCounters;
+		GLStateCounters _lastFrameCounters;
+
+		GLStateCache() {
+			Invalidate();
+		}
+
+		int TargetIndex(GLenum target) {
+			switch (target) {
+			case GL_TEXTURE_2D: return 0;
+			case GL_TEXTURE_CUBE_MAP: return 1;
+			case GL_TEXTURE_RECTANGLE: return 2;
+			case GL_TEXTURE_2D_ARRAY: return 3;
+			case GL_TEXTURE_CUBE_MAP_ARRAY: return 4;
+			case GL_TEXTURE_BUFFER: return 5;
+			default: return -1;
+			}
+		}
+
+		bool Changed(GLuint& cached, GLuint value, GLStateCall call) {
+			if (cached == value) {
+				_frameCounters.skipped[call]++;
+				return false;
+			}
+			cached = value;
+			_frameCounters.issued[call]++;
+			return true;
+		}
+
+	public:
+		static GLStateCache* Instance();
+
+		// Forget everything we know, to be used after code outside the cache touched the bindings
+		void Invalidate() {
+			_program = -1;
+			_vertexArray = -1;
+			_arrayBuffer = -1;
+			_uniformBuffer = -1;
+			_drawFramebuffer = -1;
+			_readFramebuffer = -1;
+			_activeUnit = -1;
+			for (int i = 0; i < SG_MAX_TEXTURE_UNITS; i++) {
+				for (int j = 0; j < SG_N_TEXTURE_TARGETS; j++) {
+					_textures[i][j] = -1;
+				}
+			}
+		}
+
+		void BeginFrame() {
+			_lastFrameCounters = _frameCounters;
+			_frameCounters.Reset();
+		}
+
+		GLStateCounters GetFrameCounters() const {
+			return _frameCounters;
+		}
+
+		GLStateCounters GetLastFrameCounters() const {
+			return _lastFrameCounters;
+		}
+
+		void UseProgram(GLuint program) {
+			if (Changed(_program, program, CallUseProgram)) glUseProgram(program);
+		}
+
+		GLuint GetProgram() const {
+			return _program;
+		}
+
+		void BindVertexArray(GLuint vao) {
+			if (Changed(_vertexArray, vao, CallBindVertexArray)) glBindVertexArray(vao);
+		}
+
+		void BindBuffer(GLenum target, GLuint buffer) {
+			switch (target) {
+			case GL_ARRAY_BUFFER:
+				if (Changed(_arrayBuffer, buffer, CallBindBuffer)) glBindBuffer(target, buffer);
+				break;
+			case GL_UNIFORM_BUFFER:
+				if (Changed(_uniformBuffer, buffer, CallBindBuffer)) glBindBuffer(target, buffer);
+				break;
+			default:
+				// the element buffer belongs to the bound vertex array, so it is never cached
+				_frameCounters.issued[CallBindBuffer]++;
+				glBindBuffer(target, buffer);
+				break;
+			}
+		}
+
+		// Binding a range also changes the generic binding of the target
+		void BindBufferRange(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size) {
+			if (target == GL_UNIFORM_BUFFER) _uniformBuffer = buffer;
+			else if (target == GL_ARRAY_BUFFER) _arrayBuffer = buffer;
+			_frameCounters.issued[CallBindBuffer]++;
+			glBindBufferRange(target, index, buffer, offset, size);
+		}
+
+		void BindFramebuffer(GLenum target, GLuint framebuffer) {
+			bool draw = target == GL_FRAMEBUFFER || target == GL_DRAW_FRAMEBUFFER;
+			bool read = target == GL_FRAMEBUFFER || target == GL_READ_FRAMEBUFFER;
+			if ((!draw || _drawFramebuffer == framebuffer) && (!read || _readFramebuffer == framebuffer)) {
+				_frameCounters.skipped[CallBindFramebuffer]++;
+				return;
+			}
+			if (draw) _drawFramebuffer = framebuffer;
+			if (read) _readFramebuffer = framebuffer;
+			_frameCounters.issued[CallBindFramebuffer]++;
+			glBindFramebuffer(target, framebuffer);
+		}
+
+		void ActiveTexture(GLuint unit) {
+			if (Changed(_activeUnit, unit, CallActiveTexture)) glActiveTexture(GL_TEXTURE0 + unit);
+		}
+
+		void BindTexture(GLuint unit, GLenum target, GLuint texture) {
+			int targetIndex = TargetIndex(target);
+			if (unit >= SG_MAX_TEXTURE_UNITS || targetIndex < 0) {
+				ActiveTexture(unit);
+				_frameCounters.issued[CallBindTexture]++;
+				glBindTexture(target, texture);
+				return;
+			}
+			if (_textures[unit][targetIndex] == texture) {
+				_frameCounters.skipped[CallBindTexture]++;
+				return;
+			}
+			ActiveTexture(unit);
+			_textures[unit][targetIndex] = texture;
+			_frameCounters.issued[CallBindTexture]++;
+			glBindTexture(target, texture);
+		}
+
+		void DeleteTextures(GLsizei n, const GLuint* textures) {
+			for (int k = 0; k < n; k++) {
+				for (int i = 0; i < SG_MAX_TEXTURE_UNITS; i++) {
+					for (int j = 0; j < SG_N_TEXTURE_TARGETS; j++) {
+						if (_textures[i][j] == textures[k]) _textures[i][j] = 0;
+					}
+				}
+			}
+			glDeleteTextures(n, textures);
+		}
+
+		void DeleteBuffers(GLsizei n, const GLuint* buffers) {
+			for (int k = 0; k < n; k++) {
+				if (_arrayBuffer == buffers[k]) _arrayBuffer = 0;
+				if (_uniformBuffer == buffers[k]) _uniformBuffer = 0;
+			}
+			glDeleteBuffers(n, buffers);
+		}
+
+		void DeleteVertexArrays(GLsizei n, const GLuint* arrays) {
+			for (int k = 0; k < n; k++) {
+				if (_vertexArray == arrays[k]) _vertexArray = 0;
+			}
+			glDeleteVertexArrays(n, arrays);
+		}
+
+		void DeleteFramebuffers(GLsizei n, const GLuint* framebuffers) {
+			for (int k = 0; k < n; k++) {
+				if (_drawFramebuffer == framebuffers[k]) _drawFramebuffer = 0;
+				if (_readFramebuffer == framebuffers[k]) _readFramebuffer = 0;
+			}
+			glDeleteFramebuffers(n, framebuffers);
+		}
+	};
+
+	GLStateCache GLStateCache::_instance = GLStateCache();
+	bool GLStateCache::_initialized = false;
+
+	GLStateCache* GLStateCache::Instance() {
+		if (!_initialized) {
+			_instance = GLStateCache();
+			_initialized = true;
+		}
+		return &_instance;
+	}
+}
\ No newline at end of file
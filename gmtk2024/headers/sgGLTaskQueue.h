@@ -0,0 +1,111 @@
+#pragma once
+
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+
+namespace sg {
+	// When the renderer runs on its own thread only that thread owns the GL context.
+	// Code running elsewhere (resource creation during gameplay, destructors) posts its GL work here
+	// and the render thread executes it between two frames
+	class GLTaskQueue {
+	private:
+		static GLTaskQueue _instance;
+		static bool _initialized;
+
+		struct Task {
+			std::function<void()> function;
+			bool* done;
+		};
+
+		std::mutex _mutex;
+		std::condition_variable _condition;
+		std::deque<Task> _tasks;
+		std::thread::id _owner;
+		bool _hasOwner;
+
+		GLTaskQueue() {
+			_hasOwner = false;
+		}
+
+	public:
+		static GLTaskQueue* Instance();
+
+		std::mutex& GetMutex() {
+			return _mutex;
+		}
+
+		std::condition_variable& GetCondition() {
+			return _condition;
+		}
+
+		void SetOwner(std::thread::id owner) {
+			std::lock_guard<std::mutex> lock(_mutex);
+			_owner = owner;
+			_hasOwner = true;
+		}
+
+		void ClearOwner() {
+			std::lock_guard<std::mutex> lock(_mutex);
+			_hasOwner = false;
+			_condition.notify_all();
+		}
+
+		bool IsGLThread() {
+			std::lock_guard<std::mutex> lock(_mutex);
+			return !_hasOwner || _owner == std::this_thread::get_id();
+		}
+
+		// Runs the function right away on the GL thread, otherwise queues it and
+		// blocks until the render thread has executed it
+		void Run(std::function<void()> function) {
+			if (IsGLThread()) {
+				function();
+				return;
+			}
+			bool done = false;
+			std::unique_lock<std::mutex> lock(_mutex);
+			_tasks.push_back({ function, &done });
+			_condition.notify_all();
+			_condition.wait(lock, [&]() { return done || !_hasOwner; });
+			if (!done) {
+				// the render thread stopped before getting to us, the context is back on the caller
+				while (!_tasks.empty()) ExecuteOne(lock);
+			}
+		}
+
+		// Must be called with the mutex held
+		bool HasTasks() const {
+			return !_tasks.empty();
+		}
+
+		// Pops and runs a single task, the lock must be held by the caller and is held again on return
+		void ExecuteOne(std::unique_lock<std::mutex>& lock) {
+			if (_tasks.empty()) return;
+			Task task = _tasks.front();
+			_tasks.pop_front();
+			lock.unlock();
+			task.function();
+			lock.lock();
+			*task.done = true;
+			_condition.notify_all();
+		}
+
+		void Execute() {
+			std::unique_lock<std::mutex> lock(_mutex);
+			while (!_tasks.empty()) ExecuteOne(lock);
+		}
+	};
+
+	GLTaskQueue GLTaskQueue::_instance;
+	bool GLTaskQueue::_initialized = false;
+
+	GLTaskQueue* GLTaskQueue::Instance() {
+		if (!_initialized) {
+			_initialized = true;
+		}
+		return &_instance;
+	}
+}
\ No newline at end of file
@@ -15,6 +15,7 @@ namespace sg {
 		glm::vec3 _center;
 		glm::vec3 _extents;
 		bool _boundingBoxSet = false;
+		bool _baked = false;
 
 	protected:
 		LightType _lightType;
@@ -44,7 +45,17 @@ namespace sg {
 			return _intensity;
 		}
 
-		bool FrustumCheck(sg::Frustum frustum) {
+		// Baked lights only exist in the lightmaps of the static geometry, see LightmapBaker.
+		// The renderer leaves them out of the frame, dynamic objects are not lit by them
+		void SetBaked(bool baked) {
+			_baked = baked;
+		}
+
+		bool IsBaked() {
+			return _baked;
+		}
+
+		bool FrustumCheck(const sg::Frustum& frustum) {
 			if (!_boundingBoxSet) return true;
 			return (isOnOrForwardPlane(frustum.leftFace, _center, _extents) &&
 				isOnOrForwardPlane(frustum.rightFace, _center, _extents) &&
@@ -0,0 +1,232 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <vector>
+#include <iostream>
+#include <climits>
+#include <glm/glm/glm.hpp>
+#include <sgRenderSnapshot.h>
+#include <sgGLStateCache.h>
+
+namespace sg {
+	// Clustered forward lighting: the view frustum is cut into screen tiles and exponential depth slices and every
+	// cluster gets the list of the point lights whose sphere reaches it, the lit shaders only loop over their cluster.
+	// GL 3.3 has no storage buffers, everything goes into one texture buffer: four texels per light (view position and range,
+	// color and intensity, world position and far plane, shadow slot), one header per cluster (first index, count)
+	// and the light indices packed four per texel
+	class LightClusters {
+	private:
+		static const int TexelsPerLight = 4;
+
+		int _tilesX;
+		int _tilesY;
+		int _slices;
+		float _nearPlane;
+		float _sliceScale;
+		glm::vec2 _tileSize;
+
+		// view space spheres, one array per component so the binning loop runs over plain floats
+		std::vector<float> _x;
+		std::vector<float> _y;
+		std::vector<float> _z;
+		std::vector<float> _radius;
+		std::vector<glm::ivec3> _first;
+		std::vector<glm::ivec3> _last;
+		std::vector<int> _counts;
+		std::vector<int> _cursors;
+
+		std::vector<glm::uvec4> _texels;
+		int _headersOffset;
+		int _indicesOffset;
+
+		GLuint _buffer;
+		GLuint _texture;
+		GLint _maxTexels;
+		bool _overflowReported;
+
+		int ClusterIndex(int x, int y, int slice) const {
+			return (slice * _tilesY + y) * _tilesX + x;
+		}
+
+		int SliceOf(float depth) const {
+			return glm::clamp((int)(glm::log(glm::max(depth, _nearPlane) / _nearPlane) * _sliceScale), 0, _slices - 1);
+		}
+
+		int TileOf(float ndc, int tiles, float tileSize, float screenSize) const {
+			return glm::clamp((int)((ndc * 0.5f + 0.5f) * screenSize / tileSize), 0, tiles - 1);
+		}
+
+		static glm::uvec4 Pack(glm::vec4 value) {
+			return glm::uvec4(glm::floatBitsToUint(value.x), glm::floatBitsToUint(value.y), glm::floatBitsToUint(value.z), glm::floatBitsToUint(value.w));
+		}
+
+	public:
+		LightClusters(int tilesX = 16, int tilesY = 9, int slices = 24) {
+			_tilesX = tilesX;
+			_tilesY = tilesY;
+			_slices = slices;
+			_nearPlane = 0.1f;
+			_sliceScale = 1;
+			_tileSize = glm::vec2(1);
+			_headersOffset = 0;
+			_indicesOffset = 0;
+			_buffer = 0;
+			_texture = 0;
+			_maxTexels = 0;
+			_overflowReported = false;
+		}
+
+		int GetClusterCount() const {
+			return _tilesX * _tilesY * _slices;
+		}
+
+		// Bins the point lights, call on the render thread before Upload
+		void Build(const std::vector<PointLightSnapshot>& lights, const glm::mat4& view, const glm::mat4& projection, float nearPlane, float farPlane, int width, int height) {
+			int nLights = (int)lights.size();
+			int nClusters = GetClusterCount();
+			bool perspective = projection[2][3] != 0;
+			_nearPlane = nearPlane;
+			_sliceScale = _slices / glm::log(farPlane / nearPlane);
+			_tileSize = glm::ceil(glm::vec2(width, height) / glm::vec2(_tilesX, _tilesY));
+
+			_x.resize(nLights);
+			_y.resize(nLights);
+			_z.resize(nLights);
+			_radius.resize(nLights);
+			for (int i = 0; i < nLights; i++) {
+				glm::vec3 position = glm::vec3(view * glm::vec4(lights[i].position, 1));
+				_x[i] = position.x;
+				_y[i] = position.y;
+				// depth along the view direction, the view looks down -z
+				_z[i] = -position.z;
+				_radius[i] = lights[i].range;
+			}
+
+			// cluster range of every light, an empty one (first > last) when the sphere misses the view
+			_first.resize(nLights);
+			_last.resize(nLights);
+			for (int i = 0; i < nLights; i++) {
+				float x = _x[i], y = _y[i], z = _z[i], r = _radius[i];
+				_first[i] = glm::ivec3(0, 0, SliceOf(z - r));
+				_last[i] = glm::ivec3(_tilesX - 1, _tilesY - 1, SliceOf(z + r));
+				if (r <= 0 || z + r < nearPlane || z - r > farPlane) {
+					_first[i] = glm::ivec3(1);
+					_last[i] = glm::ivec3(0);
+					continue;
+				}
+				// spheres crossing the near plane can cover any tile
+				if (perspective && z - r <= nearPlane) continue;
+
+				// screen box of the sphere: each side divided by the depth that pushes it furthest out
+				glm::vec2 minSide = glm::vec2(x - r, y - r);
+				glm::vec2 maxSide = glm::vec2(x + r, y + r);
+				glm::vec2 scale = glm::vec2(projection[0][0], projection[1][1]);
+				glm::vec2 ndcMin, ndcMax;
+				if (perspective) {
+					ndcMin = scale * minSide / glm::mix(glm::vec2(z + r), glm::vec2(z - r), glm::lessThan(minSide, glm::vec2(0)));
+					ndcMax = scale * maxSide / glm::mix(glm::vec2(z + r), glm::vec2(z - r), glm::greaterThan(maxSide, glm::vec2(0)));
+				} else {
+					glm::vec2 offset = glm::vec2(projection[3][0], projection[3][1]);
+					ndcMin = scale * minSide + offset;
+					ndcMax = scale * maxSide + offset;
+				}
+				if (ndcMax.x < -1 || ndcMax.y < -1 || ndcMin.x > 1 || ndcMin.y > 1) {
+					_first[i] = glm::ivec3(1);
+					_last[i] = glm::ivec3(0);
+					continue;
+				}
+				_first[i].x = TileOf(ndcMin.x, _tilesX, _tileSize.x, (float)width);
+				_first[i].y = TileOf(ndcMin.y, _tilesY, _tileSize.y, (float)height);
+				_last[i].x = TileOf(ndcMax.x, _tilesX, _tileSize.x, (float)width);
+				_last[i].y = TileOf(ndcMax.y, _tilesY, _tileSize.y, (float)height);
+			}
+
+			// counting pass, then the lists are laid out back to back
+			_counts.assign(nClusters, 0);
+			for (int i = 0; i < nLights; i++) {
+				for (int s = _first[i].z; s <= _last[i].z; s++) {
+					for (int y = _first[i].y; y <= _last[i].y; y++) {
+						for (int x = _first[i].x; x <= _last[i].x; x++) {
+							_counts[ClusterIndex(x, y, s)]++;
+						}
+					}
+				}
+			}
+
+			_headersOffset = nLights * TexelsPerLight;
+			_indicesOffset = _headersOffset + nClusters;
+			int capacity = _maxTexels > 0 ? (_maxTexels - _indicesOffset) * 4 : INT_MAX;
+			_texels.assign(_indicesOffset, glm::uvec4(0));
+			_cursors.resize(nClusters);
+			int total = 0;
+			for (int c = 0; c < nClusters; c++) {
+				int count = glm::max(0, glm::min(_counts[c], capacity - total));
+				if (count < _counts[c] && !_overflowReported) {
+					std::cout << "WARNING: Too many lights for the cluster buffer, some are left out." << std::endl;
+					_overflowReported = true;
+				}
+				_texels[_headersOffset + c] = glm::uvec4(total, count, 0, 0);
+				_cursors[c] = total;
+				_counts[c] = total + count;
+				total += count;
+			}
+			_texels.resize(_indicesOffset + (total + 3) / 4, glm::uvec4(0));
+
+			for (int i = 0; i < nLights; i++) {
+				const PointLightSnapshot& light = lights[i];
+				_texels[i * TexelsPerLight] = Pack(glm::vec4(_x[i], _y[i], -_z[i], light.range));
+				_texels[i * TexelsPerLight + 1] = Pack(glm::vec4(light.color, light.intensity));
+				_texels[i * TexelsPerLight + 2] = Pack(glm::vec4(light.position, light.farPlane));
+				_texels[i * TexelsPerLight + 3] = glm::uvec4((unsigned int)light.shadowSlot, 0, 0, 0);
+				for (int s = _first[i].z; s <= _last[i].z; s++) {
+					for (int y = _first[i].y; y <= _last[i].y; y++) {
+						for (int x = _first[i].x; x <= _last[i].x; x++) {
+							int c = ClusterIndex(x, y, s);
+							// _counts now holds the end of the list
+							if (_cursors[c] >= _counts[c]) continue;
+							int index = _cursors[c]++;
+							_texels[_indicesOffset + index / 4][index % 4] = i;
+						}
+					}
+				}
+			}
+		}
+
+		void Upload() {
+			bool created = _buffer == 0;
+			if (created) {
+				glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &_maxTexels);
+				glGenBuffers(1, &_buffer);
+				glGenTextures(1, &_texture);
+			}
+			GLStateCache::Instance()->BindBuffer(GL_TEXTURE_BUFFER, _buffer);
+			// orphaned every frame, the driver hands out new storage while the previous frame is still reading the old one
+			glBufferData(GL_TEXTURE_BUFFER, _texels.size() * sizeof(glm::uvec4), NULL, GL_STREAM_DRAW);
+			glBufferSubData(GL_TEXTURE_BUFFER, 0, _texels.size() * sizeof(glm::uvec4), _texels.data());
+			GLStateCache::Instance()->BindBuffer(GL_TEXTURE_BUFFER, 0);
+			if (created) {
+				// the texture keeps pointing at the buffer across reallocations
+				GLStateCache::Instance()->BindTexture(0, GL_TEXTURE_BUFFER, _texture);
+				glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32UI, _buffer);
+			}
+		}
+
+		void Bind(GLuint program, int textureUnit) {
+			if (program <= 0) return;
+			GLStateCache::Instance()->BindTexture(textureUnit, GL_TEXTURE_BUFFER, _texture);
+			GLStateCache::Instance()->UseProgram(program);
+			glUniform1i(glGetUniformLocation(program, "clusterData"), textureUnit);
+			glUniform3i(glGetUniformLocation(program, "clusterGrid"), _tilesX, _tilesY, _slices);
+			glUniform2fv(glGetUniformLocation(program, "clusterTileSize"), 1, glm::value_ptr(_tileSize));
+			glUniform2f(glGetUniformLocation(program, "clusterDepth"), _nearPlane, _sliceScale);
+			glUniform1i(glGetUniformLocation(program, "clusterHeaders"), _headersOffset);
+			glUniform1i(glGetUniformLocation(program, "clusterIndices"), _indicesOffset);
+		}
+
+		~LightClusters() {
+			if (_buffer == 0) return;
+			GLStateCache::Instance()->DeleteBuffers(1, &_buffer);
+			GLStateCache::Instance()->DeleteTextures(1, &_texture);
+		}
+	};
+}
\ No newline at end of file
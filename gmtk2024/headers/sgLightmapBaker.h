@@ -0,0 +1,409 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <cstdio>
+#include <cfloat>
+#include <glm/glm/glm.hpp>
+#include <glm/glm/gtc/packing.hpp>
+#include <sgObject3D.h>
+#include <sgTriangleBvh.h>
+#include <sgAmbientLight.h>
+#include <sgPointLight3D.h>
+#include <sgSpotLight3D.h>
+#include <sgDirectionalLight3D.h>
+#include <sgGLTaskQueue.h>
+#include <sgGLStateCache.h>
+
+namespace sg {
+	struct LightmapSettings {
+		int atlasSize = 1024;
+		// starting density, lowered until every chart fits in the atlas
+		float texelsPerUnit = 4;
+		int aoSamples = 32;
+		float aoDistance = 4;
+		// pushes the ray origins off the surface
+		float bias = 0.02f;
+		// 0 uses every core
+		int threads = 0;
+	};
+
+	// Offline lighting for static geometry. Every triangle of the target gets its own chart in the lightmap, then all cores
+	// trace the texels against the occluders: cosine distributed rays for the ambient occlusion, one shadow ray per baked light.
+	// rgb is the irradiance of the baked lights, alpha the occlusion the lightmapped shader applies to the runtime ambient lights.
+	// With a cache path the traced texels are saved and reused as long as the geometry, the lights and the settings match
+	class LightmapBaker {
+	private:
+		static const int Padding = 1;
+		static const unsigned int CacheMagic = 0x4D4C4753;
+
+		enum BakedLightType {
+			BakedAmbient = 0,
+			BakedDirectional,
+			BakedPoint,
+			BakedSpot
+		};
+
+		struct BakedLight {
+			BakedLightType type;
+			glm::vec3 position;
+			glm::vec3 direction;
+			// color times intensity
+			glm::vec3 color;
+			float range;
+			glm::mat4 shadowMatrix;
+		};
+
+		// a triangle laid flat in its own rectangle of the atlas
+		struct Chart {
+			glm::ivec2 origin;
+			glm::ivec2 size;
+			// corners in atlas texels
+			glm::vec2 corners[3];
+		};
+
+		LightmapSettings _settings;
+		std::vector<BakedLight> _lights;
+
+		TriangleBvh _occluders;
+
+		// the target, one entry per unwelded vertex, charts in triangle order
+		std::vector<glm::vec3> _positions;
+		std::vector<glm::vec3> _normals;
+		std::vector<glm::vec3> _faceNormals;
+		std::vector<Chart> _charts;
+		int _width;
+		int _height;
+		std::vector<glm::uint64> _texels;
+
+		static glm::vec3 SafeNormalize(glm::vec3 v, glm::vec3 fallback) {
+			float length = glm::length(v);
+			return length > 1e-12f ? v / length : fallback;
+		}
+
+		static float Random(unsigned int& state) {
+			state ^= state << 13;
+			state ^= state >> 17;
+			state ^= state << 5;
+			return (state >> 8) * (1.0f / 16777216.0f);
+		}
+
+		// Shelf packing, the charts go in by decreasing height. Fails when the atlas is too small for this density
+		bool Pack(const std::vector<glm::vec2>& flat, const std::vector<int>& order, float density) {
+			int width = _settings.atlasSize;
+			int x = 0, y = 0, shelfHeight = 0;
+			for (int k = 0; k < order.size(); k++) {
+				int t = order[k];
+				glm::vec2 extent = glm::max(flat[t * 3], glm::max(flat[t * 3 + 1], flat[t * 3 + 2])) * density;
+				// bilinear filtering reads one texel past the ones the triangle covers
+				glm::ivec2 size = glm::ivec2(glm::floor(extent)) + 1 + 2 * Padding;
+				if (x + size.x > width) {
+					x = 0;
+					y += shelfHeight;
+					shelfHeight = 0;
+				}
+				if (size.x > width || y + size.y > width) return false;
+				Chart& chart = _charts[t];
+				chart.origin = glm::ivec2(x, y);
+				chart.size = size;
+				for (int c = 0; c < 3; c++) chart.corners[c] = glm::vec2(x + Padding, y + Padding) + flat[t * 3 + c] * density;
+				x += size.x;
+				shelfHeight = glm::max(shelfHeight, size.y);
+			}
+			_width = width;
+			_height = 1;
+			while (_height < y + shelfHeight) _height *= 2;
+			return true;
+		}
+
+		// False when even the smallest charts don't fit in the atlas
+		bool Layout(Model* model, const glm::mat4& modelMatrix) {
+			int nVertices = model->GetNVertices();
+			int nTriangles = nVertices / 3;
+			Vertex* vertices = model->GetVertices();
+			glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(modelMatrix)));
+			_positions.resize(nVertices);
+			_normals.resize(nVertices);
+			_faceNormals.resize(nTriangles);
+			_charts.resize(nTriangles);
+
+			// every triangle flattened in its own plane, in world units and moved to positive coordinates
+			std::vector<glm::vec2> flat(nVertices);
+			for (int t = 0; t < nTriangles; t++) {
+				for (int c = 0; c < 3; c++) {
+					_positions[t * 3 + c] = glm::vec3(modelMatrix * glm::vec4(vertices[t * 3 + c].coord, 1));
+					_normals[t * 3 + c] = SafeNormalize(normalMatrix * vertices[t * 3 + c].normal, glm::vec3(0, 1, 0));
+				}
+				glm::vec3 a = _positions[t * 3], b = _positions[t * 3 + 1], c = _positions[t * 3 + 2];
+				glm::vec3 faceNormal = SafeNormalize(glm::cross(b - a, c - a), _normals[t * 3]);
+				// the offset side of the ray origins follows the shading normal
+				glm::vec3 shadingNormal = _normals[t * 3] + _normals[t * 3 + 1] + _normals[t * 3 + 2];
+				_faceNormals[t] = glm::dot(faceNormal, shadingNormal) < 0 ? -faceNormal : faceNormal;
+
+				glm::vec3 u = SafeNormalize(b - a, glm::vec3(1, 0, 0));
+				glm::vec3 w = SafeNormalize(glm::cross(faceNormal, u), glm::vec3(0, 0, 1));
+				flat[t * 3] = glm::vec2(0);
+				flat[t * 3 + 1] = glm::vec2(glm::dot(b - a, u), glm::dot(b - a, w));
+				flat[t * 3 + 2] = glm::vec2(glm::dot(c - a, u), glm::dot(c - a, w));
+				glm::vec2 lower = glm::min(flat[t * 3], glm::min(flat[t * 3 + 1], flat[t * 3 + 2]));
+				for (int k = 0; k < 3; k++) flat[t * 3 + k] -= lower;
+			}
+
+			std::vector<int> order(nTriangles);
+			for (int t = 0; t < nTriangles; t++) order[t] = t;
+			std::sort(order.begin(), order.end(), [&](int a, int b) {
+				float heightA = glm::max(flat[a * 3].y, glm::max(flat[a * 3 + 1].y, flat[a * 3 + 2].y));
+				float heightB = glm::max(flat[b * 3].y, glm::max(flat[b * 3 + 1].y, flat[b * 3 + 2].y));
+				return heightA > heightB;
+			});
+			for (float density = _settings.texelsPerUnit; density > 1e-4f; density *= 0.9f) {
+				if (Pack(flat, order, density)) return true;
+			}
+			return false;
+		}
+
+		// Barycentric weights of p in the chart, the padding texels outside take the closest point of the triangle
+		static glm::vec3 ChartWeights(const Chart& chart, glm::vec2 p) {
+			const glm::vec2* corners = chart.corners;
+			glm::vec2 v0 = corners[1] - corners[0], v1 = corners[2] - corners[0], v2 = p - corners[0];
+			float d00 = glm::dot(v0, v0), d01 = glm::dot(v0, v1), d11 = glm::dot(v1, v1);
+			float d20 = glm::dot(v2, v0), d21 = glm::dot(v2, v1);
+			float denominator = d00 * d11 - d01 * d01;
+			if (denominator > 1e-12f) {
+				float v = (d11 * d20 - d01 * d21) / denominator;
+				float w = (d00 * d21 - d01 * d20) / denominator;
+				if (v >= 0 && w >= 0 && v + w <= 1) return glm::vec3(1 - v - w, v, w);
+			}
+			glm::vec3 best = glm::vec3(1, 0, 0);
+			float bestDistance = FLT_MAX;
+			for (int i = 0; i < 3; i++) {
+				int j = (i + 1) % 3;
+				glm::vec2 edge = corners[j] - corners[i];
+				float length2 = glm::dot(edge, edge);
+				float s = length2 > 0 ? glm::clamp(glm::dot(p - corners[i], edge) / length2, 0.0f, 1.0f) : 0.0f;
+				glm::vec2 closest = corners[i] + edge * s;
+				float distance = glm::dot(p - closest, p - closest);
+				if (distance < bestDistance) {
+					bestDistance = distance;
+					best = glm::vec3(0);
+					best[i] = 1 - s;
+					best[j] = s;
+				}
+			}
+			return best;
+		}
+
+		glm::vec4 BakeTexel(glm::vec3 position, glm::vec3 normal, glm::vec3 faceNormal, unsigned int seed) const {
+			glm::vec3 origin = position + faceNormal * _settings.bias;
+
+			glm::vec3 tangent = SafeNormalize(glm::cross(glm::abs(normal.y) < 0.99f ? glm::vec3(0, 1, 0) : glm::vec3(1, 0, 0), normal), glm::vec3(1, 0, 0));
+			glm::vec3 bitangent = glm::cross(normal, tangent);
+			int hits = 0;
+			for (int s = 0; s < _settings.aoSamples; s++) {
+				float r1 = Random(seed), r2 = Random(seed);
+				float radius = glm::sqrt(r1);
+				float angle = 6.28318530718f * r2;
+				glm::vec3 direction = tangent * (radius * glm::cos(angle)) + bitangent * (radius * glm::sin(angle)) + normal * glm::sqrt(glm::max(0.0f, 1 - r1));
+				if (_occluders.Occluded(origin, direction, _settings.aoDistance)) hits++;
+			}
+			float ao = _settings.aoSamples > 0 ? 1 - (float)hits / _settings.aoSamples : 1;
+
+			// the same terms as the diffuse part of the lit shaders, without the specular which depends on the view
+			glm::vec3 irradiance = glm::vec3(0);
+			for (int i = 0; i < _lights.size(); i++) {
+				const BakedLight& light = _lights[i];
+				if (light.type == BakedAmbient) {
+					irradiance += light.color * ao;
+				} else if (light.type == BakedDirectional) {
+					float lambert = glm::dot(normal, -light.direction);
+					if (lambert > 0 && !_occluders.Occluded(origin, -light.direction, FLT_MAX)) irradiance += light.color * lambert;
+				} else {
+					glm::vec3 toLight = light.position - position;
+					float distance = glm::length(toLight);
+					if (distance <= 0) continue;
+					float lambert = glm::dot(normal, toLight / distance) * glm::max(0.0f, 1 - distance / light.range);
+					if (lambert <= 0) continue;
+					if (light.type == BakedSpot) {
+						glm::vec4 p = light.shadowMatrix * glm::vec4(position, 1);
+						glm::vec3 q = glm::vec3(p) / p.w;
+						if (p.w <= 0 || q.x < 0 || q.x > 1 || q.y < 0 || q.y > 1 || q.z < 0 || q.z > 1) continue;
+					}
+					if (!_occluders.Occluded(origin, toLight / distance, distance)) irradiance += light.color * lambert;
+				}
+			}
+			return glm::vec4(irradiance, ao);
+		}
+
+		// Charts own disjoint rectangles, the workers never write the same texel
+		void BakeChart(int t) {
+			const Chart& chart = _charts[t];
+			for (int y = 0; y < chart.size.y; y++) {
+				for (int x = 0; x < chart.size.x; x++) {
+					glm::ivec2 texel = chart.origin + glm::ivec2(x, y);
+					glm::vec3 weights = ChartWeights(chart, glm::vec2(texel) + 0.5f);
+					glm::vec3 position = weights.x * _positions[t * 3] + weights.y * _positions[t * 3 + 1] + weights.z * _positions[t * 3 + 2];
+					glm::vec3 normal = SafeNormalize(weights.x * _normals[t * 3] + weights.y * _normals[t * 3 + 1] + weights.z * _normals[t * 3 + 2], _faceNormals[t]);
+					int index = texel.y * _width + texel.x;
+					// seeded by texel, the result doesn't depend on which thread got the chart
+					unsigned int seed = ((unsigned int)index * 2654435761u) | 1u;
+					_texels[index] = glm::packHalf4x16(BakeTexel(position, normal, _faceNormals[t], seed));
+				}
+			}
+		}
+
+		void Trace() {
+			_texels.assign((size_t)_width * _height, 0);
+			int nThreads = _settings.threads > 0 ? _settings.threads : (int)std::thread::hardware_concurrency();
+			nThreads = glm::max(nThreads, 1);
+			std::atomic<int> next(0);
+			std::vector<std::thread> workers;
+			for (int i = 0; i < nThreads; i++) {
+				workers.push_back(std::thread([this, &next]() {
+					int t;
+					while ((t = next++) < (int)_charts.size()) BakeChart(t);
+				}));
+			}
+			for (int i = 0; i < workers.size(); i++) workers[i].join();
+		}
+
+		// Covers everything the texels depend on, a cache with another fingerprint is traced again. The thread count is left
+		// out, it does not change the result, and so is the struct padding
+		unsigned long long Fingerprint() const {
+			unsigned long long hash = 14695981039346656037ull;
+			hash = TriangleBvh::HashBytes(hash, &_settings.atlasSize, sizeof(int));
+			hash = TriangleBvh::HashBytes(hash, &_settings.texelsPerUnit, sizeof(float));
+			hash = TriangleBvh::HashBytes(hash, &_settings.aoSamples, sizeof(int));
+			hash = TriangleBvh::HashBytes(hash, &_settings.aoDistance, sizeof(float));
+			hash = TriangleBvh::HashBytes(hash, &_settings.bias, sizeof(float));
+			if (!_lights.empty()) hash = TriangleBvh::HashBytes(hash, _lights.data(), sizeof(BakedLight) * _lights.size());
+			hash = _occluders.Hash(hash);
+			if (!_positions.empty()) {
+				hash = TriangleBvh::HashBytes(hash, _positions.data(), sizeof(glm::vec3) * _positions.size());
+				hash = TriangleBvh::HashBytes(hash, _normals.data(), sizeof(glm::vec3) * _normals.size());
+			}
+			hash = TriangleBvh::HashBytes(hash, &_width, sizeof(int));
+			hash = TriangleBvh::HashBytes(hash, &_height, sizeof(int));
+			return hash;
+		}
+
+		bool Load(const char* path, unsigned long long fingerprint) {
+			FILE* fp;
+			if (fopen_s(&fp, path, "rb") != 0 || !fp) return false;
+			unsigned int magic = 0;
+			unsigned long long savedFingerprint = 0;
+			bool valid = fread(&magic, sizeof(magic), 1, fp) == 1 && magic == CacheMagic &&
+				fread(&savedFingerprint, sizeof(savedFingerprint), 1, fp) == 1 && savedFingerprint == fingerprint;
+			if (valid) {
+				_texels.resize((size_t)_width * _height);
+				valid = fread(_texels.data(), sizeof(glm::uint64), _texels.size(), fp) == _texels.size();
+			}
+			fclose(fp);
+			return valid;
+		}
+
+		void Save(const char* path, unsigned long long fingerprint) {
+			FILE* fp;
+			if (fopen_s(&fp, path, "wb") != 0 || !fp) {
+				printf("WARNING: Cannot write the lightmap cache %s\n", path);
+				return;
+			}
+			unsigned int magic = CacheMagic;
+			fwrite(&magic, sizeof(magic), 1, fp);
+			fwrite(&fingerprint, sizeof(fingerprint), 1, fp);
+			fwrite(_texels.data(), sizeof(glm::uint64), _texels.size(), fp);
+			fclose(fp);
+		}
+
+		GLuint Upload() {
+			GLuint texture;
+			glGenTextures(1, &texture);
+			GLStateCache::Instance()->BindTexture(0, GL_TEXTURE_2D, texture);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, _width, _height, 0, GL_RGBA, GL_HALF_FLOAT, _texels.data());
+			// no mipmaps, they would blend neighbouring charts together
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+			return texture;
+		}
+
+		BakedLight NewLight(BakedLightType type, Light* light) {
+			BakedLight baked = BakedLight();
+			baked.type = type;
+			baked.color = light->GetColor() * light->GetIntensity();
+			baked.shadowMatrix = glm::mat4(1);
+			return baked;
+		}
+
+	public:
+		LightmapBaker(LightmapSettings settings = LightmapSettings()) {
+			_settings = settings;
+			_width = 0;
+			_height = 0;
+		}
+
+		// Geometry that blocks the rays, with its current transform. The target usually is one of the occluders
+		void AddOccluder(Object3D* object) {
+			_occluders.AddObject(object);
+		}
+
+		// Lights are read when added, mark them baked on the renderer side so they are not applied twice
+		void AddLight(AmbientLight* light) {
+			_lights.push_back(NewLight(BakedAmbient, light));
+		}
+
+		void AddLight(DirectionalLight3D* light) {
+			BakedLight baked = NewLight(BakedDirectional, light);
+			baked.direction = glm::normalize(light->GlobalForward());
+			_lights.push_back(baked);
+		}
+
+		void AddLight(PointLight3D* light) {
+			BakedLight baked = NewLight(BakedPoint, light);
+			baked.position = light->GetGlobalPosition();
+			baked.range = light->GetRange();
+			_lights.push_back(baked);
+		}
+
+		void AddLight(SpotLight3D* light) {
+			BakedLight baked = NewLight(BakedSpot, light);
+			baked.position = light->GetGlobalPosition();
+			baked.range = light->GetRange();
+			baked.shadowMatrix = light->GetShadow();
+			_lights.push_back(baked);
+		}
+
+		// Gives the target lightmap coordinates and its lightmap. Runs before the object is added to the renderer,
+		// the model is unwelded and its buffers have to be created afterwards
+		bool Bake(Object3D* target, const char* cachePath = NULL) {
+			Model* model = target->GetModel();
+			if (model == NULL) return false;
+			model->Unweld();
+			if (!Layout(model, target->GetModelMatrix())) {
+				printf("ERROR: Too many triangles for a %d texels lightmap\n", _settings.atlasSize);
+				return false;
+			}
+			glm::vec2* coords = new glm::vec2[model->GetNVertices()];
+			for (int t = 0; t < _charts.size(); t++) {
+				for (int c = 0; c < 3; c++) coords[t * 3 + c] = _charts[t].corners[c] / glm::vec2(_width, _height);
+			}
+			model->SetLightmapCoords(coords);
+
+			unsigned long long fingerprint = Fingerprint();
+			if (cachePath == NULL || !Load(cachePath, fingerprint)) {
+				printf("Baking lightmap: %d charts, %dx%d texels\n", (int)_charts.size(), _width, _height);
+				_occluders.Build();
+				Trace();
+				if (cachePath != NULL) Save(cachePath, fingerprint);
+			}
+
+			GLuint texture = 0;
+			GLTaskQueue::Instance()->Run([&]() { texture = Upload(); });
+			target->SetLightmap(texture);
+			return true;
+		}
+	};
+}
\ No newline at end of file
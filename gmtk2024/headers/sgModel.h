@@ -2,6 +2,10 @@
 
 #include <unordered_map>
 #include <string>
+#include <vector>
+#include <algorithm>
+#include <cfloat>
+#include <glm/glm/gtc/constants.hpp>
 #include <sgStructures.h>
 
 namespace sg {
@@ -16,10 +20,20 @@ namespace sg {
 		Mesh* _meshes;
 		glm::vec3 _lowerBound;
 		glm::vec3 _upperBound;
+		GLuint _vao;
 		GLuint _vbo;
+		GLuint _ebo;
+		GLuint _depthVao;
+		GLuint _positionVbo;
+		unsigned int _nIndices;
+		// second texture coordinate set, one per vertex, only for lightmapped models
+		glm::vec2* _lightmapCoords;
+		GLuint _lightmapVbo;
+		// empty unless BuildClusters ran
+		std::vector<MeshCluster> _clusters;
 
 	public:
-		Model() { _nVertices = 0; _nMeshes = 0; _nMaterials = 0; _vertices = NULL;  _meshes = NULL;  _materials = NULL; _vbo = -1; }
+		Model() { _nVertices = 0; _nMeshes = 0; _nMaterials = 0; _vertices = NULL;  _meshes = NULL;  _materials = NULL; _vao = -1; _vbo = -1; _ebo = -1; _depthVao = -1; _positionVbo = -1; _nIndices = 0; _lightmapCoords = NULL; _lightmapVbo = -1; }
 		unsigned int GetNVertices() { return _nVertices; }
 		unsigned int GetNMaterials() { return _nMaterials; }
 		unsigned int GetNMeshes() { return _nMeshes; }
@@ -59,24 +73,205 @@ namespace sg {
 			_nMeshes = nMeshes;
 		}
 		bool LoadFromObj(char const* filename, bool invertYZ = false);
-		void SetVBO(GLuint vao) {
-			if (_vbo == -1) {
-				glBindVertexArray(vao);
-				glGenBuffers(1, &_vbo);
-				glBindBuffer(GL_ARRAY_BUFFER, _vbo);
-				glBufferData(GL_ARRAY_BUFFER, sizeof(sg::Vertex) * _nVertices, _vertices, GL_STATIC_DRAW);
+		unsigned int GetNTriangles() {
+			unsigned int nTriangles = 0;
+			for (int i = 0; i < _nMeshes; i++) nTriangles += _meshes[i].nTriangles;
+			return nTriangles;
+		}
+		// Gives every triangle its own three vertices, in mesh order: triangle t ends up with vertices 3t, 3t+1 and 3t+2.
+		// Lightmap charts are cut per triangle so shared vertices can't keep a single lightmap coordinate.
+		// Has to run before InitBuffers
+		void Unweld() {
+			unsigned int nVertices = GetNTriangles() * 3;
+			Vertex* vertices = new Vertex[nVertices];
+			unsigned int k = 0;
+			for (int i = 0; i < _nMeshes; i++) {
+				for (int t = 0; t < _meshes[i].nTriangles; t++) {
+					for (int c = 0; c < 3; c++) {
+						vertices[k] = _vertices[_meshes[i].triangles[t].index[c]];
+						_meshes[i].triangles[t].index[c] = k++;
+					}
+				}
+			}
+			delete[] _vertices;
+			_vertices = vertices;
+			_nVertices = nVertices;
+		}
+		// Takes ownership of one coordinate per vertex, has to run before InitBuffers
+		void SetLightmapCoords(glm::vec2* coords) {
+			delete[] _lightmapCoords;
+			_lightmapCoords = coords;
+		}
+		bool HasLightmapCoords() {
+			return _lightmapCoords != NULL;
+		}
+		// Cuts every mesh into clusters of at most maxTriangles by splitting its triangles at the median along the longest axis,
+		// the triangles of a mesh are reordered so every cluster is one index range. For big static meshes, has to run before InitBuffers
+		void BuildClusters(int maxTriangles) {
+			_clusters.clear();
+			for (int m = 0; m < _nMeshes; m++) {
+				Mesh& mesh = _meshes[m];
+				std::vector<int> order(mesh.nTriangles);
+				std::vector<glm::vec3> centroids(mesh.nTriangles);
+				for (int t = 0; t < mesh.nTriangles; t++) {
+					order[t] = t;
+					const unsigned int* index = mesh.triangles[t].index;
+					centroids[t] = (_vertices[index[0]].coord + _vertices[index[1]].coord + _vertices[index[2]].coord) / 3.0f;
+				}
+				SplitCluster(m, order, centroids, 0, mesh.nTriangles, maxTriangles);
+				std::vector<Triangle> sorted(mesh.nTriangles);
+				for (int t = 0; t < mesh.nTriangles; t++) sorted[t] = mesh.triangles[order[t]];
+				std::copy(sorted.begin(), sorted.end(), mesh.triangles);
 			}
+			for (int c = 0; c < _clusters.size(); c++) FitCluster(_clusters[c]);
+		}
+		const std::vector<MeshCluster>& GetClusters() {
+			return _clusters;
+		}
+		void InitBuffers() {
+			if (_vao != -1) return;
+			GLTaskQueue::Instance()->Run([this]() { CreateBuffers(); });
+		}
+		void CreateBuffers() {
+			glGenVertexArrays(1, &_vao);
+			GLStateCache::Instance()->BindVertexArray(_vao);
+
+			glGenBuffers(1, &_vbo);
+			GLStateCache::Instance()->BindBuffer(GL_ARRAY_BUFFER, _vbo);
+			glBufferData(GL_ARRAY_BUFFER, sizeof(sg::Vertex) * _nVertices, _vertices, GL_STATIC_DRAW);
+			glEnableVertexAttribArray(0);
+			glEnableVertexAttribArray(1);
+			glEnableVertexAttribArray(2);
+			glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(sg::Vertex), (GLvoid*)0);
+			glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(sg::Vertex), (GLvoid*)(sizeof(float) * 3));
+			glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(sg::Vertex), (GLvoid*)(sizeof(float) * 5));
+
+			if (_lightmapCoords != NULL) {
+				glGenBuffers(1, &_lightmapVbo);
+				GLStateCache::Instance()->BindBuffer(GL_ARRAY_BUFFER, _lightmapVbo);
+				glBufferData(GL_ARRAY_BUFFER, sizeof(glm::vec2) * _nVertices, _lightmapCoords, GL_STATIC_DRAW);
+				glEnableVertexAttribArray(3);
+				glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, sizeof(glm::vec2), (GLvoid*)0);
+			}
+
+			// all meshes share one index buffer, each one remembers where its range starts
+			_nIndices = 0;
+			for (int i = 0; i < _nMeshes; i++) {
+				_meshes[i].firstIndex = _nIndices;
+				_nIndices += _meshes[i].nTriangles * 3;
+			}
+			glGenBuffers(1, &_ebo);
+			GLStateCache::Instance()->BindBuffer(GL_ELEMENT_ARRAY_BUFFER, _ebo);
+			glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(unsigned int) * _nIndices, NULL, GL_STATIC_DRAW);
+			for (int i = 0; i < _nMeshes; i++) {
+				glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, sizeof(unsigned int) * _meshes[i].firstIndex, sizeof(sg::Triangle) * _meshes[i].nTriangles, _meshes[i].triangles);
+			}
+
+			InitDepthBuffers();
+
+			GLStateCache::Instance()->BindVertexArray(0);
+		}
+		// Position-only stream sharing the index buffer, used by the depth passes.
+		// The meshes are contiguous in the index buffer so the whole model is drawn as a single range
+		void InitDepthBuffers() {
+			glm::vec3* positions = new glm::vec3[_nVertices];
+			for (int i = 0; i < _nVertices; i++) positions[i] = _vertices[i].coord;
+
+			glGenVertexArrays(1, &_depthVao);
+			GLStateCache::Instance()->BindVertexArray(_depthVao);
+
+			glGenBuffers(1, &_positionVbo);
+			GLStateCache::Instance()->BindBuffer(GL_ARRAY_BUFFER, _positionVbo);
+			glBufferData(GL_ARRAY_BUFFER, sizeof(glm::vec3) * _nVertices, positions, GL_STATIC_DRAW);
+			glEnableVertexAttribArray(0);
+			glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (GLvoid*)0);
+			GLStateCache::Instance()->BindBuffer(GL_ELEMENT_ARRAY_BUFFER, _ebo);
+
+			delete[] positions;
+		}
+		GLuint GetVAO() {
+			return _vao;
 		}
 		GLuint GetVBO() {
 			return _vbo;
 		}
+		GLuint GetEBO() {
+			return _ebo;
+		}
+		GLuint GetDepthVAO() {
+			return _depthVao;
+		}
+		unsigned int GetNIndices() {
+			return _nIndices;
+		}
 		void Destroy() {
+			if (_vao != -1) {
+				GLTaskQueue::Instance()->Run([this]() {
+					GLStateCache::Instance()->DeleteVertexArrays(1, &_vao);
+					GLStateCache::Instance()->DeleteBuffers(1, &_vbo);
+					GLStateCache::Instance()->DeleteBuffers(1, &_ebo);
+					GLStateCache::Instance()->DeleteVertexArrays(1, &_depthVao);
+					GLStateCache::Instance()->DeleteBuffers(1, &_positionVbo);
+					if (_lightmapVbo != -1) GLStateCache::Instance()->DeleteBuffers(1, &_lightmapVbo);
+				});
+				_vao = _vbo = _ebo = _depthVao = _positionVbo = _lightmapVbo = -1;
+			}
+			delete[] _lightmapCoords;
+			_lightmapCoords = NULL;
 			delete(_vertices);
 			delete(_meshes);
 			delete(_materials);
 		}
 
 	private:
+		void SplitCluster(int mesh, std::vector<int>& order, const std::vector<glm::vec3>& centroids, int begin, int end, int maxTriangles) {
+			if (end - begin <= maxTriangles) {
+				if (end == begin) return;
+				MeshCluster cluster;
+				cluster.mesh = mesh;
+				cluster.firstTriangle = begin;
+				cluster.nTriangles = end - begin;
+				_clusters.push_back(cluster);
+				return;
+			}
+			glm::vec3 low(FLT_MAX), high(-FLT_MAX);
+			for (int i = begin; i < end; i++) {
+				low = glm::min(low, centroids[order[i]]);
+				high = glm::max(high, centroids[order[i]]);
+			}
+			glm::vec3 size = high - low;
+			int axis = size.x > size.y ? (size.x > size.z ? 0 : 2) : (size.y > size.z ? 1 : 2);
+			int middle = (begin + end) / 2;
+			std::nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end, [&](int a, int b) { return centroids[a][axis] < centroids[b][axis]; });
+			SplitCluster(mesh, order, centroids, begin, middle, maxTriangles);
+			SplitCluster(mesh, order, centroids, middle, end, maxTriangles);
+		}
+		// Box and normal cone of the triangles the cluster ended up with, degenerate triangles have no say in the cone
+		void FitCluster(MeshCluster& cluster) {
+			const Mesh& mesh = _meshes[cluster.mesh];
+			cluster.boundsMin = glm::vec3(FLT_MAX);
+			cluster.boundsMax = glm::vec3(-FLT_MAX);
+			std::vector<glm::vec3> normals;
+			glm::vec3 axis(0);
+			for (int t = cluster.firstTriangle; t < cluster.firstTriangle + cluster.nTriangles; t++) {
+				const unsigned int* index = mesh.triangles[t].index;
+				glm::vec3 a = _vertices[index[0]].coord, b = _vertices[index[1]].coord, c = _vertices[index[2]].coord;
+				cluster.boundsMin = glm::min(cluster.boundsMin, glm::min(a, glm::min(b, c)));
+				cluster.boundsMax = glm::max(cluster.boundsMax, glm::max(a, glm::max(b, c)));
+				glm::vec3 normal = glm::cross(b - a, c - a);
+				float length = glm::length(normal);
+				if (length < 1e-12f) continue;
+				normals.push_back(normal / length);
+				axis += normal / length;
+			}
+			cluster.coneAxis = glm::vec3(0, 1, 0);
+			cluster.coneAngle = glm::pi<float>();
+			if (normals.empty() || glm::length(axis) < 1e-3f) return;
+			cluster.coneAxis = glm::normalize(axis);
+			float minDot = 1;
+			for (int i = 0; i < normals.size(); i++) minDot = glm::min(minDot, glm::dot(normals[i], cluster.coneAxis));
+			cluster.coneAngle = glm::acos(glm::clamp(minDot, -1.0f, 1.0f));
+		}
 		void ClearData() { delete(_vertices); delete(_meshes); delete(_materials); _nVertices = 0; ; _nMaterials = 0; _nMeshes = 0; _lowerBound = glm::vec3(5000000); _upperBound = glm::vec3(-5000000); }
 		bool ReadMaterial(char const* folder, char const* filename);
 		void SeparateFolderFromFilename(char** folder, char const** filename) {
@@ -2,23 +2,61 @@
 #include <sgEntity3D.h>
 #include <sgModel.h>
 #include <sgTextureManager.h>
+#include <sgRenderSnapshot.h>
 
 namespace sg {
 	class Object3D : public Entity3D {
 	private:
+		static unsigned int _nextId;
+		unsigned int _id;
 		Model* _model3D = NULL;
 		Material* _materials = NULL;
 		unsigned int _nMaterials;
 		int _patches;
+		// rebuilt with the world bounds when the transform changed, see Entity3D::UpdateWorld
 		glm::mat4 _modelMatrix;
+		glm::vec3 _worldCenter;
+		glm::vec3 _worldExtents;
 		bool _copiedModel;
+		glm::mat4 _snapshotMatrix;
+		bool _snapshotStatic;
+		bool _snapshotCasts;
+		GLuint _lightmap;
+		// clusters of the model in world space, redone when the model matrix changes
+		std::vector<ClusterDraw> _clusterDraws;
+		glm::mat4 _clusterMatrix;
 
-		bool FrustumCheck(sg::Frustum frustum) {
+		void UpdateClusterDraws() {
+			const std::vector<MeshCluster>& clusters = _model3D->GetClusters();
+			if (_clusterDraws.size() == clusters.size() && _clusterMatrix == _modelMatrix) return;
+			_clusterMatrix = _modelMatrix;
+			_clusterDraws.resize(clusters.size());
+			glm::mat3 linear = glm::mat3(_modelMatrix);
+			glm::mat3 absolute = glm::mat3(glm::abs(linear[0]), glm::abs(linear[1]), glm::abs(linear[2]));
+			// a non uniform scale bends the normals, the cones would no longer hold them
+			float scaleX = glm::length(linear[0]), scaleY = glm::length(linear[1]), scaleZ = glm::length(linear[2]);
+			bool uniform = glm::abs(scaleX - scaleY) <= 1e-3f * scaleX && glm::abs(scaleX - scaleZ) <= 1e-3f * scaleX;
+			for (int i = 0; i < clusters.size(); i++) {
+				const MeshCluster& cluster = clusters[i];
+				ClusterDraw& draw = _clusterDraws[i];
+				draw.firstIndex = _model3D->GetMeshAt(cluster.mesh).firstIndex + cluster.firstTriangle * 3;
+				draw.nTriangles = cluster.nTriangles;
+				draw.mesh = cluster.mesh;
+				draw.center = glm::vec3(_modelMatrix * glm::vec4((cluster.boundsMin + cluster.boundsMax) * 0.5f, 1));
+				draw.extents = absolute * ((cluster.boundsMax - cluster.boundsMin) * 0.5f);
+				draw.coneAxis = glm::normalize(linear * cluster.coneAxis);
+				draw.coneAngle = uniform ? cluster.coneAngle : glm::pi<float>();
+				draw.potentiallyVisible = true;
+			}
+		}
+
+		// World space box around the model, the extents follow the object orientation
+		void GetWorldBounds(glm::vec3& globalCenter, glm::vec3& globalExtents) {
 			glm::vec3 center = _model3D->GetBoundingBoxCenter();
 			glm::vec3 extents = _model3D->GetBoundingBoxUpper() - center;
 
 			//Get global scale thanks to our transform
-			const glm::vec3 globalCenter{ _modelMatrix * glm::vec4(center, 1.f) };
+			globalCenter = glm::vec3(_modelMatrix * glm::vec4(center, 1.f));
 
 			// Scaled orientation
 			const glm::vec3 right = LocalRight() * extents.x;
@@ -29,20 +67,7 @@ namespace sg {
 			const float newIj = std::abs(right.y) + std::abs(up.y) + std::abs(forward.y);
 			const float newIk = std::abs(right.z) + std::abs(up.z) + std::abs(forward.z);
 
-			glm::vec3 globalExtents = {newIi, newIj, newIk};
-			return (isOnOrForwardPlane(frustum.leftFace, globalCenter, globalExtents) &&
-				isOnOrForwardPlane(frustum.rightFace, globalCenter, globalExtents) &&
-				isOnOrForwardPlane(frustum.topFace, globalCenter, globalExtents) &&
-				isOnOrForwardPlane(frustum.bottomFace, globalCenter, globalExtents) &&
-				isOnOrForwardPlane(frustum.nearFace, globalCenter, globalExtents) &&
-				isOnOrForwardPlane(frustum.farFace, globalCenter, globalExtents));
-		}
-
-		bool isOnOrForwardPlane(const Plane& plane, glm::vec3 center, glm::vec3 extents) const
-		{
-			// Compute the projection interval radius of b onto L(t) = b.c + t * p.n
-			const float r = glm::dot(extents, glm::abs(plane.normal));
-			return -r <= glm::dot(plane.normal, center) - plane.distance;
+			globalExtents = { newIi, newIj, newIk };
 		}
 
 		void CopyMaterialsFromModel() {
@@ -53,14 +78,17 @@ namespace sg {
 			}
 		}
 
-		glm::mat4 BuildRotationMatrix() {
-			return glm::inverse(glm::lookAt(glm::vec3(0), GlobalForward(), GlobalUp()));
+		void BuildModelMatrix() {
+			const Transform& global = GetGlobalTransform();
+			_modelMatrix = glm::translate(global.position)
+				* glm::mat4_cast(global.rotation)
+				* glm::scale(global.scale);
 		}
 
-		void BuildModelMatrix() {
-			_modelMatrix = glm::translate(GetGlobalPosition())
-				* BuildRotationMatrix()
-				* glm::scale(_globalTransform.scale);
+	protected:
+		void RebuildWorld() override {
+			BuildModelMatrix();
+			if (_model3D != NULL) GetWorldBounds(_worldCenter, _worldExtents);
 		}
 
 	public:
@@ -68,9 +96,13 @@ namespace sg {
 		bool ReceivesShadows;
 		bool Lit;
 		bool PerformFrustumCheck;
+		// Static casters are kept in the cached shadow maps until one of them changes
+		bool Static;
 
 		Object3D() : Entity3D() {
 			_modelMatrix = glm::mat4(1);
+			_worldCenter = glm::vec3(0);
+			_worldExtents = glm::vec3(0);
 			_model3D = NULL;
 			_patches = 0;
 			_copiedModel = false;
@@ -78,10 +110,19 @@ namespace sg {
 			ReceivesShadows = false;
 			Lit = false;
 			PerformFrustumCheck = true;
+			Static = false;
+			_snapshotStatic = false;
+			_snapshotCasts = false;
+			_lightmap = 0;
+			_id = _nextId++;
+		}
+
+		unsigned int GetId() {
+			return _id;
 		}
 
 		glm::mat4 GetModelMatrix() {
-			BuildModelMatrix();
+			UpdateWorld();
 			return _modelMatrix;
 		}
 
@@ -89,6 +130,8 @@ namespace sg {
 			_model3D = new Model();
 			if (_model3D->LoadFromObj(path)) {
 				CopyMaterialsFromModel();
+				// the world bounds follow the box of the model
+				_worldDirty = true;
 				return true;
 			}
 			return false;
@@ -98,17 +141,20 @@ namespace sg {
 			_model3D = new Model();
 			_model3D->InitFromVerticesAndTriangles(vertices, nVertices, triangles, nTriangles);
 			CopyMaterialsFromModel();
+			_worldDirty = true;
 		}
 
 		void LoadModelFromData(sg::Vertex vertices[], int nVertices, sg::Material materials[], int nMaterials, sg::Mesh meshes[], int nMeshes) {
 			_model3D = new Model();
 			_model3D->InitFromVerticesMaterialsAndMeshes(vertices, nVertices, materials, nMaterials, meshes, nMeshes);
 			CopyMaterialsFromModel();
+			_worldDirty = true;
 		}
 
 		void SetModel(sg::Model* model) {
 			_model3D = model;
 			CopyMaterialsFromModel();
+			_worldDirty = true;
 			_copiedModel = true;
 		}
 
@@ -152,30 +198,58 @@ namespace sg {
 			return _model3D;
 		}
 
-		void Draw(GLuint program, glm::mat4 vp, sg::Frustum frustum) {
-			BuildModelMatrix();
-			glm::mat4 mvp = vp * _modelMatrix;
-			if (!PerformFrustumCheck || FrustumCheck(frustum)) {
-				glUseProgram(program);
-				glUniformMatrix4fv(glGetUniformLocation(program, "mvp"), 1, false, glm::value_ptr(mvp));
-
-				glBindBuffer(GL_ARRAY_BUFFER, _model3D->GetVBO());
-				glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(sg::Vertex), (GLvoid*)0);
-				glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(sg::Vertex), (GLvoid*)(sizeof(float) * 3));
-				glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(sg::Vertex), (GLvoid*)(sizeof(float) * 5));
-				for (int i = 0; i < _model3D->GetNMeshes(); i++) {
-					sg::Mesh m = _model3D->GetMeshAt(i);
-					sg::TextureManager::Instance()->SetMaterialData(program, GetMaterialByName(m.materialName));
-					if (_patches > 0) {
-						glDrawArrays(GL_PATCHES, 0, _patches);
-					} else {
-						glDrawElements(GL_TRIANGLES, m.nTriangles * 3, GL_UNSIGNED_INT, m.triangles);
-					}
-				}
+		// Baked lighting of a static object, the model needs lightmap coordinates. The object owns the texture
+		void SetLightmap(GLuint texture) {
+			_lightmap = texture;
+		}
+
+		GLuint GetLightmap() {
+			return _lightmap;
+		}
+
+		// Copies what the renderer needs to draw this object, textures are loaded the first time.
+		// Returns true if the object changed in a way that invalidates the cached static shadows
+		bool FillSnapshot(ObjectSnapshot& snapshot) {
+			UpdateWorld();
+			snapshot.id = _id;
+			snapshot.vao = _model3D->GetVAO();
+			snapshot.depthVao = _model3D->GetDepthVAO();
+			snapshot.nIndices = _model3D->GetNIndices();
+			snapshot.patches = _patches;
+			snapshot.modelMatrix = _modelMatrix;
+			snapshot.center = _worldCenter;
+			snapshot.extents = _worldExtents;
+			snapshot.castsShadows = CastsShadows;
+			snapshot.receivesShadows = ReceivesShadows;
+			snapshot.lit = Lit;
+			snapshot.performFrustumCheck = PerformFrustumCheck;
+			snapshot.isStatic = Static;
+			snapshot.lightmap = _model3D->HasLightmapCoords() ? _lightmap : 0;
+
+			snapshot.meshes.resize(_model3D->GetNMeshes());
+			for (int i = 0; i < _model3D->GetNMeshes(); i++) {
+				sg::Mesh m = _model3D->GetMeshAt(i);
+				Material* material = GetMaterialByName(m.materialName);
+				sg::TextureManager::Instance()->SetTexturesData(material);
+				snapshot.meshes[i].firstIndex = m.firstIndex;
+				snapshot.meshes[i].nTriangles = m.nTriangles;
+				snapshot.meshes[i].material = *material;
 			}
+			UpdateClusterDraws();
+			snapshot.clusters = _clusterDraws;
+
+			bool staticChanged = (Static || _snapshotStatic) &&
+				(Static != _snapshotStatic || CastsShadows != _snapshotCasts || _modelMatrix != _snapshotMatrix);
+			_snapshotMatrix = _modelMatrix;
+			_snapshotStatic = Static;
+			_snapshotCasts = CastsShadows;
+			return staticChanged;
 		}
 
 		~Object3D() {
+			if (_lightmap != 0) {
+				GLTaskQueue::Instance()->Run([this]() { GLStateCache::Instance()->DeleteTextures(1, &_lightmap); });
+			}
 			if (!_copiedModel) {
 				if (_model3D) _model3D->Destroy();
 				delete(_model3D);
@@ -183,4 +257,6 @@ namespace sg {
 			free(_materials);
 		}
 	};
+
+	unsigned int Object3D::_nextId = 0;
 }
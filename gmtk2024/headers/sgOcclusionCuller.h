@@ -0,0 +1,288 @@
+#pragma once
+
+#include <glm/glm/glm.hpp>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cfloat>
+#include <sgObject3D.h>
+#include <sgFrustumCuller.h>
+
+namespace sg {
+	// Software occlusion culling: a simplified copy of the static occluders is rasterized on the CPU into a small depth buffer,
+	// then boxes are tested against a pyramid of its farthest depths. Needs no GPU and no readback, it runs where the draws are picked
+	class OcclusionCuller {
+	private:
+		// occluders in world space after simplification
+		std::vector<glm::vec3> _vertices;
+		std::vector<int> _indices;
+		// how far the simplified surfaces can be from the real ones, tested boxes grow by it so nothing is hidden by mistake
+		float _error;
+		// level 0 is the depth buffer, every level above keeps the farthest depth of 2x2 texels below it
+		std::vector<std::vector<float>> _levels;
+		std::vector<glm::ivec2> _sizes;
+		std::vector<glm::vec4> _clip;
+		glm::mat4 _viewProjection;
+		bool _rendered;
+
+		struct ScreenVertex {
+			float x;
+			float y;
+			float z;
+		};
+
+		ScreenVertex ToScreen(glm::vec4 clip) const {
+			ScreenVertex vertex;
+			vertex.x = (clip.x / clip.w * 0.5f + 0.5f) * _sizes[0].x;
+			vertex.y = (clip.y / clip.w * 0.5f + 0.5f) * _sizes[0].y;
+			vertex.z = glm::clamp(clip.z / clip.w * 0.5f + 0.5f, 0.0f, 1.0f);
+			return vertex;
+		}
+
+		// Keeps the nearest depth on the pixels whose center is inside the triangle, either winding
+		void RasterizeTriangle(ScreenVertex a, ScreenVertex b, ScreenVertex c) {
+			float area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+			if (glm::abs(area) < 1e-8f) return;
+			if (area < 0) {
+				std::swap(b, c);
+				area = -area;
+			}
+			int width = _sizes[0].x;
+			int height = _sizes[0].y;
+			int minX = glm::max((int)glm::floor(glm::min(a.x, glm::min(b.x, c.x))), 0);
+			int maxX = glm::min((int)glm::ceil(glm::max(a.x, glm::max(b.x, c.x))), width - 1);
+			int minY = glm::max((int)glm::floor(glm::min(a.y, glm::min(b.y, c.y))), 0);
+			int maxY = glm::min((int)glm::ceil(glm::max(a.y, glm::max(b.y, c.y))), height - 1);
+			if (minX > maxX || minY > maxY) return;
+
+			// edge e is A x + B y + C, positive on the inner side, and it weighs the depth of the vertex facing it
+			const ScreenVertex* from[3] = { &b, &c, &a };
+			const ScreenVertex* to[3] = { &c, &a, &b };
+			float edgeA[3], edgeB[3], edgeC[3];
+			float depthA = 0, depthB = 0, depthC = 0;
+			float facing[3] = { a.z, b.z, c.z };
+			for (int e = 0; e < 3; e++) {
+				edgeA[e] = from[e]->y - to[e]->y;
+				edgeB[e] = to[e]->x - from[e]->x;
+				edgeC[e] = -(edgeA[e] * from[e]->x + edgeB[e] * from[e]->y);
+				depthA += edgeA[e] * facing[e] / area;
+				depthB += edgeB[e] * facing[e] / area;
+				depthC += edgeC[e] * facing[e] / area;
+			}
+
+			std::vector<float>& depth = _levels[0];
+			// the width is a multiple of 4, spans start on one and never run past the row
+			minX &= ~3;
+			for (int y = minY; y <= maxY; y++) {
+				float py = y + 0.5f;
+				float* row = &depth[y * width];
+#if defined(SG_CULL_SSE2)
+				__m128 offsets = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+				__m128 e0Row = _mm_set1_ps(edgeB[0] * py + edgeC[0]), e0Step = _mm_set1_ps(edgeA[0]);
+				__m128 e1Row = _mm_set1_ps(edgeB[1] * py + edgeC[1]), e1Step = _mm_set1_ps(edgeA[1]);
+				__m128 e2Row = _mm_set1_ps(edgeB[2] * py + edgeC[2]), e2Step = _mm_set1_ps(edgeA[2]);
+				__m128 zRow = _mm_set1_ps(depthB * py + depthC), zStep = _mm_set1_ps(depthA);
+				__m128 zero = _mm_setzero_ps();
+				for (int x = minX; x <= maxX; x += 4) {
+					__m128 px = _mm_add_ps(_mm_set1_ps((float)x), offsets);
+					__m128 inside = _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(e0Step, px), e0Row), zero);
+					inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(e1Step, px), e1Row), zero));
+					inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(e2Step, px), e2Row), zero));
+					if (_mm_movemask_ps(inside) == 0) continue;
+					__m128 z = _mm_add_ps(_mm_mul_ps(zStep, px), zRow);
+					__m128 current = _mm_loadu_ps(row + x);
+					__m128 nearest = _mm_min_ps(current, z);
+					_mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearest), _mm_andnot_ps(inside, current)));
+				}
+#else
+				for (int x = minX; x <= maxX; x++) {
+					float px = x + 0.5f;
+					bool inside = true;
+					for (int e = 0; e < 3 && inside; e++) inside = edgeA[e] * px + edgeB[e] * py + edgeC[e] >= 0;
+					if (!inside) continue;
+					row[x] = glm::min(row[x], depthA * px + depthB * py + depthC);
+				}
+#endif
+			}
+		}
+
+		// Cuts the part in front of the near plane (z = -w) off, the rest is at most a quad
+		void ClipAndRasterize(glm::vec4 a, glm::vec4 b, glm::vec4 c) {
+			glm::vec4 corners[3] = { a, b, c };
+			glm::vec4 polygon[4];
+			int n = 0;
+			for (int i = 0; i < 3; i++) {
+				glm::vec4 current = corners[i];
+				glm::vec4 next = corners[(i + 1) % 3];
+				float dCurrent = current.z + current.w;
+				float dNext = next.z + next.w;
+				if (dCurrent >= 0) polygon[n++] = current;
+				if ((dCurrent >= 0) != (dNext >= 0)) polygon[n++] = glm::mix(current, next, dCurrent / (dCurrent - dNext));
+			}
+			if (n < 3) return;
+			ScreenVertex first = ToScreen(polygon[0]);
+			for (int i = 1; i + 1 < n; i++) RasterizeTriangle(first, ToScreen(polygon[i]), ToScreen(polygon[i + 1]));
+		}
+
+		void BuildPyramid() {
+			for (int level = 1; level < _levels.size(); level++) {
+				const std::vector<float>& below = _levels[level - 1];
+				glm::ivec2 belowSize = _sizes[level - 1];
+				glm::ivec2 size = _sizes[level];
+				for (int y = 0; y < size.y; y++) {
+					int y0 = 2 * y, y1 = glm::min(2 * y + 1, belowSize.y - 1);
+					for (int x = 0; x < size.x; x++) {
+						int x0 = 2 * x, x1 = glm::min(2 * x + 1, belowSize.x - 1);
+						float farthest = glm::max(glm::max(below[y0 * belowSize.x + x0], below[y0 * belowSize.x + x1]), glm::max(below[y1 * belowSize.x + x0], below[y1 * belowSize.x + x1]));
+						_levels[level][y * size.x + x] = farthest;
+					}
+				}
+			}
+		}
+
+	public:
+		OcclusionCuller() {
+			_error = 0;
+			_rendered = false;
+			SetResolution(256, 128);
+		}
+
+		// The width is rounded up to a multiple of 4, the rasterizer fills 4 pixels at a time
+		void SetResolution(int width, int height) {
+			width = (glm::max(width, 4) + 3) & ~3;
+			height = glm::max(height, 1);
+			_levels.clear();
+			_sizes.clear();
+			glm::ivec2 size(width, height);
+			while (true) {
+				_sizes.push_back(size);
+				_levels.push_back(std::vector<float>(size.x * size.y, 1.0f));
+				if (size.x == 1 && size.y == 1) break;
+				size = glm::max((size + 1) / 2, glm::ivec2(1));
+			}
+			_rendered = false;
+		}
+
+		// Adds the triangles of the object as they are now, with the vertices merged on a grid of cellSize.
+		// Only for objects that don't move, bigger cells mean fewer triangles and more conservative tests
+		void AddOccluder(Object3D* object, float cellSize) {
+			Model* model = object->GetModel();
+			if (model == NULL) return;
+			glm::mat4 modelMatrix = object->GetModelMatrix();
+			Vertex* vertices = model->GetVertices();
+			std::unordered_map<long long, int> cells;
+			std::vector<glm::vec3> sums;
+			std::vector<int> counts;
+			int base = (int)_vertices.size();
+			for (int i = 0; i < model->GetNMeshes(); i++) {
+				Mesh mesh = model->GetMeshAt(i);
+				for (int t = 0; t < mesh.nTriangles; t++) {
+					int corners[3];
+					for (int c = 0; c < 3; c++) {
+						glm::vec3 position = glm::vec3(modelMatrix * glm::vec4(vertices[mesh.triangles[t].index[c]].coord, 1));
+						glm::ivec3 cell = glm::ivec3(glm::floor(position / cellSize)) + (1 << 20);
+						long long key = ((long long)cell.x << 42) | ((long long)cell.y << 21) | (long long)cell.z;
+						std::unordered_map<long long, int>::iterator it = cells.find(key);
+						if (it == cells.end()) {
+							it = cells.insert(std::make_pair(key, (int)sums.size())).first;
+							sums.push_back(glm::vec3(0));
+							counts.push_back(0);
+						}
+						sums[it->second] += position;
+						counts[it->second]++;
+						corners[c] = it->second;
+					}
+					// collapsed into a line or a point
+					if (corners[0] == corners[1] || corners[1] == corners[2] || corners[2] == corners[0]) continue;
+					for (int c = 0; c < 3; c++) _indices.push_back(base + corners[c]);
+				}
+			}
+			for (int i = 0; i < sums.size(); i++) _vertices.push_back(sums[i] / (float)counts[i]);
+			// a merged vertex stays in its cell
+			_error = glm::max(_error, cellSize * glm::sqrt(3.0f));
+		}
+
+		void ClearOccluders() {
+			_vertices.clear();
+			_indices.clear();
+			_error = 0;
+			_rendered = false;
+		}
+
+		int GetNTriangles() const {
+			return (int)_indices.size() / 3;
+		}
+
+		// Rasterizes the occluders as seen through viewProjection and rebuilds the pyramid, once per frame before the tests
+		void Render(const glm::mat4& viewProjection) {
+			_viewProjection = viewProjection;
+			std::fill(_levels[0].begin(), _levels[0].end(), 1.0f);
+			_rendered = !_indices.empty();
+			if (!_rendered) return;
+			_clip.resize(_vertices.size());
+			for (int i = 0; i < _vertices.size(); i++) _clip[i] = viewProjection * glm::vec4(_vertices[i], 1);
+			for (int i = 0; i < _indices.size(); i += 3) {
+				const glm::vec4& a = _clip[_indices[i]];
+				const glm::vec4& b = _clip[_indices[i + 1]];
+				const glm::vec4& c = _clip[_indices[i + 2]];
+				// all behind the near plane or all beyond the same side plane
+				if (a.z < -a.w && b.z < -b.w && c.z < -c.w) continue;
+				if (a.x > a.w && b.x > b.w && c.x > c.w) continue;
+				if (a.x < -a.w && b.x < -b.w && c.x < -c.w) continue;
+				if (a.y > a.w && b.y > b.w && c.y > c.w) continue;
+				if (a.y < -a.w && b.y < -b.w && c.y < -c.w) continue;
+				ClipAndRasterize(a, b, c);
+			}
+			BuildPyramid();
+		}
+
+		// False only when the box is certainly behind the occluders of the last Render
+		bool IsVisible(glm::vec3 center, glm::vec3 extents) const {
+			if (!_rendered) return true;
+			extents += _error;
+			glm::vec2 screenMin(FLT_MAX), screenMax(-FLT_MAX);
+			float nearest = FLT_MAX;
+			for (int corner = 0; corner < 8; corner++) {
+				glm::vec3 offset((corner & 1) ? 1.0f : -1.0f, (corner & 2) ? 1.0f : -1.0f, (corner & 4) ? 1.0f : -1.0f);
+				glm::vec4 clip = _viewProjection * glm::vec4(center + offset * extents, 1);
+				// reaches the camera plane, nothing in front of it can hide it
+				if (clip.z < -clip.w) return true;
+				glm::vec3 ndc = glm::vec3(clip) / clip.w;
+				screenMin = glm::min(screenMin, glm::vec2(ndc));
+				screenMax = glm::max(screenMax, glm::vec2(ndc));
+				nearest = glm::min(nearest, ndc.z * 0.5f + 0.5f);
+			}
+			glm::ivec2 size = _sizes[0];
+			glm::ivec2 from = glm::clamp(glm::ivec2(glm::floor((screenMin * 0.5f + 0.5f) * glm::vec2(size))), glm::ivec2(0), size - 1);
+			glm::ivec2 to = glm::clamp(glm::ivec2(glm::floor((screenMax * 0.5f + 0.5f) * glm::vec2(size))), glm::ivec2(0), size - 1);
+			// the level where the rectangle spans 2x2 texels at most
+			int level = 0;
+			while ((to.x - from.x > 1 || to.y - from.y > 1) && level + 1 < _levels.size()) {
+				from /= 2;
+				to /= 2;
+				level++;
+			}
+			const std::vector<float>& depth = _levels[level];
+			int width = _sizes[level].x;
+			for (int y = from.y; y <= to.y; y++) {
+				for (int x = from.x; x <= to.x; x++) {
+					if (nearest <= depth[y * width + x]) return true;
+				}
+			}
+			return false;
+		}
+
+		// Keeps the indices whose box may be visible, in their order, and returns how many are left
+		int Filter(const BoxesSoA& boxes, int* indices, int count) const {
+			if (!_rendered) return count;
+			int kept = 0;
+			for (int i = 0; i < count; i++) {
+				int k = indices[i];
+				glm::vec3 center(boxes.centerX[k], boxes.centerY[k], boxes.centerZ[k]);
+				glm::vec3 extents(boxes.extentsX[k], boxes.extentsY[k], boxes.extentsZ[k]);
+				if (IsVisible(center, extents)) indices[kept++] = k;
+			}
+			return kept;
+		}
+	};
+}
\ No newline at end of file
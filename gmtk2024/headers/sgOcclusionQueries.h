@@ -0,0 +1,156 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <unordered_map>
+#include <glm/glm/glm.hpp>
+#include <glm/glm/gtc/matrix_transform.hpp>
+#include <glm/glm/gtc/type_ptr.hpp>
+#include <sgGLStateCache.h>
+
+namespace sg {
+	// GPU occlusion tests of world space boxes. Once the depth of the frame is complete a proxy box is drawn into a query per item,
+	// without color or depth writes, and the result is read a frame later without waiting for it.
+	// An item is reported hidden after HideAfter failed tests in a row and visible again after one pass, so boxes grazing
+	// the edge of an occluder don't flicker. Render thread only
+	class OcclusionQueries {
+	public:
+		static const int HideAfter = 3;
+		// items not tested for this many frames give their query back
+		static const unsigned int Lifetime = 120;
+
+	private:
+		struct Entry {
+			GLuint query;
+			bool pending;
+			int failed;
+			unsigned int lastIssued;
+		};
+
+		std::unordered_map<unsigned int, Entry> _entries;
+		GLuint _cubeVao = 0;
+		GLuint _cubeVbo = 0;
+		GLuint _cubeEbo = 0;
+		GLint _mvpLocation = -1;
+		unsigned int _frame = 0;
+
+	public:
+		// Unit cube from -1 to 1, scaled to the extents of every box
+		void Create() {
+			const float corners[24] = { -1, -1, -1,  1, -1, -1,  -1, 1, -1,  1, 1, -1,  -1, -1, 1,  1, -1, 1,  -1, 1, 1,  1, 1, 1 };
+			const unsigned int indices[36] = {
+				0, 2, 1, 1, 2, 3,  4, 5, 6, 5, 7, 6,
+				0, 1, 4, 1, 5, 4,  2, 6, 3, 3, 6, 7,
+				0, 4, 2, 2, 4, 6,  1, 3, 5, 3, 7, 5
+			};
+			glGenVertexArrays(1, &_cubeVao);
+			GLStateCache::Instance()->BindVertexArray(_cubeVao);
+			glGenBuffers(1, &_cubeVbo);
+			GLStateCache::Instance()->BindBuffer(GL_ARRAY_BUFFER, _cubeVbo);
+			glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+			glEnableVertexAttribArray(0);
+			glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (GLvoid*)0);
+			glGenBuffers(1, &_cubeEbo);
+			GLStateCache::Instance()->BindBuffer(GL_ELEMENT_ARRAY_BUFFER, _cubeEbo);
+			glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
+		}
+
+		// Reads the results that arrived since the last frame and drops the items that are gone
+		void BeginFrame() {
+			_frame++;
+			for (std::unordered_map<unsigned int, Entry>::iterator it = _entries.begin(); it != _entries.end();) {
+				Entry& entry = it->second;
+				if (entry.pending) {
+					GLuint available = 0;
+					glGetQueryObjectuiv(entry.query, GL_QUERY_RESULT_AVAILABLE, &available);
+					if (available) {
+						GLuint passed = 0;
+						glGetQueryObjectuiv(entry.query, GL_QUERY_RESULT, &passed);
+						entry.failed = passed ? 0 : entry.failed + 1;
+						entry.pending = false;
+					}
+				}
+				if (_frame - entry.lastIssued > Lifetime) {
+					glDeleteQueries(1, &entry.query);
+					it = _entries.erase(it);
+				} else {
+					it++;
+				}
+			}
+		}
+
+		// Hidden only while the item is tested every frame, one that comes back after a break starts over as visible
+		bool IsHidden(unsigned int key) const {
+			std::unordered_map<unsigned int, Entry>::const_iterator it = _entries.find(key);
+			if (it == _entries.end()) return false;
+			return it->second.failed >= HideAfter && it->second.lastIssued + 1 == _frame;
+		}
+
+		// The query a draw of a hidden item is conditioned on, 0 to draw it plainly
+		GLuint GetCondition(unsigned int key) const {
+			if (!IsHidden(key)) return 0;
+			return _entries.find(key)->second.query;
+		}
+
+		// Depth test only, every proxy after this goes through Issue
+		void BeginProxies(GLuint program) {
+			GLStateCache::Instance()->UseProgram(program);
+			_mvpLocation = glGetUniformLocation(program, "mvp");
+			GLStateCache::Instance()->BindVertexArray(_cubeVao);
+			glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+			glDepthMask(GL_FALSE);
+			// the camera can be close enough to see the back faces only
+			glDisable(GL_CULL_FACE);
+		}
+
+		void EndProxies() {
+			glEnable(GL_CULL_FACE);
+			glDepthMask(GL_TRUE);
+			glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+		}
+
+		// Tests the box against the current depth. A box that reaches the near plane would be clipped and could fail
+		// with the camera inside it, it counts as a pass without a query
+		void Issue(unsigned int key, glm::vec3 center, glm::vec3 extents, const glm::mat4& viewProjection) {
+			std::unordered_map<unsigned int, Entry>::iterator it = _entries.find(key);
+			if (it == _entries.end()) {
+				Entry entry = { 0, false, 0, 0 };
+				glGenQueries(1, &entry.query);
+				it = _entries.insert(std::make_pair(key, entry)).first;
+			}
+			Entry& entry = it->second;
+			// not tested last frame, its old results say nothing about now
+			if (entry.lastIssued + 1 != _frame) entry.failed = 0;
+			entry.lastIssued = _frame;
+			// the last result is still on its way, the query can't be reused yet
+			if (entry.pending) return;
+
+			for (int corner = 0; corner < 8; corner++) {
+				glm::vec3 offset((corner & 1) ? 1.0f : -1.0f, (corner & 2) ? 1.0f : -1.0f, (corner & 4) ? 1.0f : -1.0f);
+				glm::vec4 clip = viewProjection * glm::vec4(center + offset * extents, 1);
+				if (clip.z < -clip.w) {
+					entry.failed = 0;
+					return;
+				}
+			}
+
+			glm::mat4 mvp = viewProjection * glm::scale(glm::translate(glm::mat4(1), center), extents);
+			glUniformMatrix4fv(_mvpLocation, 1, false, glm::value_ptr(mvp));
+			glBeginQuery(GL_ANY_SAMPLES_PASSED, entry.query);
+			glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_INT, (GLvoid*)0);
+			glEndQuery(GL_ANY_SAMPLES_PASSED);
+			entry.pending = true;
+		}
+
+		void Delete() {
+			for (std::unordered_map<unsigned int, Entry>::iterator it = _entries.begin(); it != _entries.end(); it++) {
+				glDeleteQueries(1, &it->second.query);
+			}
+			_entries.clear();
+			if (_cubeVao == 0) return;
+			GLuint buffers[2] = { _cubeVbo, _cubeEbo };
+			GLStateCache::Instance()->DeleteBuffers(2, buffers);
+			GLStateCache::Instance()->DeleteVertexArrays(1, &_cubeVao);
+			_cubeVao = 0;
+		}
+	};
+}
\ No newline at end of file
@@ -18,8 +18,8 @@ namespace sg {
 		float _nearPlane;
 		float _farPlane;
 		float _range;
+		bool _shadowCasting = true;
 		Frustum _frustums[6];
-		FrameBufferCube *_depthCubeBuffer;
 
 		void UpdateProjectionMatrix() {
 			_projectionMatrix = glm::perspective(FOV, 1.0f, _nearPlane, _farPlane);
@@ -57,8 +57,7 @@ namespace sg {
 
 	protected:
 
-		void LocalPositionFromGlobal(bool updateChildren = true) override { Entity3D::LocalPositionFromGlobal(updateChildren); UpdateViewMatrices(); UpdateBoundingBox(); }
-		void GlobalPositionFromLocal(bool updateChildren = true) override { Entity3D::GlobalPositionFromLocal(updateChildren); UpdateViewMatrices(); UpdateBoundingBox(); }
+		void RebuildWorld() override { UpdateViewMatrices(); UpdateBoundingBox(); }
 
 	public:
 		PointLight3D(int resolution, float nearPlane, float farPlane) : Entity3D() {
@@ -68,20 +67,12 @@ namespace sg {
 			_farPlane = farPlane;
 			_range = farPlane;
 			_lightType = TypePointLight;
-			_depthCubeBuffer = new sg::FrameBufferCube(resolution, false, true, false);
 			UpdateProjectionMatrix();
 			UpdateViewMatrices();
 		}
 
-		GLuint GetShadowTexture() {
-			return _depthCubeBuffer->depthMap;
-		}
-
-		sg::FrameBufferCube GetShadowBuffer() const {
-			return *_depthCubeBuffer;
-		}
-
 		sg::Frustum GetFrustum(int index) {
+			UpdateWorld();
 			return _frustums[index];
 		}
 
@@ -112,17 +103,23 @@ namespace sg {
 			return _range;
 		}
 
+		// Lights without shadows cost no cubemap, only the lighting itself
+		void SetShadowCasting(bool shadowCasting) {
+			_shadowCasting = shadowCasting;
+		}
+
+		bool IsShadowCasting() {
+			return _shadowCasting;
+		}
+
 		glm::mat4 GetViewProjection(int index) {
+			UpdateWorld();
 			return _viewProjectionMatrices[index];
 		}
 
 		glm::mat4 GetView(int index) {
+			UpdateWorld();
 			return _viewMatrices[index];
 		}
-
-		~PointLight3D() {
-			_depthCubeBuffer->FreeTextures();
-			delete(_depthCubeBuffer);
-		}
 	};
 }
\ No newline at end of file
@@ -0,0 +1,392 @@
+#pragma once
+
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <cstdio>
+#include <glm/glm/glm.hpp>
+#include <sgObject3D.h>
+#include <sgTriangleBvh.h>
+
+namespace sg {
+	struct VisibilitySettings {
+		float cellSize = 16;
+		// how far outside the planes the eye can go, the camera follows the player from behind
+		float margin = 2;
+		// ray pairs per cell and target before they are taken as hidden from each other, clusters get at least one per triangle
+		int samples = 16;
+		// pushes the cluster samples off their surface
+		float bias = 0.05f;
+		// 0 uses every core
+		int threads = 0;
+	};
+
+	// Offline visibility for closed levels. The volume inside the bounding planes is cut into cells, then rays between samples
+	// of the cells and of the level clusters find what each cell can see: the clusters, and the other cells for everything that
+	// moves through them. Rows of bits, one per cell, identical rows are stored once.
+	// Sampled, a target only seen through a gap narrower than the samples can be missed. Every cell also gets what its
+	// neighbours see, which covers most of those and an eye close to a cell border
+	class PotentiallyVisibleSet {
+	private:
+		static const unsigned int CacheMagic = 0x53565053;
+
+		VisibilitySettings _settings;
+		std::vector<Plane> _planes;
+		TriangleBvh _occluders;
+		unsigned int _levelId;
+		int _nClusters;
+
+		// grid over the level bounds, cells outside the planes are -1
+		glm::vec3 _origin;
+		glm::ivec3 _size;
+		std::vector<int> _cells;
+		int _nCells;
+
+		// targets are the clusters then the cells, bit t of a row is target t
+		int _rowWords;
+		std::vector<int> _cellRows;
+		std::vector<unsigned int> _rows;
+
+		// samples by target, _firstSample[t] to _firstSample[t + 1]. Cells have _settings.samples each
+		std::vector<glm::vec3> _points;
+		std::vector<glm::vec3> _normals;
+		std::vector<int> _firstSample;
+
+		// R2 and R3 sequences, spread evenly whatever the number of samples
+		static glm::vec2 Sequence2(int i) {
+			return glm::fract(glm::vec2(0.5f) + glm::vec2(0.7548777f, 0.5698403f) * (float)(i + 1));
+		}
+
+		static glm::vec3 Sequence3(int i) {
+			return glm::fract(glm::vec3(0.5f) + glm::vec3(0.8191725f, 0.6710436f, 0.5497005f) * (float)(i + 1));
+		}
+
+		bool InsidePlanes(glm::vec3 point) const {
+			for (int i = 0; i < _planes.size(); i++) {
+				if (glm::dot(_planes[i].normal, point) - _planes[i].distance < -_settings.margin) return false;
+			}
+			return true;
+		}
+
+		glm::ivec3 GridCoords(glm::vec3 point) const {
+			return glm::ivec3(glm::floor((point - _origin) / _settings.cellSize));
+		}
+
+		int GridIndex(glm::ivec3 coords) const {
+			if (glm::any(glm::lessThan(coords, glm::ivec3(0))) || glm::any(glm::greaterThanEqual(coords, _size))) return -1;
+			return (coords.z * _size.y + coords.y) * _size.x + coords.x;
+		}
+
+		static bool GetBit(const unsigned int* row, int bit) {
+			return (row[bit >> 5] >> (bit & 31)) & 1;
+		}
+
+		static void SetBit(unsigned int* row, int bit) {
+			row[bit >> 5] |= 1u << (bit & 31);
+		}
+
+		// A cell is kept when some of its samples are inside the planes
+		void SampleCells() {
+			int nGrid = _size.x * _size.y * _size.z;
+			_cells.assign(nGrid, -1);
+			_nCells = 0;
+			std::vector<glm::vec3> cellPoints;
+			for (int g = 0; g < nGrid; g++) {
+				glm::ivec3 coords = glm::ivec3(g % _size.x, (g / _size.x) % _size.y, g / (_size.x * _size.y));
+				glm::vec3 corner = _origin + glm::vec3(coords) * _settings.cellSize;
+				cellPoints.clear();
+				for (int i = 0; i < _settings.samples * 8 && cellPoints.size() < _settings.samples; i++) {
+					glm::vec3 point = corner + Sequence3(i) * _settings.cellSize;
+					if (InsidePlanes(point)) cellPoints.push_back(point);
+				}
+				if (cellPoints.empty()) continue;
+				// a cell barely inside gets its few samples again
+				for (int i = 0; cellPoints.size() < _settings.samples; i++) cellPoints.push_back(cellPoints[i]);
+				_cells[g] = _nCells++;
+				_points.insert(_points.end(), cellPoints.begin(), cellPoints.end());
+				_normals.insert(_normals.end(), cellPoints.size(), glm::vec3(0));
+				_firstSample.push_back((int)_points.size());
+			}
+		}
+
+		// Points on the front of the triangles, the back faces are never drawn. Stratified over the area of the whole cluster,
+		// as many as its triangles and never fewer than the settings ask, so every part of it gets its share
+		void SampleClusters(Object3D* level) {
+			Model* model = level->GetModel();
+			const std::vector<MeshCluster>& clusters = model->GetClusters();
+			glm::mat4 modelMatrix = level->GetModelMatrix();
+			glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(modelMatrix)));
+			Vertex* vertices = model->GetVertices();
+			std::vector<float> areas;
+			_firstSample.assign(1, 0);
+			for (int c = 0; c < clusters.size(); c++) {
+				Mesh mesh = model->GetMeshAt(clusters[c].mesh);
+				const Triangle* triangles = &mesh.triangles[clusters[c].firstTriangle];
+				int nTriangles = clusters[c].nTriangles;
+
+				// running sum of the world space areas
+				areas.resize(nTriangles);
+				float total = 0;
+				for (int t = 0; t < nTriangles; t++) {
+					glm::vec3 a = glm::vec3(modelMatrix * glm::vec4(vertices[triangles[t].index[0]].coord, 1));
+					glm::vec3 b = glm::vec3(modelMatrix * glm::vec4(vertices[triangles[t].index[1]].coord, 1));
+					glm::vec3 d = glm::vec3(modelMatrix * glm::vec4(vertices[triangles[t].index[2]].coord, 1));
+					total += 0.5f * glm::length(glm::cross(b - a, d - a));
+					areas[t] = total;
+				}
+
+				int nSamples = glm::max(_settings.samples, nTriangles);
+				for (int i = 0; i < nSamples; i++) {
+					glm::vec2 r = Sequence2(i);
+					// one sample in each of nSamples equal slices of the area, degenerate clusters fall back to the triangle order
+					int t = (int)((long long)i * nTriangles / nSamples);
+					if (total > 0) {
+						float target = ((float)i + 0.5f) / nSamples * total;
+						t = glm::min((int)(std::upper_bound(areas.begin(), areas.end(), target) - areas.begin()), nTriangles - 1);
+					}
+					const Triangle& triangle = triangles[t];
+					if (r.x + r.y > 1) r = glm::vec2(1) - r;
+					glm::vec3 point = vertices[triangle.index[0]].coord * (1 - r.x - r.y) + vertices[triangle.index[1]].coord * r.x + vertices[triangle.index[2]].coord * r.y;
+					glm::vec3 normal = vertices[triangle.index[0]].normal + vertices[triangle.index[1]].normal + vertices[triangle.index[2]].normal;
+					normal = normalMatrix * normal;
+					float length = glm::length(normal);
+					normal = length > 1e-12f ? normal / length : glm::vec3(0);
+					_points.push_back(glm::vec3(modelMatrix * glm::vec4(point, 1)) + normal * _settings.bias);
+					_normals.push_back(normal);
+				}
+				_firstSample.push_back((int)_points.size());
+			}
+		}
+
+		// Every sample of the target is paired with one of the cell, the cell samples are reused for larger targets
+		bool SamplesSeeEachOther(int cell, int target) const {
+			int firstFrom = _firstSample[_nClusters + cell];
+			int nFrom = _firstSample[_nClusters + cell + 1] - firstFrom;
+			for (int i = _firstSample[target]; i < _firstSample[target + 1]; i++) {
+				glm::vec3 from = _points[firstFrom + (i - _firstSample[target]) % nFrom];
+				glm::vec3 to = _points[i];
+				glm::vec3 toTarget = to - from;
+				float distance = glm::length(toTarget);
+				if (distance < 1e-6f) return true;
+				if (glm::dot(toTarget, _normals[i]) > 0) continue;
+				if (!_occluders.Occluded(from, toTarget / distance, distance)) return true;
+			}
+			return false;
+		}
+
+		// Each cell writes its own row, cells only test the cells after them and the rows are mirrored afterwards
+		void TraceCell(int cell, const std::vector<glm::ivec3>& coords, std::vector<unsigned int>& rows) const {
+			unsigned int* row = &rows[cell * _rowWords];
+			for (int c = 0; c < _nClusters; c++) {
+				if (SamplesSeeEachOther(cell, c)) SetBit(row, c);
+			}
+			for (int other = cell; other < _nCells; other++) {
+				bool neighbour = glm::all(glm::lessThanEqual(glm::abs(coords[other] - coords[cell]), glm::ivec3(1)));
+				if (neighbour || SamplesSeeEachOther(cell, _nClusters + other)) SetBit(row, _nClusters + other);
+			}
+		}
+
+		void Trace() {
+			std::vector<glm::ivec3> coords(_nCells);
+			for (int g = 0; g < _cells.size(); g++) {
+				if (_cells[g] >= 0) coords[_cells[g]] = glm::ivec3(g % _size.x, (g / _size.x) % _size.y, g / (_size.x * _size.y));
+			}
+			std::vector<unsigned int> rows((size_t)_nCells * _rowWords, 0);
+			int nThreads = _settings.threads > 0 ? _settings.threads : (int)std::thread::hardware_concurrency();
+			nThreads = glm::max(nThreads, 1);
+			std::atomic<int> next(0);
+			std::vector<std::thread> workers;
+			for (int i = 0; i < nThreads; i++) {
+				workers.push_back(std::thread([this, &next, &coords, &rows]() {
+					int cell;
+					while ((cell = next++) < _nCells) TraceCell(cell, coords, rows);
+				}));
+			}
+			for (int i = 0; i < workers.size(); i++) workers[i].join();
+			for (int a = 0; a < _nCells; a++) {
+				for (int b = a + 1; b < _nCells; b++) {
+					if (GetBit(&rows[a * _rowWords], _nClusters + b)) SetBit(&rows[b * _rowWords], _nClusters + a);
+				}
+			}
+
+			std::vector<unsigned int> dilated(rows);
+			const glm::ivec3 faces[6] = { glm::ivec3(1, 0, 0), glm::ivec3(-1, 0, 0), glm::ivec3(0, 1, 0), glm::ivec3(0, -1, 0), glm::ivec3(0, 0, 1), glm::ivec3(0, 0, -1) };
+			for (int cell = 0; cell < _nCells; cell++) {
+				for (int f = 0; f < 6; f++) {
+					int g = GridIndex(coords[cell] + faces[f]);
+					if (g < 0 || _cells[g] < 0) continue;
+					for (int w = 0; w < _rowWords; w++) dilated[cell * _rowWords + w] |= rows[_cells[g] * _rowWords + w];
+				}
+			}
+			Compact(dilated);
+		}
+
+		void Compact(const std::vector<unsigned int>& rows) {
+			std::map<std::vector<unsigned int>, int> unique;
+			_cellRows.resize(_nCells);
+			_rows.clear();
+			for (int cell = 0; cell < _nCells; cell++) {
+				std::vector<unsigned int> row(rows.begin() + cell * _rowWords, rows.begin() + (cell + 1) * _rowWords);
+				std::map<std::vector<unsigned int>, int>::iterator it = unique.find(row);
+				if (it == unique.end()) {
+					it = unique.insert(std::make_pair(row, (int)unique.size())).first;
+					_rows.insert(_rows.end(), row.begin(), row.end());
+				}
+				_cellRows[cell] = it->second;
+			}
+		}
+
+		// Covers everything the rows depend on, a cache with another fingerprint is traced again. The thread count is left
+		// out, it does not change the result, and so is the struct padding
+		unsigned long long Fingerprint() const {
+			unsigned long long hash = 14695981039346656037ull;
+			hash = TriangleBvh::HashBytes(hash, &_settings.cellSize, sizeof(float));
+			hash = TriangleBvh::HashBytes(hash, &_settings.margin, sizeof(float));
+			hash = TriangleBvh::HashBytes(hash, &_settings.samples, sizeof(int));
+			hash = TriangleBvh::HashBytes(hash, &_settings.bias, sizeof(float));
+			if (!_planes.empty()) hash = TriangleBvh::HashBytes(hash, _planes.data(), sizeof(Plane) * _planes.size());
+			hash = _occluders.Hash(hash);
+			if (!_points.empty()) hash = TriangleBvh::HashBytes(hash, _points.data(), sizeof(glm::vec3) * _points.size());
+			hash = TriangleBvh::HashBytes(hash, &_nClusters, sizeof(int));
+			return hash;
+		}
+
+		bool Load(const char* path, unsigned long long fingerprint) {
+			FILE* fp;
+			if (fopen_s(&fp, path, "rb") != 0 || !fp) return false;
+			unsigned int magic = 0;
+			unsigned long long savedFingerprint = 0;
+			int nRows = 0;
+			bool valid = fread(&magic, sizeof(magic), 1, fp) == 1 && magic == CacheMagic &&
+				fread(&savedFingerprint, sizeof(savedFingerprint), 1, fp) == 1 && savedFingerprint == fingerprint &&
+				fread(&nRows, sizeof(nRows), 1, fp) == 1 &&
+				// rows are unique, there cannot be more than cells
+				nRows > 0 && nRows <= _nCells;
+			if (valid) {
+				_cellRows.resize(_nCells);
+				_rows.resize((size_t)nRows * _rowWords);
+				valid = fread(_cellRows.data(), sizeof(int), _cellRows.size(), fp) == _cellRows.size() &&
+					fread(_rows.data(), sizeof(unsigned int), _rows.size(), fp) == _rows.size();
+			}
+			// a truncated or corrupt file must not index past the rows
+			for (int cell = 0; valid && cell < _nCells; cell++) {
+				if (_cellRows[cell] < 0 || _cellRows[cell] >= nRows) valid = false;
+			}
+			fclose(fp);
+			if (!valid) {
+				_cellRows.clear();
+				_rows.clear();
+			}
+			return valid;
+		}
+
+		void Save(const char* path, unsigned long long fingerprint) {
+			FILE* fp;
+			if (fopen_s(&fp, path, "wb") != 0 || !fp) {
+				printf("WARNING: Cannot write the visibility cache %s\n", path);
+				return;
+			}
+			unsigned int magic = CacheMagic;
+			int nRows = (int)(_rows.size() / _rowWords);
+			fwrite(&magic, sizeof(magic), 1, fp);
+			fwrite(&fingerprint, sizeof(fingerprint), 1, fp);
+			fwrite(&nRows, sizeof(nRows), 1, fp);
+			fwrite(_cellRows.data(), sizeof(int), _cellRows.size(), fp);
+			fwrite(_rows.data(), sizeof(unsigned int), _rows.size(), fp);
+			fclose(fp);
+		}
+
+	public:
+		PotentiallyVisibleSet(VisibilitySettings settings = VisibilitySettings()) {
+			_settings = settings;
+			_levelId = 0;
+			_nClusters = 0;
+			_nCells = 0;
+			_rowWords = 0;
+			_size = glm::ivec3(0);
+		}
+
+		// The navigable volume, on the positive side of every plane
+		void SetPlanes(const std::vector<Plane>& planes) {
+			_planes = planes;
+		}
+
+		// Geometry that blocks the view, with its current transform. The level usually is the only one
+		void AddOccluder(Object3D* object) {
+			_occluders.AddObject(object);
+		}
+
+		// The level needs its clusters, the rows hold one bit per cluster of its model.
+		// With a cache path the rows are saved and reused as long as the planes, the geometry and the settings match
+		bool Build(Object3D* level, const char* cachePath = NULL) {
+			Model* model = level->GetModel();
+			if (model == NULL || model->GetClusters().empty()) return false;
+			_levelId = level->GetId();
+			_nClusters = (int)model->GetClusters().size();
+
+			glm::mat4 modelMatrix = level->GetModelMatrix();
+			glm::vec3 center = glm::vec3(modelMatrix * glm::vec4(model->GetBoundingBoxCenter(), 1));
+			glm::mat3 linear = glm::mat3(modelMatrix);
+			glm::mat3 absolute = glm::mat3(glm::abs(linear[0]), glm::abs(linear[1]), glm::abs(linear[2]));
+			glm::vec3 extents = absolute * (model->GetBoundingBoxUpper() - model->GetBoundingBoxCenter());
+			_origin = center - extents;
+			_size = glm::max(glm::ivec3(glm::ceil(extents * 2.0f / _settings.cellSize)), glm::ivec3(1));
+
+			_points.clear();
+			_normals.clear();
+			SampleClusters(level);
+			SampleCells();
+			_rowWords = (_nClusters + _nCells + 31) / 32;
+
+			unsigned long long fingerprint = Fingerprint();
+			if (cachePath == NULL || !Load(cachePath, fingerprint)) {
+				printf("Tracing visibility: %d cells, %d clusters\n", _nCells, _nClusters);
+				_occluders.Build();
+				Trace();
+				if (cachePath != NULL) Save(cachePath, fingerprint);
+			}
+			printf("Visibility: %d cells share %d rows\n", _nCells, (int)(_rows.size() / _rowWords));
+			return true;
+		}
+
+		unsigned int GetLevelId() const {
+			return _levelId;
+		}
+
+		int GetNClusters() const {
+			return _nClusters;
+		}
+
+		// What the cell around the eye sees, NULL outside the cells where everything is potentially visible
+		const unsigned int* FindRow(glm::vec3 eye) const {
+			if (_rows.empty()) return NULL;
+			int g = GridIndex(GridCoords(eye));
+			if (g < 0 || _cells[g] < 0) return NULL;
+			return &_rows[_cellRows[_cells[g]] * _rowWords];
+		}
+
+		bool IsClusterVisible(const unsigned int* row, int cluster) const {
+			return GetBit(row, cluster);
+		}
+
+		// Visible from the row when any cell the box touches is, a box outside every cell always is
+		bool IsBoxVisible(const unsigned int* row, glm::vec3 center, glm::vec3 extents) const {
+			glm::ivec3 from = glm::max(GridCoords(center - extents), glm::ivec3(0));
+			glm::ivec3 to = glm::min(GridCoords(center + extents), _size - 1);
+			bool inCells = false;
+			for (int z = from.z; z <= to.z; z++) {
+				for (int y = from.y; y <= to.y; y++) {
+					for (int x = from.x; x <= to.x; x++) {
+						int cell = _cells[GridIndex(glm::ivec3(x, y, z))];
+						if (cell < 0) continue;
+						if (GetBit(row, _nClusters + cell)) return true;
+						inCells = true;
+					}
+				}
+			}
+			return !inCells;
+		}
+	};
+}
\ No newline at end of file
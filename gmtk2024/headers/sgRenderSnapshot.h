@@ -0,0 +1,306 @@
+#pragma once
+
+#include <vector>
+#include <glm/glm/gtc/type_ptr.hpp>
+#include <sgStructures.h>
+#include <sgTextureManager.h>
+
+namespace sg {
+	// Everything the render thread reads about the scene, copied by value at the end of a simulation step.
+	// The simulation can change or delete its objects while the previous step is still being drawn
+
+	enum RenderMode {
+		RenderForward = 0,
+		// g-buffer pass, then one screen pass applies the lights per cluster
+		RenderDeferred
+	};
+
+	struct MeshDraw {
+		unsigned int firstIndex;
+		int nTriangles;
+		Material material;
+	};
+
+	// World space MeshCluster with its index range
+	struct ClusterDraw {
+		unsigned int firstIndex;
+		int nTriangles;
+		int mesh;
+		glm::vec3 center;
+		glm::vec3 extents;
+		glm::vec3 coneAxis;
+		float coneAngle;
+		// cleared on the render side when the camera cell can't see the cluster
+		bool potentiallyVisible;
+
+		bool InFrustum(const Frustum& frustum) const {
+			const Plane* planes[6] = { &frustum.leftFace, &frustum.rightFace, &frustum.topFace, &frustum.bottomFace, &frustum.nearFace, &frustum.farFace };
+			for (int i = 0; i < 6; i++) {
+				float r = glm::dot(extents, glm::abs(planes[i]->normal));
+				if (glm::dot(planes[i]->normal, center) - planes[i]->distance < -r) return false;
+			}
+			return true;
+		}
+
+		// True when every triangle faces away from the eye, a position (w = 1) or the direction towards an eye at infinity (w = 0).
+		// Back faces are culled in every pass, so such a cluster draws nothing
+		bool FacesAway(glm::vec4 eye) const {
+			const float halfPi = 1.5707963f;
+			if (coneAngle >= halfPi) return false;
+			if (eye.w == 0) {
+				// the closest normal to the eye direction still points more than 90 degrees away from it
+				float angle = glm::acos(glm::clamp(glm::dot(coneAxis, glm::normalize(glm::vec3(eye))), -1.0f, 1.0f));
+				return angle - coneAngle > halfPi;
+			}
+			// every point of the bounding sphere has to be behind every plane the cone allows
+			glm::vec3 toCluster = center - glm::vec3(eye);
+			float distance = glm::length(toCluster);
+			float radius = glm::length(extents);
+			if (distance <= radius) return false;
+			float angle = glm::acos(glm::clamp(glm::dot(coneAxis, toCluster / distance), -1.0f, 1.0f));
+			return angle + coneAngle < glm::acos(radius / distance);
+		}
+
+		bool IsVisible(const Frustum& frustum, glm::vec4 eye) const {
+			return potentiallyVisible && InFrustum(frustum) && !FacesAway(eye);
+		}
+	};
+
+	struct ObjectSnapshot {
+		// stays the same for the lifetime of the object, the index in the snapshot doesn't
+		unsigned int id;
+		GLuint vao;
+		GLuint depthVao;
+		unsigned int nIndices;
+		int patches;
+		glm::mat4 modelMatrix;
+		glm::vec3 center;
+		glm::vec3 extents;
+		bool castsShadows;
+		bool receivesShadows;
+		bool lit;
+		bool performFrustumCheck;
+		bool isStatic;
+		// baked lighting, 0 when the object has none
+		GLuint lightmap;
+		std::vector<MeshDraw> meshes;
+		// big static meshes are drawn by cluster, only the ones each view can see. Empty for the others
+		std::vector<ClusterDraw> clusters;
+
+		bool FrustumCheck(const Frustum& frustum) const {
+			if (!performFrustumCheck) return true;
+			return BoundsInFrustum(frustum);
+		}
+
+		// Plain box test, also for objects that opted out of culling
+		bool BoundsInFrustum(const Frustum& frustum) const {
+			return (isOnOrForwardPlane(frustum.leftFace) &&
+				isOnOrForwardPlane(frustum.rightFace) &&
+				isOnOrForwardPlane(frustum.topFace) &&
+				isOnOrForwardPlane(frustum.bottomFace) &&
+				isOnOrForwardPlane(frustum.nearFace) &&
+				isOnOrForwardPlane(frustum.farFace));
+		}
+
+		bool isOnOrForwardPlane(const Plane& plane) const {
+			// Compute the projection interval radius of b onto L(t) = b.c + t * p.n
+			const float r = glm::dot(extents, glm::abs(plane.normal));
+			return -r <= glm::dot(plane.normal, center) - plane.distance;
+		}
+
+		// Whether every material is fully opaque, see-through ones must not write depth over what is behind them
+		bool IsOpaque() const {
+			for (int i = 0; i < meshes.size(); i++) {
+				if (meshes[i].material.d < 1) return false;
+			}
+			return true;
+		}
+
+		// Whether the draws go through the clusters, tessellated objects don't use indices
+		bool IsClustered() const {
+			return !clusters.empty() && patches == 0;
+		}
+
+		// eye is where the view looks from, as in ClusterDraw::FacesAway
+		void Draw(GLuint program, const glm::mat4& vp, const Frustum& frustum, glm::vec4 eye) {
+			if (!FrustumCheck(frustum)) return;
+			glm::mat4 mvp = vp * modelMatrix;
+			GLStateCache::Instance()->UseProgram(program);
+			glUniformMatrix4fv(glGetUniformLocation(program, "mvp"), 1, false, glm::value_ptr(mvp));
+
+			GLStateCache::Instance()->BindVertexArray(vao);
+			if (IsClustered()) {
+				int material = -1;
+				for (int i = 0; i < clusters.size(); i++) {
+					if (!clusters[i].IsVisible(frustum, eye)) continue;
+					if (clusters[i].mesh != material) {
+						material = clusters[i].mesh;
+						sg::TextureManager::Instance()->SetMaterialData(program, &meshes[material].material);
+					}
+					DrawCluster(clusters[i]);
+				}
+				return;
+			}
+			for (int i = 0; i < meshes.size(); i++) {
+				sg::TextureManager::Instance()->SetMaterialData(program, &meshes[i].material);
+				if (patches > 0) {
+					glDrawArrays(GL_PATCHES, 0, patches);
+				} else {
+					glDrawElements(GL_TRIANGLES, meshes[i].nTriangles * 3, GL_UNSIGNED_INT, (GLvoid*)(sizeof(unsigned int) * meshes[i].firstIndex));
+				}
+			}
+		}
+
+		// Tessellated objects displace their surface in the evaluation shader, the depth passes give them a program with
+		// the same stages. matrix is the mvp of a single view, or the model matrix when a geometry shader fans out the views
+		void DrawDepthPatches(GLuint patchProgram, const glm::mat4& matrix) {
+			if (patchProgram == -1) return;
+			GLStateCache::Instance()->UseProgram(patchProgram);
+			glUniformMatrix4fv(glGetUniformLocation(patchProgram, "mvp"), 1, false, glm::value_ptr(matrix));
+
+			GLStateCache::Instance()->BindVertexArray(vao);
+			for (int i = 0; i < meshes.size(); i++) {
+				// only for the displacement map
+				sg::TextureManager::Instance()->SetMaterialData(patchProgram, &meshes[i].material);
+				glDrawArrays(GL_PATCHES, 0, patches);
+			}
+		}
+
+		// Layered shadow passes: the geometry shader projects the world space triangles into every view,
+		// so the caller culls against all of them and submits the object once. A cluster is drawn if any of the views sees it
+		void DrawDepthLayered(GLuint program, GLuint patchProgram, const Frustum* frustums, const glm::vec4* eyes, int nViews) {
+			if (patches > 0) {
+				DrawDepthPatches(patchProgram, modelMatrix);
+				return;
+			}
+			GLStateCache::Instance()->UseProgram(program);
+			glUniformMatrix4fv(glGetUniformLocation(program, "model"), 1, false, glm::value_ptr(modelMatrix));
+
+			GLStateCache::Instance()->BindVertexArray(depthVao);
+			if (IsClustered()) {
+				for (int i = 0; i < clusters.size(); i++) {
+					bool visible = false;
+					for (int v = 0; v < nViews && !visible; v++) visible = clusters[i].IsVisible(frustums[v], eyes[v]);
+					if (visible) DrawCluster(clusters[i]);
+				}
+				return;
+			}
+			glDrawElements(GL_TRIANGLES, nIndices, GL_UNSIGNED_INT, (GLvoid*)0);
+		}
+
+		void DrawCluster(const ClusterDraw& cluster) {
+			glDrawElements(GL_TRIANGLES, cluster.nTriangles * 3, GL_UNSIGNED_INT, (GLvoid*)(sizeof(unsigned int) * cluster.firstIndex));
+		}
+
+		// Depth-only path for the shadow passes: no material work, positions only, one draw per model
+		void DrawDepth(GLuint program, GLuint patchProgram, const glm::mat4& vp, const Frustum& frustum, glm::vec4 eye) {
+			if (!FrustumCheck(frustum)) return;
+			if (patches > 0) {
+				DrawDepthPatches(patchProgram, vp * modelMatrix);
+				return;
+			}
+			glm::mat4 mvp = vp * modelMatrix;
+			GLStateCache::Instance()->UseProgram(program);
+			glUniformMatrix4fv(glGetUniformLocation(program, "mvp"), 1, false, glm::value_ptr(mvp));
+
+			GLStateCache::Instance()->BindVertexArray(depthVao);
+			if (IsClustered()) {
+				for (int i = 0; i < clusters.size(); i++) {
+					if (clusters[i].IsVisible(frustum, eye)) DrawCluster(clusters[i]);
+				}
+				return;
+			}
+			glDrawElements(GL_TRIANGLES, nIndices, GL_UNSIGNED_INT, (GLvoid*)0);
+		}
+	};
+
+	struct SpotLightSnapshot {
+		glm::vec3 position;
+		glm::vec3 color;
+		float intensity;
+		float range;
+		glm::mat4 shadowMatrix;
+		glm::mat4 viewProjection;
+		Frustum frustum;
+		unsigned int shadowId;
+		int shadowWidth;
+		int shadowHeight;
+		// filled on the render side: the resolution picked for this frame, the atlas tile in texels and in texture coordinates
+		int shadowSize;
+		glm::ivec4 shadowTile;
+		glm::vec4 shadowRect;
+		Texture mapTexture;
+		bool visible;
+	};
+
+	struct DirectionalLightSnapshot {
+		glm::vec3 direction;
+		glm::vec3 color;
+		float intensity;
+		// a light without cascades has a single one covering everything
+		int nCascades;
+		glm::vec4 cascadeSplits;
+		glm::mat4 shadowMatrices[SG_MAX_CASCADES];
+		glm::mat4 viewProjections[SG_MAX_CASCADES];
+		Frustum frustums[SG_MAX_CASCADES];
+		// cascade c uses shadowId + c
+		unsigned int shadowId;
+		int shadowWidth;
+		int shadowHeight;
+		int shadowSize;
+		glm::ivec4 shadowTiles[SG_MAX_CASCADES];
+		glm::vec4 shadowRects[SG_MAX_CASCADES];
+		bool visible;
+	};
+
+	struct PointLightSnapshot {
+		glm::vec3 position;
+		glm::vec3 color;
+		float intensity;
+		float range;
+		float farPlane;
+		glm::mat4 viewProjections[6];
+		Frustum frustums[6];
+		unsigned int shadowId;
+		int shadowWidth;
+		int shadowHeight;
+		bool castsShadows;
+		// filled on the render side, the cubemap is owned by the renderer and sized every frame.
+		// Only SG_MAX_POINT_SHADOWS lights get one, shadowSlot is their sampler in the shaders or -1
+		int shadowSlot;
+		int shadowSize;
+		GLuint shadowBuffer;
+		GLuint shadowTexture;
+		bool visible;
+	};
+
+	struct AmbientLightSnapshot {
+		glm::vec3 color;
+		float intensity;
+	};
+
+	struct RenderSnapshot {
+		glm::mat4 view;
+		glm::mat4 projection;
+		glm::mat4 viewProjection;
+		Frustum frustum;
+		float nearPlane;
+		float farPlane;
+		glm::vec3 cameraPosition;
+		// projection[1][1], turns a size over a distance into a fraction of the screen height
+		float projectionScale;
+		int width;
+		int height;
+		bool showTriangulation;
+		RenderMode renderMode;
+		bool depthPrePass;
+		// bumped by the simulation whenever a static caster is added, removed or moved
+		unsigned int staticVersion;
+		int nStaticCasters;
+		std::vector<ObjectSnapshot> objects;
+		std::vector<SpotLightSnapshot> spotLights;
+		std::vector<DirectionalLightSnapshot> directionalLights;
+		std::vector<PointLightSnapshot> pointLights;
+		std::vector<AmbientLightSnapshot> ambientLights;
+	};
+}
\ No newline at end of file
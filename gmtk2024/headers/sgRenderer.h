@@ -10,25 +10,51 @@
 #include <sgPointLight3D.h>
 #include <sgCamera3D.h>
 #include <sgSkyboxRenderer.h>
+#include <sgStreamBuffer.h>
+#include <sgRenderSnapshot.h>
+#include <sgGLTaskQueue.h>
+#include <sgShadowAtlas.h>
+#include <sgDynamicBvh.h>
+#include <sgFrustumCuller.h>
+#include <sgOcclusionCuller.h>
+#include <sgOcclusionQueries.h>
+#include <sgPotentiallyVisibleSet.h>
+#include <sgLightClusters.h>
+#include <sgGBuffer.h>
 #include <thread>
+#include <unordered_map>
+#include <functional>
+#include <algorithm>
+#include <cfloat>
 
 namespace sg {
 	class Renderer {
     private:
+        static const GLuint ObjectDataBinding = 0;
+        static const GLsizeiptr ObjectStreamFrameSize = 2 * 1024 * 1024;
+
         GLuint _shadowedProgram;
         GLuint _depthProgram;
         GLuint _depthLinearProgram;
+        GLuint _depthViewportsProgram = -1;
+        // the depth programs again with the tessellation stages, for objects drawn as patches
+        GLuint _depthPatchProgram = -1;
+        GLuint _depthLinearPatchProgram = -1;
+        GLuint _depthViewportsPatchProgram = -1;
         GLuint _unlitProgram;
         GLuint _litProgram;
         GLuint _triangulationProgram;
+        GLuint _gBufferProgram;
+        GLuint _deferredProgram;
+        GLuint _lightmappedProgram;
         bool _showTriangulation;
         SkyboxRenderer _skybox;
+        StreamBuffer* _objectStream;
 
         GLFWwindow* _window;
         GLint _origFB;
         int _width;
         int _height;
-        GLuint _vao;
 
         Camera3D* _mainCamera;
         std::vector<SpotLight3D*> _spotLights;
@@ -38,6 +64,145 @@ namespace sg {
         std::vector<Object3D*> _objects;
         std::vector<Entity3D*> _entities;
 
+        // Double buffered hand-off to the render thread: the simulation fills one snapshot while the other is drawn
+        RenderSnapshot _snapshots[2];
+        int _writeSnapshot = 0;
+        int _pendingSnapshot = -1;
+        int _drawingSnapshot = -1;
+        std::thread _renderThread;
+        bool _threaded = false;
+        bool _stopRenderThread = false;
+        GLStateCounters _lastStateCounters;
+        // Presented frames, timed between two buffer swaps on the thread that draws
+        double _lastPresentTime = 0;
+        int _presentedFrameRate = 0;
+
+        // Spot and directional shadow maps are tiles of one atlas, all rendered through its framebuffer.
+        // The atlas is sized from the shadow memory budget, up to ShadowAtlasSize
+        static const int ShadowAtlasSize = 4096;
+        static const int MinShadowAtlasSize = 512;
+        ShadowAtlas* _shadowAtlas = NULL;
+        GLenum _shadowDepthFormat = GL_DEPTH_COMPONENT32F;
+
+        // Every shadow gets a resolution tier from its screen coverage, tier 0 being the size the light asked for
+        // and each tier halving it. The budget covers the allocated shadow textures: the atlas with its static copy
+        // takes up to three quarters of it, the point light cubemaps (and their caches) share the rest
+        static const int ShadowTierCount = 4;
+        static const int MinShadowSize = 128;
+        static const unsigned int ShadowTierHoldFrames = 30;
+        struct ShadowTier {
+            int tier;
+            unsigned int higherSince;
+            unsigned int lastUsed;
+        };
+        struct ShadowSizeRequest {
+            int* size;
+            float coverage;
+            int faces;
+            bool inAtlas;
+        };
+        size_t _shadowMemoryBudget = 96 * 1024 * 1024;
+        std::unordered_map<unsigned int, ShadowTier> _shadowTiers;
+
+        // Point light cubemaps live on the render side so they can follow the tier of their light
+        struct PointShadowMap {
+            FrameBufferCube* buffer;
+            int size;
+            unsigned int lastUsed;
+        };
+        std::unordered_map<unsigned int, PointShadowMap> _pointShadowMaps;
+
+        // Point lights reach the lit shaders through per cluster lists, there is no cap on how many a scene has
+        LightClusters _lightClusters;
+
+        // Lights kept per frame, the least important ones relative to the camera are merged into a close neighbour or dropped.
+        // Spot lights are also held to the SG_MAX_LIGHTS slots of the shaders, each object then uses its SG_MAX_OBJECT_LIGHTS best ones
+        int _lightBudget = 128;
+        bool _lightBudgetReported = false;
+        struct LightRank {
+            float importance;
+            bool spot;
+            int index;
+
+            bool operator<(const LightRank& other) const {
+                return importance > other.importance;
+            }
+        };
+
+        // Deferred path: the lit objects only write the g-buffer, a full screen pass then shades every pixel once
+        RenderMode _renderMode = RenderForward;
+        // Forward mode: depth of the scene first, then each pixel is shaded only by the surface that ends up visible
+        bool _depthPrePass = false;
+        GBuffer _gBuffer;
+        GLuint _fullscreenVao = 0;
+        // first unit after the light textures, where the lighting pass finds normals and depth
+        int _gBufferTextureUnit = 0;
+        // first unit after the light textures of the lightmapped program, the lightmap goes there
+        int _lightmapTextureUnit = 0;
+
+        // GPU time of the frames, read one frame late so the query never stalls
+        GLuint _frameQueries[2] = { 0, 0 };
+        bool _frameQueryIssued[2] = { false, false };
+        int _frameQuery = 0;
+        double _lastGPUFrameTime = 0;
+
+        // All culled objects of the snapshots by world box, items are snapshot indices. Kept across frames on the render side,
+        // objects are matched by id and only reinserted when they moved out of their leaf. The camera and every light view query it
+        struct ObjectProxy {
+            int proxy;
+            unsigned int frame;
+        };
+        DynamicBvh _objectTree;
+        std::unordered_map<unsigned int, ObjectProxy> _objectProxies;
+        unsigned int _treeFrame = 0;
+        // exact boxes of the snapshot objects by index, the tree only narrows down which of them get tested
+        BoxesSoA _objectBounds;
+        // static occluders rasterized on the CPU for the camera, the frustum survivors and the lights are tested against them
+        OcclusionCuller _occlusionCuller;
+        bool _occlusionCulling = true;
+        // GPU path: proxy boxes of the dynamic objects and of the spot and point light ranges are tested against the depth of the frame.
+        // Hidden objects are drawn under a conditional render, hidden lights are left out like those outside the view.
+        // Lights are keyed by shadow id
+        OcclusionQueries _objectQueries;
+        OcclusionQueries _lightQueries;
+        bool _occlusionQueries = false;
+        struct QueriedLight {
+            unsigned int key;
+            glm::vec3 position;
+            float range;
+        };
+        std::vector<QueriedLight> _queriedLights;
+        // Precomputed visibility of the level, what the cell of the camera can't see is dropped before the frustum tests.
+        // The row is NULL while the camera is outside the cells or without a set
+        PotentiallyVisibleSet* _visibilitySet = NULL;
+        const unsigned int* _visibleRow = NULL;
+        // objects that opted out of culling, every view gets them
+        std::vector<int> _unculledObjects;
+        std::vector<int> _visibleObjects;
+        std::vector<int> _shadowCasters;
+
+        // Spot lights closer than this are rendered in one pass through viewport arrays, one viewport per tile
+        float _spotGroupRadius = 1.0f;
+        std::vector<std::vector<int>> _spotGroups;
+
+        // Depth of the static casters only, keyed by shadow id (the first light for groups). Atlas tiles keep theirs
+        // in the same rectangle of the static atlas, point lights in a cubemap. Valid while views, tiles and static version match
+        struct ShadowCache {
+            FrameBufferCube* cubeBuffer;
+            int cubeSize;
+            std::vector<glm::mat4> views;
+            std::vector<glm::ivec4> tiles;
+            unsigned int staticVersion;
+            bool valid;
+            unsigned int lastUsed;
+        };
+        static const unsigned int ShadowCacheLifetime = 120;
+        bool _shadowCaching = true;
+        bool _copyImage = false;
+        unsigned int _staticVersion = 0;
+        unsigned int _shadowFrame = 0;
+        std::unordered_map<unsigned int, ShadowCache> _shadowCaches;
+
         double _timestep = 1000.0 / 40;
         int _tessellationLevel = 1;
         bool _firstFrame = true;
@@ -92,21 +257,46 @@ namespace sg {
             }
         }
 
-        void UpdateLights() {
+        void UpdateLights(const RenderSnapshot& snapshot) {
             int textureUnit = 2;
-            sg::UpdateDirectionalLights(_shadowedProgram, _directionalLights, _mainCamera->GetView(), textureUnit);
-            sg::UpdateDirectionalLights(_litProgram, _directionalLights, _mainCamera->GetView(), textureUnit);
+            GLStateCache::Instance()->BindTexture(textureUnit, GL_TEXTURE_2D, _shadowAtlas->GetTexture());
+            GLStateCache::Instance()->UseProgram(_shadowedProgram);
+            glUniform1i(glGetUniformLocation(_shadowedProgram, "shadowAtlas"), textureUnit);
+            GLStateCache::Instance()->UseProgram(_deferredProgram);
+            glUniform1i(glGetUniformLocation(_deferredProgram, "shadowAtlas"), textureUnit);
+            GLStateCache::Instance()->UseProgram(_lightmappedProgram);
+            glUniform1i(glGetUniformLocation(_lightmappedProgram, "shadowAtlas"), textureUnit);
 
-            textureUnit += _directionalLights.size();
-            sg::UpdatePointLights(_shadowedProgram, _pointLights, _mainCamera->GetView(), textureUnit);
-            sg::UpdatePointLights(_litProgram, _pointLights, _mainCamera->GetView(), textureUnit);
+            textureUnit++;
+            sg::UpdateDirectionalLights(_shadowedProgram, snapshot.directionalLights, snapshot.view);
+            sg::UpdateDirectionalLights(_litProgram, snapshot.directionalLights, snapshot.view);
+            sg::UpdateDirectionalLights(_deferredProgram, snapshot.directionalLights, snapshot.view);
+            sg::UpdateDirectionalLights(_lightmappedProgram, snapshot.directionalLights, snapshot.view);
 
-            textureUnit += _pointLights.size();
-            sg::UpdateSpotLights(_shadowedProgram, _spotLights, _mainCamera->GetView(), textureUnit);
-            sg::UpdateSpotLights(_litProgram, _spotLights, _mainCamera->GetView(), textureUnit);
+            _lightClusters.Build(snapshot.pointLights, snapshot.view, snapshot.projection, snapshot.nearPlane, snapshot.farPlane, snapshot.width, snapshot.height);
+            _lightClusters.Upload();
+            _lightClusters.Bind(_shadowedProgram, textureUnit);
+            _lightClusters.Bind(_litProgram, textureUnit);
+            _lightClusters.Bind(_deferredProgram, textureUnit);
+            _lightClusters.Bind(_lightmappedProgram, textureUnit);
 
-            sg::UpdateAmbientLights(_shadowedProgram, _ambientLights);
-            sg::UpdateAmbientLights(_litProgram, _ambientLights);
+            textureUnit++;
+            sg::UpdatePointShadowMaps(_shadowedProgram, snapshot.pointLights, textureUnit);
+            sg::UpdatePointShadowMaps(_deferredProgram, snapshot.pointLights, textureUnit);
+            sg::UpdatePointShadowMaps(_lightmappedProgram, snapshot.pointLights, textureUnit);
+
+            textureUnit += SG_MAX_POINT_SHADOWS;
+            sg::UpdateSpotLights(_shadowedProgram, snapshot.spotLights, snapshot.view, textureUnit);
+            sg::UpdateSpotLights(_litProgram, snapshot.spotLights, snapshot.view, textureUnit);
+            _gBufferTextureUnit = sg::UpdateSpotLights(_deferredProgram, snapshot.spotLights, snapshot.view, textureUnit);
+            _lightmapTextureUnit = sg::UpdateSpotLights(_lightmappedProgram, snapshot.spotLights, snapshot.view, textureUnit);
+            GLStateCache::Instance()->UseProgram(_lightmappedProgram);
+            glUniform1i(glGetUniformLocation(_lightmappedProgram, "lightmap"), _lightmapTextureUnit);
+
+            sg::UpdateAmbientLights(_shadowedProgram, snapshot.ambientLights);
+            sg::UpdateAmbientLights(_litProgram, snapshot.ambientLights);
+            sg::UpdateAmbientLights(_deferredProgram, snapshot.ambientLights);
+            sg::UpdateAmbientLights(_lightmappedProgram, snapshot.ambientLights);
         }
 
         void RemoveSpotLight(SpotLight3D* light) {
@@ -161,56 +351,1168 @@ namespace sg {
             }
         }
 
-        void RenderShadows() {
-            glUseProgram(_depthProgram);
+        // Fraction of the screen height covered by the sphere of influence of a light
+        float ShadowCoverage(const RenderSnapshot& snapshot, glm::vec3 position, float range) {
+            float distance = glm::max(glm::distance(snapshot.cameraPosition, position), range);
+            return glm::min(1.0f, range * snapshot.projectionScale / distance);
+        }
 
-            for (int i = 0; i < _spotLights.size(); i++) {
-                if (!_spotLights[i]->FrustumCheck(_mainCamera->GetFrustum())) continue;
-                glBindFramebuffer(GL_DRAW_FRAMEBUFFER, _spotLights[i]->GetShadowBuffer().bufferIndex);
-                glClear(GL_DEPTH_BUFFER_BIT);
-                glViewport(0, 0, _spotLights[i]->GetShadowWidth(), _spotLights[i]->GetShadowHeight());
+        static float Luminance(glm::vec3 color) {
+            return glm::dot(color, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+        }
+
+        // How much a light can add to a box: its brightness with the shaders' linear falloff at the closest point of the box
+        static float LightImportance(glm::vec3 color, float intensity, float range, glm::vec3 position, glm::vec3 center, glm::vec3 extents) {
+            glm::vec3 closest = glm::clamp(position, center - extents, center + extents);
+            float falloff = glm::max(0.0f, 1 - glm::distance(position, closest) / range);
+            return Luminance(color) * intensity * falloff;
+        }
 
-                for (int j = 0; j < _objects.size(); j++) {
-                    if (_objects[j]->CastsShadows) {
-                        _objects[j]->Draw(_depthProgram, _spotLights[i]->GetViewProjection(), _spotLights[i]->GetFrustum());
+        // Same measure for the whole frame: brightness weighted by how much of the screen the light can reach
+        float LightImportance(const RenderSnapshot& snapshot, glm::vec3 color, float intensity, float range, glm::vec3 position, bool visible) {
+            if (!visible) return 0;
+            return Luminance(color) * intensity * ShadowCoverage(snapshot, position, range);
+        }
+
+        // Render side, runs before anything else looks at the lights of the frame
+        void ApplyLightBudget(RenderSnapshot& snapshot) {
+            std::vector<LightRank> ranks;
+            for (int i = 0; i < snapshot.spotLights.size(); i++) {
+                SpotLightSnapshot& light = snapshot.spotLights[i];
+                ranks.push_back({ LightImportance(snapshot, light.color, light.intensity, light.range, light.position, light.visible), true, i });
+            }
+            for (int i = 0; i < snapshot.pointLights.size(); i++) {
+                PointLightSnapshot& light = snapshot.pointLights[i];
+                ranks.push_back({ LightImportance(snapshot, light.color, light.intensity, light.range, light.position, light.visible), false, i });
+            }
+            if (ranks.size() <= _lightBudget && snapshot.spotLights.size() <= SG_MAX_LIGHTS) return;
+            std::stable_sort(ranks.begin(), ranks.end());
+
+            std::vector<bool> keepSpot(snapshot.spotLights.size(), false);
+            std::vector<bool> keepPoint(snapshot.pointLights.size(), false);
+            int kept = 0;
+            int keptSpots = 0;
+            for (int r = 0; r < ranks.size() && kept < _lightBudget; r++) {
+                if (ranks[r].spot) {
+                    if (keptSpots == SG_MAX_LIGHTS) continue;
+                    keepSpot[ranks[r].index] = true;
+                    keptSpots++;
+                } else {
+                    keepPoint[ranks[r].index] = true;
+                }
+                kept++;
+            }
+            if (!_lightBudgetReported) {
+                std::cout << "WARNING: More lights than the light budget, the least important ones are merged or dropped." << std::endl;
+                _lightBudgetReported = true;
+            }
+
+            // a dropped point light inside the reach of a kept one adds its energy to it, the rest are lost
+            for (int i = 0; i < snapshot.pointLights.size(); i++) {
+                if (keepPoint[i]) continue;
+                PointLightSnapshot& dropped = snapshot.pointLights[i];
+                int closest = -1;
+                float closestDistance = FLT_MAX;
+                for (int j = 0; j < snapshot.pointLights.size(); j++) {
+                    if (!keepPoint[j]) continue;
+                    float distance = glm::distance(dropped.position, snapshot.pointLights[j].position);
+                    if (distance < snapshot.pointLights[j].range * 0.5f && distance < closestDistance) {
+                        closest = j;
+                        closestDistance = distance;
                     }
                 }
+                if (closest < 0) continue;
+                PointLightSnapshot& target = snapshot.pointLights[closest];
+                float intensity = target.intensity + dropped.intensity;
+                if (intensity > 0) target.color = (target.color * target.intensity + dropped.color * dropped.intensity) / intensity;
+                target.intensity = intensity;
+                target.range = glm::max(target.range, dropped.range);
             }
 
-            for (int i = 0; i < _directionalLights.size(); i++) {
-                if (!_directionalLights[i]->FrustumCheck(_mainCamera->GetFrustum())) continue;
-                glBindFramebuffer(GL_DRAW_FRAMEBUFFER, _directionalLights[i]->GetShadowBuffer().bufferIndex);
-                glClear(GL_DEPTH_BUFFER_BIT);
-                glViewport(0, 0, _directionalLights[i]->GetShadowWidth(), _directionalLights[i]->GetShadowHeight());
+            int nSpots = 0;
+            for (int i = 0; i < snapshot.spotLights.size(); i++) {
+                if (keepSpot[i]) snapshot.spotLights[nSpots++] = snapshot.spotLights[i];
+            }
+            snapshot.spotLights.resize(nSpots);
+            int nPoints = 0;
+            for (int i = 0; i < snapshot.pointLights.size(); i++) {
+                if (keepPoint[i]) snapshot.pointLights[nPoints++] = snapshot.pointLights[i];
+            }
+            snapshot.pointLights.resize(nPoints);
+        }
+
+        // The SG_MAX_OBJECT_LIGHTS spot lights that light the object the most, the shaders only evaluate those
+        void SetObjectLights(const RenderSnapshot& snapshot, const ObjectSnapshot& object, GLuint program) {
+            std::pair<float, int> best[SG_MAX_OBJECT_LIGHTS];
+            int nBest = 0;
+            int nLights = glm::min((int)snapshot.spotLights.size(), SG_MAX_LIGHTS);
+            for (int i = 0; i < nLights; i++) {
+                const SpotLightSnapshot& light = snapshot.spotLights[i];
+                if (!object.BoundsInFrustum(light.frustum)) continue;
+                float importance = LightImportance(light.color, light.intensity, light.range, light.position, object.center, object.extents);
+                if (importance <= 0) continue;
+                // insertion into the short sorted list
+                int k = nBest < SG_MAX_OBJECT_LIGHTS ? nBest++ : SG_MAX_OBJECT_LIGHTS;
+                while (k > 0 && best[k - 1].first < importance) {
+                    if (k < SG_MAX_OBJECT_LIGHTS) best[k] = best[k - 1];
+                    k--;
+                }
+                if (k < SG_MAX_OBJECT_LIGHTS) best[k] = std::make_pair(importance, i);
+            }
+
+            GLint indices[SG_MAX_OBJECT_LIGHTS];
+            for (int k = 0; k < nBest; k++) indices[k] = best[k].second;
+            GLStateCache::Instance()->UseProgram(program);
+            glUniform1i(glGetUniformLocation(program, "nObjectSpotLights"), nBest);
+            if (nBest > 0) glUniform1iv(glGetUniformLocation(program, "objectSpotLights"), nBest, indices);
+        }
+
+        // Higher resolutions are taken right away, lower ones only once the light has wanted them for a while,
+        // so a light sitting on a threshold doesn't get its map reallocated every frame
+        int ShadowTierFor(unsigned int shadowId, float coverage) {
+            const float thresholds[ShadowTierCount - 1] = { 0.5f, 0.25f, 0.1f };
+            int desired = 0;
+            while (desired < ShadowTierCount - 1 && coverage < thresholds[desired]) desired++;
+
+            std::unordered_map<unsigned int, ShadowTier>::iterator it = _shadowTiers.find(shadowId);
+            if (it == _shadowTiers.end()) {
+                ShadowTier state = { desired, _shadowFrame, _shadowFrame };
+                it = _shadowTiers.insert(std::make_pair(shadowId, state)).first;
+            }
+            ShadowTier& state = it->second;
+            if (desired <= state.tier) {
+                state.tier = desired;
+                state.higherSince = _shadowFrame;
+            } else if (_shadowFrame - state.higherSince >= ShadowTierHoldFrames) {
+                state.tier = desired;
+                state.higherSince = _shadowFrame;
+            }
+            state.lastUsed = _shadowFrame;
+            return state.tier;
+        }
+
+        int ShadowSizeFor(unsigned int shadowId, int requested, float coverage) {
+            return glm::max(MinShadowSize, requested >> ShadowTierFor(shadowId, coverage));
+        }
+
+        size_t ShadowBytesPerTexel() const {
+            return _shadowDepthFormat == GL_DEPTH_COMPONENT16 ? 2 : 4;
+        }
+
+        // Texture memory of a square shadow map with its cache copy, the atlas and the cubemaps each have one when caching
+        size_t ShadowMapBytes(int size, int faces, bool cached) const {
+            return (size_t)faces * size * size * ShadowBytesPerTexel() * (cached ? 2 : 1);
+        }
+
+        int ShadowAtlasSizeForBudget() const {
+            int size = ShadowAtlasSize;
+            while (size > MinShadowAtlasSize && ShadowMapBytes(size, 1, _shadowCaching) > _shadowMemoryBudget / 4 * 3) size /= 2;
+            return size;
+        }
+
+        // Render side, after the budget or the caching changed
+        void FitShadowAtlas() {
+            if (_shadowAtlas != NULL && _shadowAtlas->GetSize() != ShadowAtlasSizeForBudget()) ResetShadowMaps();
+        }
+
+        // Render side, picks the resolution of every visible shadow and shrinks the least covered ones
+        // until everything fits the budget
+        void ChooseShadowSizes(RenderSnapshot& snapshot) {
+            std::vector<ShadowSizeRequest> requests;
+            for (int i = 0; i < snapshot.spotLights.size(); i++) {
+                SpotLightSnapshot& light = snapshot.spotLights[i];
+                if (!light.visible) continue;
+                float coverage = ShadowCoverage(snapshot, light.position, light.range);
+                light.shadowSize = ShadowSizeFor(light.shadowId, glm::max(light.shadowWidth, light.shadowHeight), coverage);
+                requests.push_back({ &light.shadowSize, coverage, 1, true });
+            }
+            for (int i = 0; i < snapshot.directionalLights.size(); i++) {
+                DirectionalLightSnapshot& light = snapshot.directionalLights[i];
+                if (!light.visible) continue;
+                // directional lights cover the whole view, they always get the full resolution unless the budget says otherwise
+                light.shadowSize = glm::max(light.shadowWidth, light.shadowHeight);
+                requests.push_back({ &light.shadowSize, 1.0f, light.nCascades, true });
+            }
+            // only the most covering point lights get a cubemap, the shaders have a sampler for SG_MAX_POINT_SHADOWS of them
+            std::vector<std::pair<float, int>> pointShadows;
+            for (int i = 0; i < snapshot.pointLights.size(); i++) {
+                PointLightSnapshot& light = snapshot.pointLights[i];
+                light.shadowSlot = -1;
+                if (!light.visible || !light.castsShadows) continue;
+                pointShadows.push_back(std::make_pair(ShadowCoverage(snapshot, light.position, light.range), i));
+            }
+            std::sort(pointShadows.begin(), pointShadows.end(), std::greater<std::pair<float, int>>());
+            for (int k = 0; k < pointShadows.size() && k < SG_MAX_POINT_SHADOWS; k++) {
+                PointLightSnapshot& light = snapshot.pointLights[pointShadows[k].second];
+                float coverage = pointShadows[k].first;
+                light.shadowSlot = k;
+                light.shadowSize = ShadowSizeFor(light.shadowId, light.shadowWidth, coverage);
+                requests.push_back({ &light.shadowSize, coverage, 6, false });
+            }
+
+            // the tiles have to fit the area of the atlas, the cubemaps the memory the atlas leaves
+            bool cubesCached = _shadowCaching && _copyImage;
+            size_t atlasArea = (size_t)_shadowAtlas->GetSize() * _shadowAtlas->GetSize();
+            size_t atlasBytes = ShadowMapBytes(_shadowAtlas->GetSize(), 1, _shadowCaching);
+            size_t cubeBudget = _shadowMemoryBudget > atlasBytes ? _shadowMemoryBudget - atlasBytes : 0;
+            size_t tileArea = 0, cubeBytes = 0;
+            for (int i = 0; i < requests.size(); i++) {
+                int size = *requests[i].size;
+                if (requests[i].inAtlas) tileArea += (size_t)requests[i].faces * size * size;
+                else cubeBytes += ShadowMapBytes(size, requests[i].faces, cubesCached);
+            }
+            while (tileArea > atlasArea || cubeBytes > cubeBudget) {
+                int smallest = -1;
+                for (int i = 0; i < requests.size(); i++) {
+                    if (*requests[i].size <= MinShadowSize) continue;
+                    if (requests[i].inAtlas ? tileArea <= atlasArea : cubeBytes <= cubeBudget) continue;
+                    if (smallest < 0 || requests[i].coverage < requests[smallest].coverage) smallest = i;
+                }
+                if (smallest < 0) break;
+                ShadowSizeRequest& request = requests[smallest];
+                int size = *request.size;
+                int shrunk = glm::max(MinShadowSize, size / 2);
+                if (request.inAtlas) {
+                    tileArea -= (size_t)request.faces * (size * size - shrunk * shrunk);
+                } else {
+                    cubeBytes -= ShadowMapBytes(size, request.faces, cubesCached) - ShadowMapBytes(shrunk, request.faces, cubesCached);
+                }
+                *request.size = shrunk;
+                // shrink the others before coming back to this one
+                request.coverage *= 2;
+            }
+
+            std::unordered_map<unsigned int, ShadowTier>::iterator it = _shadowTiers.begin();
+            while (it != _shadowTiers.end()) {
+                if (_shadowFrame - it->second.lastUsed > ShadowCacheLifetime) {
+                    it = _shadowTiers.erase(it);
+                } else {
+                    it++;
+                }
+            }
+        }
+
+        // Render side, reallocates the cubemaps whose light changed resolution
+        void AssignPointShadowMaps(RenderSnapshot& snapshot) {
+            for (int i = 0; i < snapshot.pointLights.size(); i++) {
+                PointLightSnapshot& light = snapshot.pointLights[i];
+                std::unordered_map<unsigned int, PointShadowMap>::iterator it = _pointShadowMaps.find(light.shadowId);
+                if (light.shadowSlot >= 0) {
+                    if (it != _pointShadowMaps.end() && it->second.size != light.shadowSize) {
+                        FreeFrameBufferCube(it->second.buffer);
+                        _pointShadowMaps.erase(it);
+                        it = _pointShadowMaps.end();
+                    }
+                    if (it == _pointShadowMaps.end()) {
+                        PointShadowMap map = { new sg::FrameBufferCube(light.shadowSize, false, true, false, _shadowDepthFormat), light.shadowSize, 0 };
+                        it = _pointShadowMaps.insert(std::make_pair(light.shadowId, map)).first;
+                    }
+                    it->second.lastUsed = _shadowFrame;
+                }
+                bool found = it != _pointShadowMaps.end();
+                light.shadowBuffer = found ? it->second.buffer->bufferIndex : 0;
+                light.shadowTexture = found ? it->second.buffer->depthMap : 0;
+                light.shadowSize = found ? it->second.size : 0;
+            }
+
+            std::unordered_map<unsigned int, PointShadowMap>::iterator it = _pointShadowMaps.begin();
+            while (it != _pointShadowMaps.end()) {
+                if (_shadowFrame - it->second.lastUsed > ShadowCacheLifetime) {
+                    FreeFrameBufferCube(it->second.buffer);
+                    it = _pointShadowMaps.erase(it);
+                } else {
+                    it++;
+                }
+            }
+        }
+
+        void FreeFrameBufferCube(FrameBufferCube* buffer) {
+            buffer->FreeTextures();
+            GLStateCache::Instance()->DeleteFramebuffers(1, &buffer->bufferIndex);
+            delete(buffer);
+        }
+
+        // Drops every shadow map, they are recreated with the current settings on the next frame
+        void ResetShadowMaps() {
+            delete(_shadowAtlas);
+            _shadowAtlas = new ShadowAtlas(ShadowAtlasSizeForBudget(), _shadowDepthFormat);
+            for (std::unordered_map<unsigned int, PointShadowMap>::iterator it = _pointShadowMaps.begin(); it != _pointShadowMaps.end(); it++) {
+                FreeFrameBufferCube(it->second.buffer);
+            }
+            _pointShadowMaps.clear();
+            for (std::unordered_map<unsigned int, ShadowCache>::iterator it = _shadowCaches.begin(); it != _shadowCaches.end(); it++) {
+                FreeShadowCache(it->second);
+            }
+            _shadowCaches.clear();
+        }
+
+        void AssignShadowTile(unsigned int shadowId, int size, bool visible, glm::ivec4& tile, glm::vec4& rect) {
+            ShadowAtlasTile atlasTile;
+            // invisible lights are not rendered this frame, they keep pointing at their last tile while they have one
+            bool found = visible ? _shadowAtlas->Acquire(shadowId, size, size, _shadowFrame, atlasTile) : _shadowAtlas->Find(shadowId, atlasTile);
+            tile = found ? atlasTile.rect : glm::ivec4(0);
+            rect = found ? _shadowAtlas->GetUVRect(atlasTile) : glm::vec4(0);
+        }
 
-                for (int j = 0; j < _objects.size(); j++) {
-                    if (_objects[j]->CastsShadows) {
-                        _objects[j]->Draw(_depthProgram, _directionalLights[i]->GetViewProjection(), _directionalLights[i]->GetFrustum());
+        // Render side, hands out the atlas tiles of the spot and directional lights
+        void AssignShadowTiles(RenderSnapshot& snapshot) {
+            _shadowAtlas->Prune(_shadowFrame, ShadowCacheLifetime);
+            for (int i = 0; i < snapshot.spotLights.size(); i++) {
+                SpotLightSnapshot& light = snapshot.spotLights[i];
+                AssignShadowTile(light.shadowId, light.shadowSize, light.visible, light.shadowTile, light.shadowRect);
+            }
+            for (int i = 0; i < snapshot.directionalLights.size(); i++) {
+                DirectionalLightSnapshot& light = snapshot.directionalLights[i];
+                for (int c = 0; c < light.nCascades; c++) {
+                    AssignShadowTile(light.shadowId + c, light.shadowSize, light.visible, light.shadowTiles[c], light.shadowRects[c]);
+                    // snapped to the texels of the tile it got, which the budget and the atlas may have shrunk
+                    if (light.nCascades > 1 && light.shadowTiles[c].z > 0) {
+                        DirectionalLight3D::SnapCascade(light.shadowTiles[c].z, light.viewProjections[c], light.shadowMatrices[c], light.frustums[c]);
                     }
                 }
             }
+        }
+
+        // Render side, splits the visible spot lights with a tile into groups
+        void GroupSpotLights(RenderSnapshot& snapshot) {
+            _spotGroups.clear();
+            for (int i = 0; i < snapshot.spotLights.size(); i++) {
+                SpotLightSnapshot& light = snapshot.spotLights[i];
+                if (!light.visible || light.shadowTile.z == 0) continue;
+
+                int group = -1;
+                for (int g = 0; g < _spotGroups.size() && _depthViewportsProgram != -1; g++) {
+                    SpotLightSnapshot& first = snapshot.spotLights[_spotGroups[g][0]];
+                    if (_spotGroups[g].size() < SG_MAX_SHADOW_VIEWS && glm::distance(first.position, light.position) <= _spotGroupRadius) {
+                        group = g;
+                        break;
+                    }
+                }
+                if (group < 0) {
+                    _spotGroups.push_back(std::vector<int>());
+                    group = _spotGroups.size() - 1;
+                }
+                _spotGroups[group].push_back(i);
+            }
+        }
+
+        ShadowCache& GetShadowCache(unsigned int key, int cubeSize = 0) {
+            std::unordered_map<unsigned int, ShadowCache>::iterator it = _shadowCaches.find(key);
+            if (it == _shadowCaches.end()) {
+                ShadowCache cache = { NULL, 0, std::vector<glm::mat4>(), std::vector<glm::ivec4>(), 0, false, 0 };
+                it = _shadowCaches.insert(std::make_pair(key, cache)).first;
+            }
+            ShadowCache& cache = it->second;
+            if (cubeSize > 0 && cache.cubeSize != cubeSize) {
+                FreeShadowCache(cache);
+                cache.cubeBuffer = new sg::FrameBufferCube(cubeSize, false, true, false, _shadowDepthFormat);
+                cache.cubeSize = cubeSize;
+                cache.valid = false;
+            }
+            cache.lastUsed = _shadowFrame;
+            return cache;
+        }
+
+        void FreeShadowCache(ShadowCache& cache) {
+            if (cache.cubeBuffer != NULL) {
+                FreeFrameBufferCube(cache.cubeBuffer);
+                cache.cubeBuffer = NULL;
+                cache.cubeSize = 0;
+            }
+        }
+
+        // Caches of lights that have been gone or invisible for a while
+        void PruneShadowCaches() {
+            std::unordered_map<unsigned int, ShadowCache>::iterator it = _shadowCaches.begin();
+            while (it != _shadowCaches.end()) {
+                if (_shadowFrame - it->second.lastUsed > ShadowCacheLifetime) {
+                    FreeShadowCache(it->second);
+                    it = _shadowCaches.erase(it);
+                } else {
+                    it++;
+                }
+            }
+        }
+
+        void UpdateObjectTree(const RenderSnapshot& snapshot) {
+            const std::vector<ObjectSnapshot>& objects = snapshot.objects;
+            _treeFrame++;
+            _unculledObjects.clear();
+            _objectBounds.Resize(objects.size());
+            for (int i = 0; i < objects.size(); i++) {
+                const ObjectSnapshot& object = objects[i];
+                _objectBounds.Set(i, object.center, object.extents);
+                if (!object.performFrustumCheck) {
+                    _unculledObjects.push_back(i);
+                    continue;
+                }
+                glm::vec3 boundsMin = object.center - object.extents;
+                glm::vec3 boundsMax = object.center + object.extents;
+                std::unordered_map<unsigned int, ObjectProxy>::iterator it = _objectProxies.find(object.id);
+                if (it == _objectProxies.end()) {
+                    ObjectProxy proxy = { _objectTree.Insert(i, boundsMin, boundsMax), _treeFrame };
+                    _objectProxies[object.id] = proxy;
+                } else {
+                    _objectTree.Move(it->second.proxy, boundsMin, boundsMax);
+                    _objectTree.SetItem(it->second.proxy, i);
+                    it->second.frame = _treeFrame;
+                }
+            }
+            // removed from the scene or no longer culled since the last snapshot
+            for (std::unordered_map<unsigned int, ObjectProxy>::iterator it = _objectProxies.begin(); it != _objectProxies.end();) {
+                if (it->second.frame != _treeFrame) {
+                    _objectTree.Remove(it->second.proxy);
+                    it = _objectProxies.erase(it);
+                } else {
+                    it++;
+                }
+            }
+        }
+
+        // Sorted candidates without duplicates, plus the unculled objects. The draw order stays the order of the snapshot
+        void AddUnculledObjects(std::vector<int>& objects) {
+            objects.insert(objects.end(), _unculledObjects.begin(), _unculledObjects.end());
+            std::sort(objects.begin(), objects.end());
+            objects.erase(std::unique(objects.begin(), objects.end()), objects.end());
+        }
+
+        // Draws the occluders as the camera sees them. A light whose whole reach is hidden lights nothing on screen,
+        // it is treated like one outside the view and gets neither a shadow map nor a place in the light lists
+        void RenderOccluders(RenderSnapshot& snapshot) {
+            if (!_occlusionCulling) return;
+            _occlusionCuller.Render(snapshot.viewProjection);
+            for (int i = 0; i < snapshot.spotLights.size(); i++) {
+                SpotLightSnapshot& light = snapshot.spotLights[i];
+                if (light.visible) light.visible = _occlusionCuller.IsVisible(light.position, glm::vec3(light.range));
+            }
+            for (int i = 0; i < snapshot.pointLights.size(); i++) {
+                PointLightSnapshot& light = snapshot.pointLights[i];
+                if (light.visible) light.visible = _occlusionCuller.IsVisible(light.position, glm::vec3(light.range));
+            }
+        }
+
+        // Lights in view get a proxy at the end of the frame whatever their last result, so they can come back
+        void HideQueriedLights(RenderSnapshot& snapshot) {
+            _queriedLights.clear();
+            if (!_occlusionQueries) return;
+            _objectQueries.BeginFrame();
+            _lightQueries.BeginFrame();
+            for (int i = 0; i < snapshot.spotLights.size(); i++) {
+                SpotLightSnapshot& light = snapshot.spotLights[i];
+                if (!light.visible) continue;
+                _queriedLights.push_back({ light.shadowId, light.position, light.range });
+                light.visible = !_lightQueries.IsHidden(light.shadowId);
+            }
+            for (int i = 0; i < snapshot.pointLights.size(); i++) {
+                PointLightSnapshot& light = snapshot.pointLights[i];
+                if (!light.visible) continue;
+                _queriedLights.push_back({ light.shadowId, light.position, light.range });
+                light.visible = !_lightQueries.IsHidden(light.shadowId);
+            }
+        }
+
+        // Only objects that move are tested, the static ones are the occluders
+        bool HasOcclusionQuery(const ObjectSnapshot& object) const {
+            return _occlusionQueries && !object.isStatic && object.performFrustumCheck;
+        }
+
+        // Proxies for the next frame, against the finished depth of this one
+        void IssueOcclusionQueries(const RenderSnapshot& snapshot) {
+            if (!_occlusionQueries) return;
+            const std::vector<ObjectSnapshot>& objects = snapshot.objects;
+            _objectQueries.BeginProxies(_depthProgram);
+            for (int k = 0; k < _visibleObjects.size(); k++) {
+                const ObjectSnapshot& object = objects[_visibleObjects[k]];
+                if (HasOcclusionQuery(object)) _objectQueries.Issue(object.id, object.center, object.extents, snapshot.viewProjection);
+            }
+            _objectQueries.EndProxies();
+            _lightQueries.BeginProxies(_depthProgram);
+            for (int i = 0; i < _queriedLights.size(); i++) {
+                _lightQueries.Issue(_queriedLights[i].key, _queriedLights[i].position, glm::vec3(_queriedLights[i].range), snapshot.viewProjection);
+            }
+            _lightQueries.EndProxies();
+        }
+
+        // Draws of an object that failed its last queries go through a conditional render on the latest one,
+        // the GPU drops them if it failed again. Returns whether a condition was set
+        bool BeginOcclusionCondition(const ObjectSnapshot& object) {
+            if (!HasOcclusionQuery(object)) return false;
+            GLuint query = _objectQueries.GetCondition(object.id);
+            if (query == 0) return false;
+            glBeginConditionalRender(query, GL_QUERY_NO_WAIT);
+            return true;
+        }
+
+        void CollectVisibleObjects(const RenderSnapshot& snapshot) {
+            _visibleObjects.clear();
+            _visibleRow = _visibilitySet != NULL ? _visibilitySet->FindRow(snapshot.cameraPosition) : NULL;
+            _objectTree.QueryFrustum(snapshot.frustum, _visibleObjects);
+            if (_visibleRow != NULL) {
+                int kept = 0;
+                for (int k = 0; k < _visibleObjects.size(); k++) {
+                    const ObjectSnapshot& object = snapshot.objects[_visibleObjects[k]];
+                    if (_visibilitySet->IsBoxVisible(_visibleRow, object.center, object.extents)) _visibleObjects[kept++] = _visibleObjects[k];
+                }
+                _visibleObjects.resize(kept);
+            }
+            _visibleObjects.resize(FrustumCuller::Filter(snapshot.frustum, _objectBounds, _visibleObjects.data(), _visibleObjects.size()));
+            if (_occlusionCulling) _visibleObjects.resize(_occlusionCuller.Filter(_objectBounds, _visibleObjects.data(), _visibleObjects.size()));
+            AddUnculledObjects(_visibleObjects);
+        }
+
+        // Runs after the shadows, the lights can see parts of the level the camera can't
+        void HideLevelClusters(RenderSnapshot& snapshot) {
+            if (_visibleRow == NULL) return;
+            for (int i = 0; i < snapshot.objects.size(); i++) {
+                ObjectSnapshot& object = snapshot.objects[i];
+                if (object.id != _visibilitySet->GetLevelId() || object.clusters.size() != _visibilitySet->GetNClusters()) continue;
+                for (int c = 0; c < object.clusters.size(); c++) {
+                    object.clusters[c].potentiallyVisible = _visibilitySet->IsClusterVisible(_visibleRow, c);
+                }
+            }
+        }
+
+        // Drops the tree candidates in _shadowCasters whose own box misses all the views, the draws then skip the frustum tests
+        void CullShadowCasters(const Frustum* frustums, int nFrustums) {
+            std::sort(_shadowCasters.begin(), _shadowCasters.end());
+            _shadowCasters.erase(std::unique(_shadowCasters.begin(), _shadowCasters.end()), _shadowCasters.end());
+            _shadowCasters.resize(FrustumCuller::Filter(frustums, nFrustums, _objectBounds, _shadowCasters.data(), _shadowCasters.size()));
+        }
+
+        // Only casters inside the convex hull of the camera frustum and the light can shadow something visible.
+        // Every camera plane with the light on its inner side bounds that hull, the missing side planes only make the test conservative.
+        // light is a position (w = 1) or the direction towards a directional light (w = 0)
+        bool CastsIntoView(const RenderSnapshot& snapshot, const ObjectSnapshot& object, glm::vec4 light) {
+            if (!object.performFrustumCheck) return true;
+            const Frustum& frustum = snapshot.frustum;
+            const Plane* planes[6] = { &frustum.leftFace, &frustum.rightFace, &frustum.topFace, &frustum.bottomFace, &frustum.nearFace, &frustum.farFace };
+            for (int i = 0; i < 6; i++) {
+                float lightSide = glm::dot(planes[i]->normal, glm::vec3(light)) - planes[i]->distance * light.w;
+                if (lightSide < 0) continue;
+                if (!object.isOnOrForwardPlane(*planes[i])) return false;
+            }
+            return true;
+        }
+
+        // Narrows the objects the light views found in _shadowCasters to the casters that can shadow the view of any of the lights.
+        // Static casters skip the camera test, they can end up in a cached map that is reused after the camera moved
+        void FilterShadowCasters(const RenderSnapshot& snapshot, const glm::vec4* lights, int nLights) {
+            AddUnculledObjects(_shadowCasters);
+            const std::vector<ObjectSnapshot>& objects = snapshot.objects;
+            int kept = 0;
+            for (int i = 0; i < _shadowCasters.size(); i++) {
+                const ObjectSnapshot& object = objects[_shadowCasters[i]];
+                if (!object.castsShadows) continue;
+                bool keep = object.isStatic;
+                for (int k = 0; k < nLights && !keep; k++) keep = CastsIntoView(snapshot, object, lights[k]);
+                if (keep) _shadowCasters[kept++] = _shadowCasters[i];
+            }
+            _shadowCasters.resize(kept);
+        }
+
+        // The atlas is never cleared as a whole, the other tiles belong to other lights
+        void ClearShadowTiles(const glm::ivec4* tiles, int nTiles) {
+            glEnable(GL_SCISSOR_TEST);
+            for (int k = 0; k < nTiles; k++) {
+                glScissor(tiles[k].x, tiles[k].y, tiles[k].z, tiles[k].w);
+                glClear(GL_DEPTH_BUFFER_BIT);
+            }
+            glDisable(GL_SCISSOR_TEST);
+        }
+
+        // drawCasters(true) draws the static casters, drawCasters(false) the dynamic ones.
+        // The static ones are redrawn into the static atlas only when the views, the tiles or a static caster changed,
+        // every frame the tiles are copied into the atlas and the dynamic casters are drawn on top
+        void RenderAtlasShadow(RenderSnapshot& snapshot, unsigned int cacheKey, const glm::ivec4* tiles, const glm::mat4* views, int nViews,
+            std::function<void(bool)> drawCasters) {
+            if (!_shadowCaching || snapshot.nStaticCasters == 0) {
+                GLStateCache::Instance()->BindFramebuffer(GL_DRAW_FRAMEBUFFER, _shadowAtlas->GetBuffer());
+                ClearShadowTiles(tiles, nViews);
+                drawCasters(true);
+                drawCasters(false);
+                return;
+            }
+
+            FrameBuffer* staticAtlas = _shadowAtlas->GetStaticBuffer();
+            ShadowCache& cache = GetShadowCache(cacheKey);
+            bool valid = cache.valid && cache.staticVersion == snapshot.staticVersion &&
+                cache.views.size() == nViews && std::equal(views, views + nViews, cache.views.begin()) &&
+                std::equal(tiles, tiles + nViews, cache.tiles.begin());
+            if (!valid) {
+                GLStateCache::Instance()->BindFramebuffer(GL_DRAW_FRAMEBUFFER, staticAtlas->bufferIndex);
+                ClearShadowTiles(tiles, nViews);
+                drawCasters(true);
+                cache.views.assign(views, views + nViews);
+                cache.tiles.assign(tiles, tiles + nViews);
+                cache.staticVersion = snapshot.staticVersion;
+                cache.valid = true;
+            }
+
+            if (!_copyImage) GLStateCache::Instance()->BindFramebuffer(GL_READ_FRAMEBUFFER, staticAtlas->bufferIndex);
+            GLStateCache::Instance()->BindFramebuffer(GL_DRAW_FRAMEBUFFER, _shadowAtlas->GetBuffer());
+            for (int k = 0; k < nViews; k++) {
+                const glm::ivec4& tile = tiles[k];
+                if (_copyImage) {
+                    glCopyImageSubData(staticAtlas->depthMap, GL_TEXTURE_2D, 0, tile.x, tile.y, 0,
+                        _shadowAtlas->GetTexture(), GL_TEXTURE_2D, 0, tile.x, tile.y, 0, tile.z, tile.w, 1);
+                } else {
+                    glBlitFramebuffer(tile.x, tile.y, tile.x + tile.z, tile.y + tile.w, tile.x, tile.y, tile.x + tile.z, tile.y + tile.w, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+                }
+            }
+            drawCasters(false);
+        }
+
+        // Same scheme for the cubemaps of the point lights, which stay out of the atlas
+        void RenderCubeShadow(RenderSnapshot& snapshot, PointLightSnapshot& light, std::function<void(bool)> drawCasters) {
+            if (!_shadowCaching || snapshot.nStaticCasters == 0 || !_copyImage) {
+                GLStateCache::Instance()->BindFramebuffer(GL_DRAW_FRAMEBUFFER, light.shadowBuffer);
+                glClear(GL_DEPTH_BUFFER_BIT);
+                drawCasters(true);
+                drawCasters(false);
+                return;
+            }
+
+            ShadowCache& cache = GetShadowCache(light.shadowId, light.shadowSize);
+            bool valid = cache.valid && cache.staticVersion == snapshot.staticVersion &&
+                cache.views.size() == 6 && std::equal(light.viewProjections, light.viewProjections + 6, cache.views.begin());
+            if (!valid) {
+                GLStateCache::Instance()->BindFramebuffer(GL_DRAW_FRAMEBUFFER, cache.cubeBuffer->bufferIndex);
+                glClear(GL_DEPTH_BUFFER_BIT);
+                drawCasters(true);
+                cache.views.assign(light.viewProjections, light.viewProjections + 6);
+                cache.staticVersion = snapshot.staticVersion;
+                cache.valid = true;
+            }
+
+            glCopyImageSubData(cache.cubeBuffer->depthMap, GL_TEXTURE_CUBE_MAP, 0, 0, 0, 0,
+                light.shadowTexture, GL_TEXTURE_CUBE_MAP, 0, 0, 0, 0, light.shadowSize, light.shadowSize, 6);
+            GLStateCache::Instance()->BindFramebuffer(GL_DRAW_FRAMEBUFFER, light.shadowBuffer);
+            drawCasters(false);
+        }
+
+        void RenderShadowView(RenderSnapshot& snapshot, unsigned int shadowId, const glm::ivec4& tile, const glm::mat4& viewProjection, const Frustum& frustum, glm::vec4 light) {
+            std::vector<ObjectSnapshot>& objects = snapshot.objects;
+            _shadowCasters.clear();
+            _objectTree.QueryFrustum(frustum, _shadowCasters);
+            CullShadowCasters(&frustum, 1);
+            FilterShadowCasters(snapshot, &light, 1);
+
+            GLStateCache::Instance()->UseProgram(_depthProgram);
+            RenderAtlasShadow(snapshot, shadowId, &tile, &viewProjection, 1, [&](bool staticCasters) {
+                glViewport(tile.x, tile.y, tile.z, tile.w);
+                for (int i = 0; i < _shadowCasters.size(); i++) {
+                    ObjectSnapshot& object = objects[_shadowCasters[i]];
+                    if (object.isStatic == staticCasters) object.DrawDepth(_depthProgram, _depthPatchProgram, viewProjection, frustum, light);
+                }
+            });
+        }
+
+        void RenderSpotShadowGroup(RenderSnapshot& snapshot, int group) {
+            std::vector<int>& lights = _spotGroups[group];
+            std::vector<ObjectSnapshot>& objects = snapshot.objects;
+
+            GLStateCache::Instance()->UseProgram(_depthViewportsProgram);
+            glm::mat4 viewProjections[SG_MAX_SHADOW_VIEWS];
+            glm::ivec4 tiles[SG_MAX_SHADOW_VIEWS];
+            glm::vec4 positions[SG_MAX_SHADOW_VIEWS];
+            Frustum frustums[SG_MAX_SHADOW_VIEWS];
+            _shadowCasters.clear();
+            for (int k = 0; k < lights.size(); k++) {
+                viewProjections[k] = snapshot.spotLights[lights[k]].viewProjection;
+                tiles[k] = snapshot.spotLights[lights[k]].shadowTile;
+                positions[k] = glm::vec4(snapshot.spotLights[lights[k]].position, 1);
+                frustums[k] = snapshot.spotLights[lights[k]].frustum;
+                _objectTree.QueryFrustum(frustums[k], _shadowCasters);
+            }
+            CullShadowCasters(frustums, lights.size());
+            FilterShadowCasters(snapshot, positions, lights.size());
+            GLuint programs[2] = { _depthViewportsProgram, _depthViewportsPatchProgram };
+            for (int p = 0; p < 2; p++) {
+                if (programs[p] == -1) continue;
+                GLStateCache::Instance()->UseProgram(programs[p]);
+                glUniformMatrix4fv(glGetUniformLocation(programs[p], "viewProjections"), lights.size(), false, glm::value_ptr(viewProjections[0]));
+                glUniform1i(glGetUniformLocation(programs[p], "nViews"), lights.size());
+            }
+
+            unsigned int cacheKey = snapshot.spotLights[lights[0]].shadowId;
+            RenderAtlasShadow(snapshot, cacheKey, tiles, viewProjections, lights.size(), [&](bool staticCasters) {
+                for (int k = 0; k < lights.size(); k++) {
+                    glViewportIndexedf(k, tiles[k].x, tiles[k].y, tiles[k].z, tiles[k].w);
+                }
+                for (int i = 0; i < _shadowCasters.size(); i++) {
+                    ObjectSnapshot& object = objects[_shadowCasters[i]];
+                    if (object.isStatic == staticCasters) object.DrawDepthLayered(_depthViewportsProgram, _depthViewportsPatchProgram, frustums, positions, lights.size());
+                }
+            });
+        }
+
+        void RenderPointShadow(RenderSnapshot& snapshot, PointLightSnapshot& light) {
+            std::vector<ObjectSnapshot>& objects = snapshot.objects;
+
+            GLuint programs[2] = { _depthLinearProgram, _depthLinearPatchProgram };
+            for (int p = 0; p < 2; p++) {
+                if (programs[p] == -1) continue;
+                GLStateCache::Instance()->UseProgram(programs[p]);
+                glUniform3fv(glGetUniformLocation(programs[p], "lightPos"), 1, glm::value_ptr(light.position));
+                glUniform1f(glGetUniformLocation(programs[p], "far_plane"), light.farPlane);
+                glUniformMatrix4fv(glGetUniformLocation(programs[p], "shadowMatrices"), 6, false, glm::value_ptr(light.viewProjections[0]));
+            }
+            glm::vec4 position = glm::vec4(light.position, 1);
+            glm::vec4 eyes[6] = { position, position, position, position, position, position };
+            _shadowCasters.clear();
+            _objectTree.QuerySphere(light.position, light.farPlane, _shadowCasters);
+            CullShadowCasters(light.frustums, 6);
+            FilterShadowCasters(snapshot, &position, 1);
+
+            // all six faces in one pass, the cubemap is attached as a layered target
+            RenderCubeShadow(snapshot, light, [&](bool staticCasters) {
+                glViewport(0, 0, light.shadowSize, light.shadowSize);
+                for (int i = 0; i < _shadowCasters.size(); i++) {
+                    ObjectSnapshot& object = objects[_shadowCasters[i]];
+                    if (object.isStatic == staticCasters) object.DrawDepthLayered(_depthLinearProgram, _depthLinearPatchProgram, light.frustums, eyes, 6);
+                }
+            });
+        }
+
+        void RenderShadows(RenderSnapshot& snapshot) {
+            for (int g = 0; g < _spotGroups.size(); g++) {
+                if (_spotGroups[g].size() > 1) {
+                    RenderSpotShadowGroup(snapshot, g);
+                } else {
+                    SpotLightSnapshot& light = snapshot.spotLights[_spotGroups[g][0]];
+                    RenderShadowView(snapshot, light.shadowId, light.shadowTile, light.viewProjection, light.frustum, glm::vec4(light.position, 1));
+                }
+            }
+
+            for (int i = 0; i < snapshot.directionalLights.size(); i++) {
+                DirectionalLightSnapshot& light = snapshot.directionalLights[i];
+                if (!light.visible) continue;
+                for (int c = 0; c < light.nCascades; c++) {
+                    if (light.shadowTiles[c].z == 0) continue;
+                    RenderShadowView(snapshot, light.shadowId + c, light.shadowTiles[c], light.viewProjections[c], light.frustums[c], glm::vec4(-light.direction, 0));
+                }
+            }
+
+            for (int i = 0; i < snapshot.pointLights.size(); i++) {
+                if (snapshot.pointLights[i].shadowSlot < 0) continue;
+                RenderPointShadow(snapshot, snapshot.pointLights[i]);
+            }
+
+            PruneShadowCaches();
+        }
+
+        // Simulation side, narrows the shadow projection of a light to what can matter this frame: the receivers
+        // clipped to the camera frustum and, towards the light, the casters in front of them
+        void FitShadowBounds(AngledLight3D* light, const RenderSnapshot& snapshot) {
+            glm::mat4 view = light->GetView();
+            glm::mat3 rotation = glm::mat3(view);
+            glm::mat3 absRotation = glm::mat3(glm::abs(rotation[0]), glm::abs(rotation[1]), glm::abs(rotation[2]));
+            Frustum lightFrustum = light->GetFrustum();
+
+            // light space box of the camera frustum
+            glm::vec3 cameraMin = glm::vec3(FLT_MAX), cameraMax = glm::vec3(-FLT_MAX);
+            glm::mat4 inverse = glm::inverse(snapshot.viewProjection);
+            for (int corner = 0; corner < 8; corner++) {
+                glm::vec4 ndc((corner & 1) ? 1.0f : -1.0f, (corner & 2) ? 1.0f : -1.0f, (corner & 4) ? 1.0f : -1.0f, 1.0f);
+                glm::vec4 world = inverse * ndc;
+                glm::vec3 point = glm::vec3(view * glm::vec4(glm::vec3(world) / world.w, 1));
+                cameraMin = glm::min(cameraMin, point);
+                cameraMax = glm::max(cameraMax, point);
+            }
+
+            const std::vector<ObjectSnapshot>& objects = snapshot.objects;
+            glm::vec3 receiverMin = glm::vec3(FLT_MAX), receiverMax = glm::vec3(-FLT_MAX);
+            for (int i = 0; i < objects.size(); i++) {
+                const ObjectSnapshot& object = objects[i];
+                if (!object.lit || !object.receivesShadows || !object.BoundsInFrustum(lightFrustum)) continue;
+                glm::vec3 center = glm::vec3(view * glm::vec4(object.center, 1));
+                glm::vec3 extents = absRotation * object.extents;
+                glm::vec3 boxMin = glm::max(center - extents, cameraMin);
+                glm::vec3 boxMax = glm::min(center + extents, cameraMax);
+                if (glm::any(glm::greaterThan(boxMin, boxMax))) continue;
+                receiverMin = glm::min(receiverMin, boxMin);
+                receiverMax = glm::max(receiverMax, boxMax);
+            }
+            if (receiverMin.x > receiverMax.x) {
+                light->ResetShadowBounds();
+                return;
+            }
+
+            // the view looks down -z
+            float nearPlane = -receiverMax.z;
+            float farPlane = -receiverMin.z;
+            for (int i = 0; i < objects.size(); i++) {
+                const ObjectSnapshot& object = objects[i];
+                if (!object.castsShadows || !object.BoundsInFrustum(lightFrustum)) continue;
+                glm::vec3 center = glm::vec3(view * glm::vec4(object.center, 1));
+                glm::vec3 extents = absRotation * object.extents;
+                if (light->IsOrthographic() && (glm::any(glm::greaterThan(glm::vec2(center - extents), glm::vec2(receiverMax))) ||
+                    glm::any(glm::lessThan(glm::vec2(center + extents), glm::vec2(receiverMin))))) continue;
+                // casters between the light and the receivers pull the near plane in, the others don't move it
+                nearPlane = glm::min(nearPlane, -(center.z + extents.z));
+            }
+
+            // snapped to a coarse step, so the projection (and the cached static shadows) only change when the bounds move noticeably
+            float baseNear = light->GetNearPlane();
+            float baseFar = light->GetFarPlane();
+            float step = (baseFar - baseNear) / 64;
+            nearPlane = glm::max(baseNear, glm::floor(nearPlane / step) * step);
+            farPlane = glm::min(baseFar, glm::ceil(farPlane / step) * step);
+            if (farPlane <= nearPlane) {
+                light->ResetShadowBounds();
+                return;
+            }
+
+            glm::vec2 baseHalfSize = glm::vec2(2 * light->GetFov() * light->GetAspectRatio(), 2 * light->GetFov());
+            glm::vec2 halfSize = glm::max(glm::abs(glm::vec2(receiverMin)), glm::abs(glm::vec2(receiverMax)));
+            glm::vec2 sizeStep = baseHalfSize / 32.0f;
+            halfSize = glm::min(baseHalfSize, glm::max(glm::ceil(halfSize / sizeStep), glm::vec2(1)) * sizeStep);
+            light->FitShadowBounds(nearPlane, farPlane, halfSize);
+        }
+
+        // Everything the simulation moved since the last snapshot gets its matrices rebuilt here, once,
+        // whatever the number of transform changes. The reads below only hit the cached values
+        void UpdateWorlds() {
+            _mainCamera->UpdateWorld();
+            for (int i = 0; i < _objects.size(); i++) _objects[i]->UpdateWorld();
+            for (int i = 0; i < _spotLights.size(); i++) _spotLights[i]->UpdateWorld();
+            for (int i = 0; i < _directionalLights.size(); i++) _directionalLights[i]->UpdateWorld();
+            for (int i = 0; i < _pointLights.size(); i++) _pointLights[i]->UpdateWorld();
+        }
+
+        // Simulation side: copies the state of the scene that the next frame is going to show
+        void BuildSnapshot(RenderSnapshot& snapshot) {
+            UpdateWorlds();
+            snapshot.view = _mainCamera->GetView();
+            snapshot.projection = _mainCamera->GetProjection();
+            snapshot.viewProjection = _mainCamera->GetViewProjection();
+            snapshot.frustum = _mainCamera->GetFrustum();
+            snapshot.nearPlane = _mainCamera->GetNearPlane();
+            snapshot.farPlane = _mainCamera->GetFarPlane();
+            snapshot.cameraPosition = _mainCamera->GetGlobalPosition();
+            snapshot.projectionScale = _mainCamera->GetProjection()[1][1];
+            snapshot.width = _width;
+            snapshot.height = _height;
+            snapshot.showTriangulation = _showTriangulation;
+            snapshot.renderMode = _renderMode;
+            snapshot.depthPrePass = _depthPrePass;
+
+            snapshot.objects.resize(_objects.size());
+            snapshot.nStaticCasters = 0;
+            for (int i = 0; i < _objects.size(); i++) {
+                if (_objects[i]->FillSnapshot(snapshot.objects[i])) _staticVersion++;
+                if (_objects[i]->Static && _objects[i]->CastsShadows) snapshot.nStaticCasters++;
+            }
+            snapshot.staticVersion = _staticVersion;
 
-            glUseProgram(_depthLinearProgram);
+            // baked lights are already in the lightmaps
+            snapshot.spotLights.resize(_spotLights.size());
+            int nSpots = 0;
+            for (int i = 0; i < _spotLights.size(); i++) {
+                if (_spotLights[i]->IsBaked()) continue;
+                SpotLightSnapshot& light = snapshot.spotLights[nSpots++];
+                light.position = _spotLights[i]->GetGlobalPosition();
+                light.color = _spotLights[i]->GetColor();
+                light.intensity = _spotLights[i]->GetIntensity();
+                light.range = _spotLights[i]->GetRange();
+                if (_spotLights[i]->IsShadowFitting()) FitShadowBounds(_spotLights[i], snapshot);
+                light.shadowMatrix = _spotLights[i]->GetShadow();
+                light.viewProjection = _spotLights[i]->GetShadowViewProjection();
+                light.frustum = _spotLights[i]->GetShadowFrustum();
+                light.shadowId = _spotLights[i]->GetShadowId();
+                light.shadowWidth = _spotLights[i]->GetShadowWidth();
+                light.shadowHeight = _spotLights[i]->GetShadowHeight();
+                light.mapTexture = _spotLights[i]->GetMapTexture();
+                light.visible = _spotLights[i]->FrustumCheck(snapshot.frustum);
+            }
+            snapshot.spotLights.resize(nSpots);
+
+            snapshot.directionalLights.resize(_directionalLights.size());
+            int nDirectionals = 0;
+            for (int i = 0; i < _directionalLights.size(); i++) {
+                if (_directionalLights[i]->IsBaked()) continue;
+                DirectionalLightSnapshot& light = snapshot.directionalLights[nDirectionals++];
+                light.direction = _directionalLights[i]->GlobalForward();
+                light.color = _directionalLights[i]->GetColor();
+                light.intensity = _directionalLights[i]->GetIntensity();
+                light.shadowId = _directionalLights[i]->GetShadowId();
+                light.shadowWidth = _directionalLights[i]->GetShadowWidth();
+                light.shadowHeight = _directionalLights[i]->GetShadowHeight();
+                light.nCascades = _directionalLights[i]->GetCascades();
+                if (light.nCascades > 1) {
+                    _directionalLights[i]->FitCascades(_mainCamera);
+                    light.cascadeSplits = _directionalLights[i]->GetCascadeSplits();
+                    for (int c = 0; c < light.nCascades; c++) {
+                        light.shadowMatrices[c] = _directionalLights[i]->GetCascadeShadow(c);
+                        light.viewProjections[c] = _directionalLights[i]->GetCascadeViewProjection(c);
+                        light.frustums[c] = _directionalLights[i]->GetCascadeFrustum(c);
+                    }
+                    // the cascades follow the camera, there is always something to shadow
+                    light.visible = true;
+                } else {
+                    if (_directionalLights[i]->IsShadowFitting()) FitShadowBounds(_directionalLights[i], snapshot);
+                    light.cascadeSplits = glm::vec4(FLT_MAX);
+                    light.shadowMatrices[0] = _directionalLights[i]->GetShadow();
+                    light.viewProjections[0] = _directionalLights[i]->GetShadowViewProjection();
+                    light.frustums[0] = _directionalLights[i]->GetShadowFrustum();
+                    light.visible = _directionalLights[i]->FrustumCheck(snapshot.frustum);
+                }
+            }
+            snapshot.directionalLights.resize(nDirectionals);
 
+            snapshot.pointLights.resize(_pointLights.size());
+            int nPoints = 0;
             for (int i = 0; i < _pointLights.size(); i++) {
-                if (!_pointLights[i]->FrustumCheck(_mainCamera->GetFrustum())) continue;
-                glBindFramebuffer(GL_DRAW_FRAMEBUFFER, _pointLights[i]->GetShadowBuffer().bufferIndex);
+                if (_pointLights[i]->IsBaked()) continue;
+                PointLightSnapshot& light = snapshot.pointLights[nPoints++];
+                light.position = _pointLights[i]->GetGlobalPosition();
+                light.color = _pointLights[i]->GetColor();
+                light.intensity = _pointLights[i]->GetIntensity();
+                light.range = _pointLights[i]->GetRange();
+                light.farPlane = _pointLights[i]->GetFarPlane();
                 for (int face = 0; face < 6; face++) {
-                    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, _pointLights[i]->GetShadowTexture(), 0);
-                    glClear(GL_DEPTH_BUFFER_BIT);
-                    glViewport(0, 0, _pointLights[i]->GetShadowWidth(), _pointLights[i]->GetShadowHeight());
-
-                    glUniform3fv(glGetUniformLocation(_depthLinearProgram, "lightPos"), 1, glm::value_ptr(_pointLights[i]->GetGlobalPosition()));
-                    glUniform1f(glGetUniformLocation(_depthLinearProgram, "far_plane"), _pointLights[i]->GetFarPlane());
-
-                    for (int j = 0; j < _objects.size(); j++) {
-                        if (_objects[j]->CastsShadows) {
-                            glUniformMatrix4fv(glGetUniformLocation(_depthLinearProgram, "model"), 1, false, glm::value_ptr(_objects[j]->GetModelMatrix()));
-                            _objects[j]->Draw(_depthLinearProgram, _pointLights[i]->GetViewProjection(face), _pointLights[i]->GetFrustum(face));
-                        }
-                    }
+                    light.viewProjections[face] = _pointLights[i]->GetViewProjection(face);
+                    light.frustums[face] = _pointLights[i]->GetFrustum(face);
+                }
+                light.shadowId = _pointLights[i]->GetShadowId();
+                light.shadowWidth = _pointLights[i]->GetShadowWidth();
+                light.shadowHeight = _pointLights[i]->GetShadowHeight();
+                light.castsShadows = _pointLights[i]->IsShadowCasting();
+                light.visible = _pointLights[i]->FrustumCheck(snapshot.frustum);
+            }
+            snapshot.pointLights.resize(nPoints);
+
+            snapshot.ambientLights.resize(_ambientLights.size());
+            int nAmbients = 0;
+            for (int i = 0; i < _ambientLights.size(); i++) {
+                if (_ambientLights[i]->IsBaked()) continue;
+                snapshot.ambientLights[nAmbients].color = _ambientLights[i]->GetColor();
+                snapshot.ambientLights[nAmbients].intensity = _ambientLights[i]->GetIntensity();
+                nAmbients++;
+            }
+            snapshot.ambientLights.resize(nAmbients);
+        }
+
+        void DrawLitObject(const RenderSnapshot& snapshot, ObjectSnapshot& object, GLuint program) {
+            glm::mat4 model = object.modelMatrix;
+            StreamAllocation allocation = _objectStream->Allocate(sizeof(ObjectData));
+            if (allocation.data == NULL) return;
+            ObjectData* data = (ObjectData*)allocation.data;
+            data->mvp = snapshot.viewProjection * model;
+            data->mv = snapshot.view * model;
+            data->modelMat = model;
+            data->mvt = glm::mat4(glm::transpose(glm::inverse(glm::mat3(data->mv))));
+            _objectStream->BindRange(ObjectDataBinding, allocation);
+
+            object.Draw(program, snapshot.viewProjection, snapshot.frustum, glm::vec4(snapshot.cameraPosition, 1));
+        }
+
+        void DrawForwardObject(const RenderSnapshot& snapshot, ObjectSnapshot& object) {
+            bool conditional = BeginOcclusionCondition(object);
+            if (object.lit && object.lightmap != 0) {
+                GLStateCache::Instance()->BindTexture(_lightmapTextureUnit, GL_TEXTURE_2D, object.lightmap);
+                SetObjectLights(snapshot, object, _lightmappedProgram);
+                DrawLitObject(snapshot, object, _lightmappedProgram);
+            } else if (object.lit) {
+                GLuint program = object.receivesShadows ? _shadowedProgram : _litProgram;
+                SetObjectLights(snapshot, object, program);
+                DrawLitObject(snapshot, object, program);
+            } else {
+                object.Draw(_unlitProgram, snapshot.viewProjection, snapshot.frustum, glm::vec4(snapshot.cameraPosition, 1));
+            }
+            if (conditional) glEndConditionalRender();
+        }
+
+        // Tessellated objects displace their surface after the vertex shader, _depthProgram can't reproduce it.
+        // See-through objects stay out too, their depth would hide what is behind them
+        bool InDepthPrePass(const ObjectSnapshot& object) const {
+            return object.patches == 0 && object.IsOpaque();
+        }
+
+        void RenderDepthPrePass(RenderSnapshot& snapshot) {
+            std::vector<ObjectSnapshot>& objects = snapshot.objects;
+            glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+            for (int k = 0; k < _visibleObjects.size(); k++) {
+                ObjectSnapshot& object = objects[_visibleObjects[k]];
+                if (!InDepthPrePass(object)) continue;
+                bool conditional = BeginOcclusionCondition(object);
+                object.DrawDepth(_depthProgram, _depthPatchProgram, snapshot.viewProjection, snapshot.frustum, glm::vec4(snapshot.cameraPosition, 1));
+                if (conditional) glEndConditionalRender();
+            }
+            glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+        }
+
+        // Lit objects write their surface into the g-buffer, then a full screen triangle evaluates the same lights as the
+        // forward shaders (clusters for the point lights) once per pixel and writes the depth for what comes after
+        void RenderDeferredPass(RenderSnapshot& snapshot) {
+            std::vector<ObjectSnapshot>& objects = snapshot.objects;
+            _gBuffer.Resize(snapshot.width, snapshot.height);
+            GLStateCache::Instance()->BindFramebuffer(GL_DRAW_FRAMEBUFFER, _gBuffer.bufferIndex);
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            GLStateCache::Instance()->UseProgram(_gBufferProgram);
+            GLint receivesShadows = glGetUniformLocation(_gBufferProgram, "receivesShadows");
+            for (int k = 0; k < _visibleObjects.size(); k++) {
+                ObjectSnapshot& object = objects[_visibleObjects[k]];
+                if (!object.lit || object.lightmap != 0) continue;
+                GLStateCache::Instance()->UseProgram(_gBufferProgram);
+                glUniform1i(receivesShadows, object.receivesShadows ? 1 : 0);
+                bool conditional = BeginOcclusionCondition(object);
+                DrawLitObject(snapshot, object, _gBufferProgram);
+                if (conditional) glEndConditionalRender();
+            }
+
+            GLStateCache::Instance()->BindFramebuffer(GL_DRAW_FRAMEBUFFER, _origFB);
+            GLStateCache::Instance()->BindTexture(0, GL_TEXTURE_2D, _gBuffer.albedoTexture);
+            GLStateCache::Instance()->BindTexture(1, GL_TEXTURE_2D, _gBuffer.specularTexture);
+            GLStateCache::Instance()->BindTexture(_gBufferTextureUnit, GL_TEXTURE_2D, _gBuffer.normalTexture);
+            GLStateCache::Instance()->BindTexture(_gBufferTextureUnit + 1, GL_TEXTURE_2D, _gBuffer.depthTexture);
+            GLStateCache::Instance()->UseProgram(_deferredProgram);
+            glUniform1i(glGetUniformLocation(_deferredProgram, "gAlbedo"), 0);
+            glUniform1i(glGetUniformLocation(_deferredProgram, "gSpecular"), 1);
+            glUniform1i(glGetUniformLocation(_deferredProgram, "gNormal"), _gBufferTextureUnit);
+            glUniform1i(glGetUniformLocation(_deferredProgram, "gDepth"), _gBufferTextureUnit + 1);
+            glUniformMatrix4fv(glGetUniformLocation(_deferredProgram, "inverseProjection"), 1, false, glm::value_ptr(glm::inverse(snapshot.projection)));
+            glUniformMatrix4fv(glGetUniformLocation(_deferredProgram, "inverseView"), 1, false, glm::value_ptr(glm::inverse(snapshot.view)));
+            glDepthFunc(GL_ALWAYS);
+            GLStateCache::Instance()->BindVertexArray(_fullscreenVao);
+            glDrawArrays(GL_TRIANGLES, 0, 3);
+            glDepthFunc(GL_LESS);
+
+            // the g-buffer has no room for the lightmap, lightmapped objects are shaded forward against the resolved depth
+            for (int k = 0; k < _visibleObjects.size(); k++) {
+                ObjectSnapshot& object = objects[_visibleObjects[k]];
+                if (!object.lit || object.lightmap != 0) DrawForwardObject(snapshot, object);
+            }
+        }
+
+        // Render side: only reads the snapshot, never the live scene
+        void DrawSnapshot(RenderSnapshot& snapshot) {
+            GLStateCache::Instance()->BeginFrame();
+            glBeginQuery(GL_TIME_ELAPSED, _frameQueries[_frameQuery]);
+
+            _shadowFrame++;
+            UpdateObjectTree(snapshot);
+            RenderOccluders(snapshot);
+            HideQueriedLights(snapshot);
+            ApplyLightBudget(snapshot);
+            ChooseShadowSizes(snapshot);
+            AssignShadowTiles(snapshot);
+            AssignPointShadowMaps(snapshot);
+            GroupSpotLights(snapshot);
+            UpdateLights(snapshot);
+            CollectVisibleObjects(snapshot);
+            RenderShadows(snapshot);
+            HideLevelClusters(snapshot);
+
+            _objectStream->BeginFrame();
+
+            GLStateCache::Instance()->BindFramebuffer(GL_DRAW_FRAMEBUFFER, _origFB);
+            glViewport(0, 0, snapshot.width, snapshot.height);
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+            std::vector<ObjectSnapshot>& objects = snapshot.objects;
+            if (snapshot.renderMode == RenderDeferred) {
+                RenderDeferredPass(snapshot);
+            } else if (snapshot.depthPrePass) {
+                RenderDepthPrePass(snapshot);
+                // the depth is final, only the fragments that match it get shaded
+                glDepthFunc(GL_EQUAL);
+                glDepthMask(GL_FALSE);
+                for (int k = 0; k < _visibleObjects.size(); k++) {
+                    ObjectSnapshot& object = objects[_visibleObjects[k]];
+                    if (InDepthPrePass(object)) DrawForwardObject(snapshot, object);
+                }
+                glDepthFunc(GL_LESS);
+                glDepthMask(GL_TRUE);
+                for (int k = 0; k < _visibleObjects.size(); k++) {
+                    ObjectSnapshot& object = objects[_visibleObjects[k]];
+                    if (!InDepthPrePass(object) && object.IsOpaque()) DrawForwardObject(snapshot, object);
+                }
+                // see-through objects last, tested against the finished depth without adding to it
+                glDepthFunc(GL_LEQUAL);
+                glDepthMask(GL_FALSE);
+                for (int k = 0; k < _visibleObjects.size(); k++) {
+                    ObjectSnapshot& object = objects[_visibleObjects[k]];
+                    if (!object.IsOpaque()) DrawForwardObject(snapshot, object);
+                }
+                glDepthFunc(GL_LESS);
+                glDepthMask(GL_TRUE);
+            } else {
+                for (int k = 0; k < _visibleObjects.size(); k++) {
+                    DrawForwardObject(snapshot, objects[_visibleObjects[k]]);
+                }
+            }
+
+            IssueOcclusionQueries(snapshot);
+
+            if (snapshot.showTriangulation) {
+                for (int k = 0; k < _visibleObjects.size(); k++) {
+                    objects[_visibleObjects[k]].Draw(_triangulationProgram, snapshot.viewProjection, snapshot.frustum, glm::vec4(snapshot.cameraPosition, 1));
+                }
+            }
+
+            if (_skybox.IsPresent()) {
+                _skybox.RenderSkybox(snapshot.viewProjection);
+            }
+
+            _objectStream->EndFrame();
+
+            glEndQuery(GL_TIME_ELAPSED);
+            _frameQueryIssued[_frameQuery] = true;
+            _frameQuery = 1 - _frameQuery;
+            GLuint available = 0;
+            GLuint64 gpuTime = 0;
+            if (_frameQueryIssued[_frameQuery]) glGetQueryObjectuiv(_frameQueries[_frameQuery], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (available) glGetQueryObjectui64v(_frameQueries[_frameQuery], GL_QUERY_RESULT, &gpuTime);
+
+            glfwSwapBuffers(_window);
+            double now = sg::getCurrentTimeMillis();
+
+            std::lock_guard<std::mutex> lock(GLTaskQueue::Instance()->GetMutex());
+            _lastStateCounters = GLStateCache::Instance()->GetFrameCounters();
+            if (available) _lastGPUFrameTime = gpuTime / 1000000.0;
+            if (_lastPresentTime > 0 && now > _lastPresentTime) _presentedFrameRate = (int)(1000 / ((now - _lastPresentTime) / 1000));
+            _lastPresentTime = now;
+        }
+
+        void RenderLoop() {
+            glfwMakeContextCurrent(_window);
+            GLTaskQueue* queue = GLTaskQueue::Instance();
+            std::unique_lock<std::mutex> lock(queue->GetMutex());
+            while (true) {
+                queue->GetCondition().wait(lock, [&]() { return _stopRenderThread || _pendingSnapshot != -1 || queue->HasTasks(); });
+                if (_pendingSnapshot != -1) {
+                    // a submitted snapshot is drawn before any task posted after it, those may delete what it references
+                    int index = _pendingSnapshot;
+                    _drawingSnapshot = index;
+                    _pendingSnapshot = -1;
+                    lock.unlock();
+                    DrawSnapshot(_snapshots[index]);
+                    lock.lock();
+                    _drawingSnapshot = -1;
+                    queue->GetCondition().notify_all();
+                } else if (queue->HasTasks()) {
+                    queue->ExecuteOne(lock);
+                } else if (_stopRenderThread) {
+                    break;
                 }
             }
+            lock.unlock();
+            glfwMakeContextCurrent(NULL);
+        }
+
+        RenderSnapshot& AcquireSnapshot() {
+            std::unique_lock<std::mutex> lock(GLTaskQueue::Instance()->GetMutex());
+            GLTaskQueue::Instance()->GetCondition().wait(lock, [&]() { return _drawingSnapshot != _writeSnapshot; });
+            return _snapshots[_writeSnapshot];
+        }
+
+        void SubmitSnapshot() {
+            std::lock_guard<std::mutex> lock(GLTaskQueue::Instance()->GetMutex());
+            // a snapshot that has not been picked up yet is replaced, the render thread always gets the latest state
+            _pendingSnapshot = _writeSnapshot;
+            _writeSnapshot = 1 - _writeSnapshot;
+            GLTaskQueue::Instance()->GetCondition().notify_all();
         }
 
     public:
@@ -224,12 +1526,6 @@ namespace sg {
 
             glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &_origFB);
 
-            glGenVertexArrays(1, &_vao);
-            glBindVertexArray(_vao);
-            glEnableVertexAttribArray(0);
-            glEnableVertexAttribArray(1);
-            glEnableVertexAttribArray(2);
-
             glPatchParameteri(GL_PATCH_VERTICES, 4);
             glEnable(GL_DEPTH_TEST);
             glEnable(GL_MULTISAMPLE);
@@ -237,10 +1533,45 @@ namespace sg {
 
             _shadowedProgram = sg::CreateProgram("shaders/vertexShader_shadowed.glsl", "shaders/fragmentShader_shadowed.glsl");
             _depthProgram = sg::CreateProgram("shaders/vertexShader_depth.glsl", "shaders/fragmentShader_depth.glsl");
-            _depthLinearProgram = sg::CreateProgram("shaders/vertexShader_depth_linear.glsl", "shaders/fragmentShader_depth_linear.glsl");
+            _depthLinearProgram = sg::CreateProgram("shaders/vertexShader_depth_linear.glsl", "shaders/fragmentShader_depth_linear.glsl", "shaders/geometryShader_depth_linear.glsl");
+            if (GLEW_VERSION_4_1 || GLEW_ARB_viewport_array) {
+                _depthViewportsProgram = sg::CreateProgram("shaders/vertexShader_depth_linear.glsl", "shaders/fragmentShader_depth.glsl", "shaders/geometryShader_depth_viewports.glsl");
+            }
+            if (GLEW_VERSION_4_0 || GLEW_ARB_tessellation_shader) {
+                _depthPatchProgram = sg::CreateProgram("shaders/vertexShader_normalmapping.glsl", "shaders/fragmentShader_depth.glsl",
+                    "shaders/tessellationControlShader_quad.glsl", "shaders/tessellationEvaluationShader_depth.glsl");
+                _depthLinearPatchProgram = sg::CreateProgram("shaders/vertexShader_normalmapping.glsl", "shaders/fragmentShader_depth_linear.glsl",
+                    "shaders/tessellationControlShader_quad.glsl", "shaders/tessellationEvaluationShader_depth.glsl", "shaders/geometryShader_depth_linear.glsl");
+                if (_depthViewportsProgram != -1) {
+                    _depthViewportsPatchProgram = sg::CreateProgram("shaders/vertexShader_normalmapping.glsl", "shaders/fragmentShader_depth.glsl",
+                        "shaders/tessellationControlShader_quad.glsl", "shaders/tessellationEvaluationShader_depth.glsl", "shaders/geometryShader_depth_viewports.glsl");
+                }
+                GLuint patchPrograms[3] = { _depthPatchProgram, _depthLinearPatchProgram, _depthViewportsPatchProgram };
+                for (int p = 0; p < 3; p++) {
+                    if (patchPrograms[p] == -1) continue;
+                    GLStateCache::Instance()->UseProgram(patchPrograms[p]);
+                    glUniform1f(glGetUniformLocation(patchPrograms[p], "level"), _tessellationLevel);
+                }
+            }
             _unlitProgram = sg::CreateProgram("shaders/vertexShader_unlit.glsl", "shaders/fragmentShader_unlit.glsl");
             _litProgram = sg::CreateProgram("shaders/vertexShader_lit.glsl", "shaders/fragmentShader_lit.glsl");
             _triangulationProgram = sg::CreateProgram("shaders/vertexShader_triangulation.glsl", "shaders/fragmentShader_triangulation.glsl", "shaders/geometryShader_triangulation.glsl");
+            _gBufferProgram = sg::CreateProgram("shaders/vertexShader_shadowed.glsl", "shaders/fragmentShader_gbuffer.glsl");
+            _deferredProgram = sg::CreateProgram("shaders/vertexShader_fullscreen.glsl", "shaders/fragmentShader_deferred.glsl");
+            _lightmappedProgram = sg::CreateProgram("shaders/vertexShader_lightmapped.glsl", "shaders/fragmentShader_lightmapped.glsl");
+
+            glUniformBlockBinding(_shadowedProgram, glGetUniformBlockIndex(_shadowedProgram, "ObjectData"), ObjectDataBinding);
+            glUniformBlockBinding(_litProgram, glGetUniformBlockIndex(_litProgram, "ObjectData"), ObjectDataBinding);
+            glUniformBlockBinding(_gBufferProgram, glGetUniformBlockIndex(_gBufferProgram, "ObjectData"), ObjectDataBinding);
+            glUniformBlockBinding(_lightmappedProgram, glGetUniformBlockIndex(_lightmappedProgram, "ObjectData"), ObjectDataBinding);
+            // core profile draws need a vertex array even when the vertices come from gl_VertexID
+            glGenVertexArrays(1, &_fullscreenVao);
+            glGenQueries(2, _frameQueries);
+            _objectQueries.Create();
+            _lightQueries.Create();
+            _objectStream = new StreamBuffer(GL_UNIFORM_BUFFER, ObjectStreamFrameSize);
+            _copyImage = GLEW_VERSION_4_3 || GLEW_ARB_copy_image;
+            _shadowAtlas = new ShadowAtlas(ShadowAtlasSizeForBudget(), _shadowDepthFormat);
 
             return 0;
         }
@@ -254,11 +1585,119 @@ namespace sg {
             _showTriangulation = t;
         }
 
+        // Takes effect from the next snapshot, both modes use the same lights and shadow maps
+        void SetRenderMode(RenderMode mode) {
+            _renderMode = mode;
+        }
+
+        RenderMode GetRenderMode() {
+            return _renderMode;
+        }
+
+        // Most lights drawn per frame, spot and point lights together
+        void SetLightBudget(int budget) {
+            _lightBudget = budget;
+        }
+
+        // Pays off when the shading is expensive and objects overlap, costs a second geometry pass otherwise
+        void SetDepthPrePass(bool prePass) {
+            _depthPrePass = prePass;
+        }
+
+        void SetSpotShadowGroupRadius(float radius) {
+            _spotGroupRadius = radius;
+        }
+
+        // The static copies count against the shadow memory budget, the atlas is resized to match
+        void SetShadowCaching(bool caching) {
+            GLTaskQueue::Instance()->Run([this, caching]() {
+                _shadowCaching = caching;
+                FitShadowAtlas();
+            });
+        }
+
+        // Whether the shadow maps keep the object in their static cache rather than redrawing it every frame
+        bool InStaticShadowCache(Object3D* obj) {
+            return _shadowCaching && obj->Static && obj->CastsShadows;
+        }
+
+        // GL_DEPTH_COMPONENT16 halves the shadow memory, GL_DEPTH_COMPONENT32F (default) keeps the precision for long ranges
+        void SetShadowDepthFormat(GLenum format) {
+            GLTaskQueue::Instance()->Run([this, format]() {
+                if (format == _shadowDepthFormat) return;
+                _shadowDepthFormat = format;
+                if (_shadowAtlas != NULL) ResetShadowMaps();
+            });
+        }
+
+        // Bytes of all the shadow textures, the atlas takes the largest power of two size that fits three quarters of it
+        void SetShadowMemoryBudget(size_t bytes) {
+            GLTaskQueue::Instance()->Run([this, bytes]() {
+                _shadowMemoryBudget = bytes;
+                FitShadowAtlas();
+            });
+        }
+
+        // How far an object moves before the culling tree reinserts it, larger margins mean fewer updates and looser bounds
+        void SetCullingMargin(float margin) {
+            GLTaskQueue::Instance()->Run([this, margin]() { _objectTree.SetMargin(margin); });
+        }
+
+        // Static geometry that hides what is behind it, copied as it is placed now with its vertices merged on a grid of cellSize
+        void AddOccluder(Object3D* object, float cellSize = 1.0f) {
+            GLTaskQueue::Instance()->Run([this, object, cellSize]() { _occlusionCuller.AddOccluder(object, cellSize); });
+        }
+
+        void SetOcclusionCulling(bool enabled) {
+            GLTaskQueue::Instance()->Run([this, enabled]() { _occlusionCulling = enabled; });
+        }
+
+        // Occlusion queries for the dynamic objects and the lights, for scenes where the CPU occluders don't cover enough
+        // The set stays owned by the caller, NULL before deleting it
+        void SetVisibilitySet(PotentiallyVisibleSet* visibilitySet) {
+            GLTaskQueue::Instance()->Run([this, visibilitySet]() { _visibilitySet = visibilitySet; });
+        }
+
+        void SetOcclusionQueries(bool enabled) {
+            GLTaskQueue::Instance()->Run([this, enabled]() { _occlusionQueries = enabled; });
+        }
+
+        // Size of the CPU depth buffer, coarser is faster but hides less
+        void SetOcclusionResolution(int width, int height) {
+            GLTaskQueue::Instance()->Run([this, width, height]() { _occlusionCuller.SetResolution(width, height); });
+        }
+
         GLFWwindow* GetWindow() {
             return _window;
         }
 
+        // Moves the GL context to a dedicated thread, RenderFrame then only runs the simulation and
+        // hands the snapshot over, so the next update overlaps with the drawing of the previous one
+        void StartRenderThread() {
+            if (_threaded) return;
+            _threaded = true;
+            _stopRenderThread = false;
+            glfwMakeContextCurrent(NULL);
+            _renderThread = std::thread(&Renderer::RenderLoop, this);
+            GLTaskQueue::Instance()->SetOwner(_renderThread.get_id());
+        }
+
+        void StopRenderThread() {
+            if (!_threaded) return;
+            {
+                std::lock_guard<std::mutex> lock(GLTaskQueue::Instance()->GetMutex());
+                _stopRenderThread = true;
+                GLTaskQueue::Instance()->GetCondition().notify_all();
+            }
+            _renderThread.join();
+            GLTaskQueue::Instance()->ClearOwner();
+            glfwMakeContextCurrent(_window);
+            _threaded = false;
+        }
+
+        // The GL context goes away with the window, models and everything else owning GL objects must be deleted before
         void DestroyWindow() {
+            StopRenderThread();
             if (_window != NULL) {
                 glfwDestroyWindow(_window);
                 _window = NULL;
@@ -274,8 +1713,9 @@ namespace sg {
         }
 
         void AddObject(Object3D* obj) {
-            obj->GetModel()->SetVBO(_vao);
+            obj->GetModel()->InitBuffers();
             _objects.push_back(obj);
+            if (obj->Static) _staticVersion++;
         }
 
         void AddLight(Light* light) {
@@ -321,6 +1761,7 @@ namespace sg {
             }
             if (index >= 0) {
                 _objects.erase(std::next(_objects.begin(), index));
+                if (obj->Static) _staticVersion++;
             }
         }
 
@@ -350,7 +1791,7 @@ namespace sg {
 
         void SetSkybox(const char* posx, const char* negx, const char* posy, const char* negy, const char* posz, const char* negz) {
             const char* textureFaces[6] = { posx, negx, posy, negy, posz, negz };
-            _skybox.InitSkybox(textureFaces, _vao);
+            GLTaskQueue::Instance()->Run([&]() { _skybox.InitSkybox(textureFaces); });
         }
 
         void RemoveAllEntities() {
@@ -358,6 +1799,7 @@ namespace sg {
                 _entities.erase(_entities.begin());
             while (_objects.size() > 0)
                 _objects.erase(_objects.begin());
+            _staticVersion++;
             while (_spotLights.size() > 0)
                 _spotLights.erase(_spotLights.begin());
             while (_pointLights.size() > 0)
@@ -379,59 +1821,41 @@ namespace sg {
             SetMainCamera(camera);
         }
 
+        GLStateCounters GetLastFrameStateCounters() {
+            std::lock_guard<std::mutex> lock(GLTaskQueue::Instance()->GetMutex());
+            return _lastStateCounters;
+        }
+
+        // Milliseconds the GPU spent on the frame before the last one, to compare the render modes
+        double GetLastFrameGPUTime() {
+            std::lock_guard<std::mutex> lock(GLTaskQueue::Instance()->GetMutex());
+            return _lastGPUFrameTime;
+        }
+
+        // Runs one simulation step and returns the rate at which frames were last presented. With the render thread
+        // that is its own pace, not the one of the simulation
         int RenderFrame() {
             double start = sg::getCurrentTimeMillis();
 
             UpdateOrStart();
-            UpdateLights();
-
-            RenderShadows();
-
-            glBindFramebuffer(GL_DRAW_FRAMEBUFFER, _origFB);
-            glViewport(0, 0, _width, _height);
-            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-            for (int i = 0; i < _objects.size(); i++) {
-                if (_objects[i]->Lit) {
-                    GLuint program = _objects[i]->ReceivesShadows ? _shadowedProgram : _litProgram;
-                    glm::mat4 mv = _mainCamera->GetView() * _objects[i]->GetModelMatrix();
-                    sg::SetMatrix(mv, program, "mv");
-                    sg::SetMatrix(_objects[i]->GetModelMatrix(), program, "modelMat");
-                    sg::SetMatrix(glm::transpose(glm::inverse(glm::mat3(mv))), program, "mvt");
-                    for (int j = 0; j < _spotLights.size(); j++) {
-                        std::string str = std::string("spotShadowMatrices[").append(std::to_string(j)).append("]");
-                        sg::SetMatrix(_spotLights[j]->GetShadow() * _objects[i]->GetModelMatrix(), program, str.c_str());
-                    }
-                    for (int j = 0; j < _directionalLights.size(); j++) {
-                        std::string str = std::string("dirShadowMatrices[").append(std::to_string(j)).append("]");
-                        sg::SetMatrix(_directionalLights[j]->GetShadow() * _objects[i]->GetModelMatrix(), program, str.c_str());
-                    }
-
-                    _objects[i]->Draw(program, _mainCamera->GetViewProjection(), _mainCamera->GetFrustum());
-                } else {
-                    _objects[i]->Draw(_unlitProgram, _mainCamera->GetViewProjection(), _mainCamera->GetFrustum());
-                }
-            }
 
-            if (_showTriangulation) {
-                for (int i = 0; i < _objects.size(); i++) {
-                    _objects[i]->Draw(_triangulationProgram, _mainCamera->GetViewProjection(), _mainCamera->GetFrustum());
-                }
+            if (_threaded) {
+                RenderSnapshot& snapshot = AcquireSnapshot();
+                BuildSnapshot(snapshot);
+                SubmitSnapshot();
+            } else {
+                BuildSnapshot(_snapshots[0]);
+                DrawSnapshot(_snapshots[0]);
             }
 
-            if (_skybox.IsPresent()) {
-                _skybox.RenderSkybox(_mainCamera);
-            }
-
-            glfwSwapBuffers(_window);
-
             double elapsed = (sg::getCurrentTimeMillis() - start) / 1000;
             double sleepTime = glm::max(0.0, (_timestep - elapsed));
             std::this_thread::sleep_for(std::chrono::milliseconds((long)sleepTime));
 
             _lastDt = (sg::getCurrentTimeMillis() - start) / 1000;
 
-            return (int)(1000 / _lastDt);
+            std::lock_guard<std::mutex> lock(GLTaskQueue::Instance()->GetMutex());
+            return _presentedFrameRate;
         }
 	};
 }
\ No newline at end of file
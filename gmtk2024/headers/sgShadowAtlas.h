@@ -0,0 +1,184 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <vector>
+#include <unordered_map>
+#include <iostream>
+#include <sgStructures.h>
+#include <sgGLStateCache.h>
+
+namespace sg {
+	struct ShadowAtlasTile {
+		int node;
+		int requestedSize;
+		glm::ivec4 rect;
+		unsigned int lastUsed;
+	};
+
+	// One depth texture shared by all the spot and directional shadow maps.
+	// Tiles are square power of two regions handed out by a quadtree, each light keeps its tile while it is used
+	class ShadowAtlas {
+	private:
+		enum NodeState : unsigned char {
+			NodeFree = 0,
+			NodeSplit,
+			NodeUsed
+		};
+
+		int _size;
+		int _minTileSize;
+		int _maxLevel;
+		std::vector<unsigned char> _nodes;
+		std::unordered_map<unsigned int, ShadowAtlasTile> _tiles;
+		FrameBuffer* _buffer;
+		FrameBuffer* _staticBuffer;
+		bool _shrinkReported;
+		GLenum _depthFormat;
+
+		int LevelForSize(int size) {
+			int tileSize = _size;
+			int level = 0;
+			while (level < _maxLevel && tileSize / 2 >= size) {
+				tileSize /= 2;
+				level++;
+			}
+			return level;
+		}
+
+		int Allocate(int node, int level, int targetLevel, int x, int y, int size, glm::ivec4& rect) {
+			if (level == targetLevel) {
+				if (_nodes[node] != NodeFree) return -1;
+				_nodes[node] = NodeUsed;
+				rect = glm::ivec4(x, y, size, size);
+				return node;
+			}
+			if (_nodes[node] == NodeUsed) return -1;
+			_nodes[node] = NodeSplit;
+
+			int half = size / 2;
+			for (int c = 0; c < 4; c++) {
+				int found = Allocate(4 * node + 1 + c, level + 1, targetLevel, x + (c & 1) * half, y + (c >> 1) * half, half, rect);
+				if (found >= 0) return found;
+			}
+			if (ChildrenFree(node)) _nodes[node] = NodeFree;
+			return -1;
+		}
+
+		bool ChildrenFree(int node) {
+			for (int c = 1; c <= 4; c++) {
+				if (_nodes[4 * node + c] != NodeFree) return false;
+			}
+			return true;
+		}
+
+		void Free(int node) {
+			_nodes[node] = NodeFree;
+			while (node > 0) {
+				node = (node - 1) / 4;
+				if (!ChildrenFree(node)) break;
+				_nodes[node] = NodeFree;
+			}
+		}
+
+	public:
+		ShadowAtlas(int size, GLenum depthFormat = GL_DEPTH_COMPONENT32F, int minTileSize = 64) {
+			_size = size;
+			_depthFormat = depthFormat;
+			_minTileSize = minTileSize;
+			_maxLevel = 0;
+			while ((size >> _maxLevel) > minTileSize) _maxLevel++;
+
+			int nNodes = 0;
+			for (int level = 0, levelNodes = 1; level <= _maxLevel; level++, levelNodes *= 4) nNodes += levelNodes;
+			_nodes = std::vector<unsigned char>(nNodes, NodeFree);
+
+			_buffer = new sg::FrameBuffer(size, size, false, true, false, false, depthFormat);
+			_staticBuffer = NULL;
+			_shrinkReported = false;
+		}
+
+		// Returns the tile of the owner, allocating it if needed. When the atlas is full the tile is shrunk
+		bool Acquire(unsigned int owner, int width, int height, unsigned int frame, ShadowAtlasTile& tile) {
+			int requested = glm::max(width, height);
+			std::unordered_map<unsigned int, ShadowAtlasTile>::iterator it = _tiles.find(owner);
+			if (it != _tiles.end() && it->second.requestedSize != requested) {
+				Free(it->second.node);
+				_tiles.erase(it);
+				it = _tiles.end();
+			}
+			if (it == _tiles.end()) {
+				ShadowAtlasTile newTile;
+				newTile.node = -1;
+				newTile.requestedSize = requested;
+				for (int level = LevelForSize(requested); level <= _maxLevel && newTile.node < 0; level++) {
+					newTile.node = Allocate(0, 0, level, 0, 0, _size, newTile.rect);
+					if (newTile.node >= 0 && level != LevelForSize(requested) && !_shrinkReported) {
+						std::cout << "WARNING: Shadow atlas full, shadow maps are being shrunk." << std::endl;
+						_shrinkReported = true;
+					}
+				}
+				if (newTile.node < 0) return false;
+				it = _tiles.insert(std::make_pair(owner, newTile)).first;
+			}
+			it->second.lastUsed = frame;
+			tile = it->second;
+			return true;
+		}
+
+		bool Find(unsigned int owner, ShadowAtlasTile& tile) {
+			std::unordered_map<unsigned int, ShadowAtlasTile>::iterator it = _tiles.find(owner);
+			if (it == _tiles.end()) return false;
+			tile = it->second;
+			return true;
+		}
+
+		// Gives back the tiles of lights that have not been drawn for a while
+		void Prune(unsigned int frame, unsigned int lifetime) {
+			std::unordered_map<unsigned int, ShadowAtlasTile>::iterator it = _tiles.begin();
+			while (it != _tiles.end()) {
+				if (frame - it->second.lastUsed > lifetime) {
+					Free(it->second.node);
+					it = _tiles.erase(it);
+				} else {
+					it++;
+				}
+			}
+		}
+
+		// Offset and scale of the tile in texture coordinates
+		glm::vec4 GetUVRect(const ShadowAtlasTile& tile) const {
+			return glm::vec4(tile.rect) / (float)_size;
+		}
+
+		int GetSize() const {
+			return _size;
+		}
+
+		GLuint GetBuffer() const {
+			return _buffer->bufferIndex;
+		}
+
+		GLuint GetTexture() const {
+			return _buffer->depthMap;
+		}
+
+		// Same layout as the atlas, holds the static casters of every tile
+		FrameBuffer* GetStaticBuffer() {
+			if (_staticBuffer == NULL) {
+				_staticBuffer = new sg::FrameBuffer(_size, _size, false, true, false, false, _depthFormat);
+			}
+			return _staticBuffer;
+		}
+
+		~ShadowAtlas() {
+			_buffer->FreeTextures();
+			GLStateCache::Instance()->DeleteFramebuffers(1, &_buffer->bufferIndex);
+			delete(_buffer);
+			if (_staticBuffer != NULL) {
+				_staticBuffer->FreeTextures();
+				GLStateCache::Instance()->DeleteFramebuffers(1, &_staticBuffer->bufferIndex);
+				delete(_staticBuffer);
+			}
+		}
+	};
+}
\ No newline at end of file
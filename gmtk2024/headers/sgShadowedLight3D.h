@@ -1,12 +1,15 @@
 #pragma once
 
 #include <sgLight.h>
+#include <sgStructures.h>
 
 namespace sg {
 	class ShadowedLight3D : public Light {
 	private:
+		static unsigned int _nextShadowId;
 		int _shadowWidth;
 		int _shadowHeight;
+		unsigned int _shadowId;
 
 	protected:
 		void SetShadowWidth(int width) {
@@ -18,6 +21,17 @@ namespace sg {
 		}
 
 	public:
+		ShadowedLight3D() {
+			// a block of ids, cascaded lights use one per cascade
+			_shadowId = _nextShadowId;
+			_nextShadowId += SG_MAX_CASCADES;
+		}
+
+		// Identifies the light on the render side, where its shadow tiles and caches live
+		unsigned int GetShadowId() const {
+			return _shadowId;
+		}
+
 		int GetShadowWidth() const {
 			return _shadowWidth;
 		}
@@ -26,4 +40,6 @@ namespace sg {
 			return _shadowHeight;
 		}
 	};
+
+	unsigned int ShadowedLight3D::_nextShadowId = 0;
 }
\ No newline at end of file
@@ -8,11 +8,13 @@ namespace sg {
         GLuint _skyboxTexture = -1;
         Vertex _backgroundVertices[3];
         Triangle _backgroundTriangles[1];
+        GLuint _backgroundVAO = -1;
         GLuint _backgroundVBO = -1;
+        GLuint _backgroundEBO = -1;
         bool _isPresent = false;
 
     public:
-        void InitSkybox(const char* textureFaces[6], GLuint vao) {
+        void InitSkybox(const char* textureFaces[6]) {
             _backgroundProgram = sg::CreateProgram("shaders/vertexShader_background.glsl", "shaders/fragmentShader_background.glsl");
 
             _skyboxTexture = TextureManager::Instance()->SetCubemap(textureFaces);
@@ -22,10 +24,17 @@ namespace sg {
             _backgroundVertices[2] = sg::Vertex{ glm::vec3(3, -1, 1 - 1e-5), glm::vec2(1, 0), glm::vec3(0,0,1) };
             _backgroundTriangles[0] = sg::Triangle{ {0,2,1} };
 
-            glBindVertexArray(vao);
+            glGenVertexArrays(1, &_backgroundVAO);
+            GLStateCache::Instance()->BindVertexArray(_backgroundVAO);
             glGenBuffers(1, &_backgroundVBO);
-            glBindBuffer(GL_ARRAY_BUFFER, _backgroundVBO);
+            GLStateCache::Instance()->BindBuffer(GL_ARRAY_BUFFER, _backgroundVBO);
             glBufferData(GL_ARRAY_BUFFER, sizeof(sg::Vertex) * 3, _backgroundVertices, GL_STATIC_DRAW);
+            glEnableVertexAttribArray(0);
+            glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(sg::Vertex), (GLvoid*)0);
+            glGenBuffers(1, &_backgroundEBO);
+            GLStateCache::Instance()->BindBuffer(GL_ELEMENT_ARRAY_BUFFER, _backgroundEBO);
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(sg::Triangle), _backgroundTriangles, GL_STATIC_DRAW);
+            GLStateCache::Instance()->BindVertexArray(0);
 
             _isPresent = true;
         }
@@ -34,18 +43,16 @@ namespace sg {
             return _isPresent;
         }
 
-        void RenderSkybox(Camera3D* camera) {
-            glUseProgram(_backgroundProgram);
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_CUBE_MAP, _skyboxTexture);
+        void RenderSkybox(glm::mat4 viewProjection) {
+            GLStateCache::Instance()->UseProgram(_backgroundProgram);
+            GLStateCache::Instance()->BindTexture(0, GL_TEXTURE_CUBE_MAP, _skyboxTexture);
             glUniform1i(glGetUniformLocation(_backgroundProgram, "skybox"), 0);
             glUniform1i(glGetUniformLocation(_backgroundProgram, "skyboxSet"), 1);
 
-            glm::mat3 matrixPV = glm::inverse(glm::mat3(camera->GetViewProjection()));
+            glm::mat3 matrixPV = glm::inverse(glm::mat3(viewProjection));
             glUniformMatrix3fv(glGetUniformLocation(_backgroundProgram, "toWorld"), 1, false, glm::value_ptr(matrixPV));
-            glBindBuffer(GL_ARRAY_BUFFER, _backgroundVBO);
-            glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(sg::Vertex), (GLvoid*)0);
-            glDrawElements(GL_TRIANGLES, 3, GL_UNSIGNED_INT, _backgroundTriangles);
+            GLStateCache::Instance()->BindVertexArray(_backgroundVAO);
+            glDrawElements(GL_TRIANGLES, 3, GL_UNSIGNED_INT, (GLvoid*)0);
         }
     };
 }
\ No newline at end of file
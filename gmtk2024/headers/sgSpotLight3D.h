@@ -13,6 +13,8 @@ namespace sg {
 		void UpdateProjectionMatrix() override {
 			if (_orthographic) SetOrthographic();
 			else SetPerspective();
+			// refreshes the shadow matrix and the bounds with the new projection
+			UpdateView();
 		}
 
 	public:
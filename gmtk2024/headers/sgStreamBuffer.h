@@ -0,0 +1,138 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <cstring>
+#include <iostream>
+#include <sgGLStateCache.h>
+
+#define SG_FRAMES_IN_FLIGHT 3
+
+namespace sg {
+	struct StreamAllocation {
+		void* data = NULL;
+		GLintptr offset = 0;
+		GLsizeiptr size = 0;
+	};
+
+	// Ring of SG_FRAMES_IN_FLIGHT regions inside one persistently mapped buffer.
+	// The CPU writes the dynamic data of frame N in its own region while the GPU is still reading
+	// the regions of the previous frames; a fence per region tells us when it can be reused
+	class StreamBuffer {
+	private:
+		GLenum _target;
+		GLuint _buffer;
+		GLsizeiptr _frameSize;
+		GLint _alignment;
+		unsigned char* _mapped;
+		unsigned char* _staging;
+		bool _persistent;
+		GLsync _fences[SG_FRAMES_IN_FLIGHT];
+		int _frame;
+		GLintptr _head;
+		bool _overflowReported;
+
+		GLintptr FrameStart() const {
+			return _frame * _frameSize;
+		}
+
+		void WaitForFence(GLsync& fence) {
+			if (fence == NULL) return;
+			GLenum result = glClientWaitSync(fence, 0, 0);
+			while (result != GL_ALREADY_SIGNALED && result != GL_CONDITION_SATISFIED && result != GL_WAIT_FAILED) {
+				result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+			}
+			glDeleteSync(fence);
+			fence = NULL;
+		}
+
+	public:
+		StreamBuffer(GLenum target, GLsizeiptr frameSize) {
+			_target = target;
+			_frame = 0;
+			_head = 0;
+			_overflowReported = false;
+			_mapped = NULL;
+			_staging = NULL;
+			for (int i = 0; i < SG_FRAMES_IN_FLIGHT; i++) _fences[i] = NULL;
+
+			_alignment = 1;
+			if (target == GL_UNIFORM_BUFFER) glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &_alignment);
+			_frameSize = (frameSize + _alignment - 1) / _alignment * _alignment;
+
+			glGenBuffers(1, &_buffer);
+			GLStateCache::Instance()->BindBuffer(_target, _buffer);
+
+			_persistent = GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage;
+			if (_persistent) {
+				GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+				glBufferStorage(_target, _frameSize * SG_FRAMES_IN_FLIGHT, NULL, flags);
+				_mapped = (unsigned char*)glMapBufferRange(_target, 0, _frameSize * SG_FRAMES_IN_FLIGHT, flags);
+			} else {
+				// without buffer storage the data is written in client memory and uploaded when it gets bound
+				glBufferData(_target, _frameSize * SG_FRAMES_IN_FLIGHT, NULL, GL_STREAM_DRAW);
+				_staging = new unsigned char[_frameSize * SG_FRAMES_IN_FLIGHT];
+			}
+		}
+
+		bool IsPersistent() const {
+			return _persistent;
+		}
+
+		GLuint GetBuffer() const {
+			return _buffer;
+		}
+
+		// Moves to the next region, waiting only if the GPU is still using it from three frames ago
+		void BeginFrame() {
+			_frame = (_frame + 1) % SG_FRAMES_IN_FLIGHT;
+			_head = 0;
+			WaitForFence(_fences[_frame]);
+		}
+
+		void EndFrame() {
+			_fences[_frame] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		}
+
+		StreamAllocation Allocate(GLsizeiptr size) {
+			StreamAllocation allocation;
+			GLsizeiptr alignedSize = (size + _alignment - 1) / _alignment * _alignment;
+			if (_head + alignedSize > _frameSize) {
+				if (!_overflowReported) {
+					std::cout << "ERROR: Stream buffer frame size exceeded." << std::endl;
+					_overflowReported = true;
+				}
+				return allocation;
+			}
+			allocation.offset = FrameStart() + _head;
+			allocation.size = size;
+			allocation.data = (_persistent ? _mapped : _staging) + allocation.offset;
+			_head += alignedSize;
+			return allocation;
+		}
+
+		StreamAllocation Write(const void* data, GLsizeiptr size) {
+			StreamAllocation allocation = Allocate(size);
+			if (allocation.data != NULL) memcpy(allocation.data, data, size);
+			return allocation;
+		}
+
+		void BindRange(GLuint index, StreamAllocation allocation) {
+			if (!_persistent) {
+				GLStateCache::Instance()->BindBuffer(_target, _buffer);
+				glBufferSubData(_target, allocation.offset, allocation.size, allocation.data);
+			}
+			GLStateCache::Instance()->BindBufferRange(_target, index, _buffer, allocation.offset, allocation.size);
+		}
+
+		~StreamBuffer() {
+			for (int i = 0; i < SG_FRAMES_IN_FLIGHT; i++) WaitForFence(_fences[i]);
+			if (_persistent) {
+				GLStateCache::Instance()->BindBuffer(_target, _buffer);
+				glUnmapBuffer(_target);
+			} else {
+				delete[] _staging;
+			}
+			GLStateCache::Instance()->DeleteBuffers(1, &_buffer);
+		}
+	};
+}
\ No newline at end of file
@@ -2,6 +2,15 @@
 
 #include <GL/glew.h>
 #include <glm/glm/glm.hpp>
+#include <sgGLStateCache.h>
+#include <sgGLTaskQueue.h>
+
+#define SG_MAX_LIGHTS 8
+#define SG_MAX_POINT_SHADOWS 5
+#define SG_MAX_SHADOW_VIEWS 4
+#define SG_MAX_DIR_LIGHTS 4
+#define SG_MAX_CASCADES 4
+#define SG_MAX_OBJECT_LIGHTS 4
 
 namespace sg {
 
@@ -16,17 +25,20 @@ namespace sg {
 		bool isRectangle = false;
 		bool isValid = false;
 
-		sg::FrameBuffer(float width, float height, bool createTexture = true, bool createDepthMap = false, bool createDepthBuffer = true, bool rectangleTexture = false) {
+		sg::FrameBuffer(float width, float height, bool createTexture = true, bool createDepthMap = false, bool createDepthBuffer = true, bool rectangleTexture = false, GLenum depthFormat = GL_DEPTH_COMPONENT32F) {
 			isRectangle = rectangleTexture;
+			GLTaskQueue::Instance()->Run([&]() { Create(width, height, createTexture, createDepthMap, createDepthBuffer, rectangleTexture, depthFormat); });
+		}
+
+		void Create(float width, float height, bool createTexture, bool createDepthMap, bool createDepthBuffer, bool rectangleTexture, GLenum depthFormat) {
 			glGenFramebuffers(1, &bufferIndex);
-			glBindFramebuffer(GL_FRAMEBUFFER, bufferIndex);
+			GLStateCache::Instance()->BindFramebuffer(GL_FRAMEBUFFER, bufferIndex);
 
 			if (createTexture) {
 				hasTexture = true;
 				glGenTextures(1, &renderTexture);
-				glActiveTexture(GL_TEXTURE0);
 				GLuint textureType = rectangleTexture ? GL_TEXTURE_RECTANGLE : GL_TEXTURE_2D;
-				glBindTexture(textureType, renderTexture);
+				GLStateCache::Instance()->BindTexture(0, textureType, renderTexture);
 				glTexImage2D(textureType, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
 				glTexParameteri(textureType, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
 				glTexParameteri(textureType, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
@@ -37,10 +49,9 @@ namespace sg {
 			if (createDepthMap) {
 				hasDepthMap = true;
 				glGenTextures(1, &depthMap);
-				glActiveTexture(GL_TEXTURE0);
 				GLuint textureType = rectangleTexture ? GL_TEXTURE_RECTANGLE : GL_TEXTURE_2D;
-				glBindTexture(textureType, depthMap);
-				glTexImage2D(textureType, 0, GL_DEPTH_COMPONENT32F, width, height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+				GLStateCache::Instance()->BindTexture(0, textureType, depthMap);
+				glTexImage2D(textureType, 0, depthFormat, width, height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
 				glTexParameteri(textureType, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
 				glTexParameteri(textureType, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
 				glTexParameteri(textureType, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
@@ -74,16 +85,20 @@ namespace sg {
 		}
 
 		void FreeTextures() {
+			GLTaskQueue::Instance()->Run([this]() { DeleteTextures(); });
+		}
+
+		void DeleteTextures() {
 			if (hasTexture) {
-				glDeleteTextures(1, &renderTexture);
+				GLStateCache::Instance()->DeleteTextures(1, &renderTexture);
 				hasTexture = false;
 			}
 			if (hasDepthMap) {
-				glDeleteTextures(1, &depthMap);
+				GLStateCache::Instance()->DeleteTextures(1, &depthMap);
 				hasDepthMap = false;
 			}
 			if (hasDepth) {
-				glDeleteTextures(1, &depthBuffer);
+				GLStateCache::Instance()->DeleteTextures(1, &depthBuffer);
 				hasDepth = false;
 			}
 		}
@@ -99,15 +114,18 @@ namespace sg {
 		GLuint depthBuffer = 0;
 		bool isValid = false;
 
-		sg::FrameBufferCube(float res, bool createTexture = true, bool createDepthMap = false, bool createDepthBuffer = true) {
+		sg::FrameBufferCube(float res, bool createTexture = true, bool createDepthMap = false, bool createDepthBuffer = true, GLenum depthFormat = GL_DEPTH_COMPONENT32F) {
+			GLTaskQueue::Instance()->Run([&]() { Create(res, createTexture, createDepthMap, createDepthBuffer, depthFormat); });
+		}
+
+		void Create(float res, bool createTexture, bool createDepthMap, bool createDepthBuffer, GLenum depthFormat) {
 			glGenFramebuffers(1, &bufferIndex);
-			glBindFramebuffer(GL_FRAMEBUFFER, bufferIndex);
+			GLStateCache::Instance()->BindFramebuffer(GL_FRAMEBUFFER, bufferIndex);
 
 			if (createTexture) {
 				hasTexture = true;
 				glGenTextures(1, &renderTexture);
-				glActiveTexture(GL_TEXTURE0);
-				glBindTexture(GL_TEXTURE_CUBE_MAP, renderTexture);
+				GLStateCache::Instance()->BindTexture(0, GL_TEXTURE_CUBE_MAP, renderTexture);
 				for (int i = 0; i < 6; i++) {
 					glTexImage2D( GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGBA, res, res, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
 				}
@@ -124,10 +142,9 @@ namespace sg {
 			if (createDepthMap) {
 				hasDepthMap = true;
 				glGenTextures(1, &depthMap);
-				glActiveTexture(GL_TEXTURE0);
-				glBindTexture(GL_TEXTURE_CUBE_MAP, depthMap);
+				GLStateCache::Instance()->BindTexture(0, GL_TEXTURE_CUBE_MAP, depthMap);
 				for (int i = 0; i < 6; i++) {
-					glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_DEPTH_COMPONENT32F, res, res, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+					glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, depthFormat, res, res, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
 				}
 				glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
 				glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
@@ -138,9 +155,8 @@ namespace sg {
 				glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 				glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_BASE_LEVEL, 0);
 				glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, 0);
-				for (int i = 0; i < 6; i++) {
-					glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, depthMap, 0);
-				}
+				// layered attachment, the geometry shader chooses the face
+				glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, depthMap, 0);
 			}
 			if (createDepthBuffer) {
 				hasDepth = true;
@@ -164,16 +180,20 @@ namespace sg {
 		}
 
 		void FreeTextures() {
+			GLTaskQueue::Instance()->Run([this]() { DeleteTextures(); });
+		}
+
+		void DeleteTextures() {
 			if (hasTexture) {
-				glDeleteTextures(1, &renderTexture);
+				GLStateCache::Instance()->DeleteTextures(1, &renderTexture);
 				hasTexture = false;
 			}
 			if (hasDepthMap) {
-				glDeleteTextures(1, &depthMap);
+				GLStateCache::Instance()->DeleteTextures(1, &depthMap);
 				hasDepthMap = false;
 			}
 			if (hasDepth) {
-				glDeleteTextures(1, &depthBuffer);
+				GLStateCache::Instance()->DeleteTextures(1, &depthBuffer);
 				hasDepth = false;
 			}
 		}
@@ -280,6 +300,7 @@ namespace sg {
 		char* materialName;
 		sg::Triangle *triangles;
 		int nTriangles;
+		unsigned int firstIndex;
 
 		sg::Mesh() {
 			name = NULL;
@@ -287,6 +308,7 @@ namespace sg {
 			materialName = NULL;
 			triangles = NULL;
 			nTriangles = 0;
+			firstIndex = 0;
 		}
 
 		sg::Mesh(char* n, char* matName, sg::Triangle* tris, int nTris) {
@@ -295,9 +317,30 @@ namespace sg {
 			materialName = matName;
 			triangles = tris;
 			nTriangles = nTris;
+			firstIndex = 0;
 		}
 	};
 
+	// Spatially close triangles of one mesh, stored as a single run of its triangles and culled on their own.
+	// Model space: every face normal is within coneAngle of coneAxis, a cone of half pi or wider can't face away as a whole
+	struct MeshCluster {
+		int mesh;
+		int firstTriangle;
+		int nTriangles;
+		glm::vec3 boundsMin;
+		glm::vec3 boundsMax;
+		glm::vec3 coneAxis;
+		float coneAngle;
+	};
+
+	// Per-object block read by the lit and shadowed vertex shaders, std140 layout
+	struct ObjectData {
+		glm::mat4 mvp;
+		glm::mat4 mv;
+		glm::mat4 modelMat;
+		glm::mat4 mvt;
+	};
+
 	struct Plane
 	{
 		glm::vec3 normal = { 0.f, 1.f, 0.f };
@@ -323,6 +366,31 @@ namespace sg {
 		Plane nearFace;
 
 		Frustum() {}
+
+		// Planes of the clip volume of a view projection (Gribb-Hartmann), for views that are not built from fov and planes
+		static Frustum FromMatrix(const glm::mat4& viewProjection) {
+			glm::vec4 rows[4];
+			for (int i = 0; i < 4; i++) {
+				rows[i] = glm::vec4(viewProjection[0][i], viewProjection[1][i], viewProjection[2][i], viewProjection[3][i]);
+			}
+			Frustum frustum;
+			frustum.leftFace = FromCoefficients(rows[3] + rows[0]);
+			frustum.rightFace = FromCoefficients(rows[3] - rows[0]);
+			frustum.bottomFace = FromCoefficients(rows[3] + rows[1]);
+			frustum.topFace = FromCoefficients(rows[3] - rows[1]);
+			frustum.nearFace = FromCoefficients(rows[3] + rows[2]);
+			frustum.farFace = FromCoefficients(rows[3] - rows[2]);
+			return frustum;
+		}
+
+	private:
+		static Plane FromCoefficients(glm::vec4 coefficients) {
+			float length = glm::length(glm::vec3(coefficients));
+			Plane plane;
+			plane.normal = glm::vec3(coefficients) / length;
+			plane.distance = -coefficients.w / length;
+			return plane;
+		}
 	};
 
 	struct Polar {
@@ -39,8 +39,7 @@ namespace sg {
         }
 
         void BindTexture(GLuint texture, int width, int height, unsigned char* data) {
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, texture);
+            GLStateCache::Instance()->BindTexture(0, GL_TEXTURE_2D, texture);
             glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
             glGenerateMipmap(GL_TEXTURE_2D);
             glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
@@ -64,8 +63,7 @@ namespace sg {
             return texture;
         }
 
-    public:
-        sg::Texture LoadTexture(const char* filename) {
+        sg::Texture FindOrLoadTexture(const char* filename) {
             sg::Texture t;
             t.map = (char *)filename;
             GLuint index = CheckIfAlreadyLoaded(filename);
@@ -82,6 +80,20 @@ namespace sg {
             return t;
         }
 
+    public:
+        // The texture list is only touched on the thread owning the GL context
+        sg::Texture LoadTexture(const char* filename) {
+            sg::Texture t;
+            GLTaskQueue::Instance()->Run([&]() { t = FindOrLoadTexture(filename); });
+            return t;
+        }
+
+        GLuint SetCubemap(const char* textures_faces[6]) {
+            GLuint texID;
+            GLTaskQueue::Instance()->Run([&]() { texID = CreateCubemap(textures_faces); });
+            return texID;
+        }
+
         void SetTexturesData(sg::Material* mat) {
             if (mat->texture_Kd.isPresent && !mat->texture_Kd.isLoaded) {
                 mat->texture_Kd = LoadTexture(mat->texture_Kd.map);
@@ -91,11 +103,11 @@ namespace sg {
             }
         }
 
-        GLuint SetCubemap(const char* textures_faces[6]) {
+    private:
+        GLuint CreateCubemap(const char* textures_faces[6]) {
             GLuint texID;
             glGenTextures(1, &texID);
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_CUBE_MAP, texID);
+            GLStateCache::Instance()->BindTexture(0, GL_TEXTURE_CUBE_MAP, texID);
             glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
             glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
             glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
@@ -123,9 +135,10 @@ namespace sg {
             return texID;
         }
 
+    public:
         void SetMaterialData(GLuint programId, Material* mat) {
             SetTexturesData(mat);
-            glUseProgram(programId);
+            GLStateCache::Instance()->UseProgram(programId);
             GLint Kd = glGetUniformLocation(programId, "material.Kd");
             glUniform3f(Kd, mat->Kd[0], mat->Kd[1], mat->Kd[2]);
             GLint Ks = glGetUniformLocation(programId, "material.Ks");
@@ -135,8 +148,7 @@ namespace sg {
             GLint d = glGetUniformLocation(programId, "material.d");
             glUniform1f(d, mat->d);
             if (mat->texture_Kd.isPresent) {
-                glActiveTexture(GL_TEXTURE0);
-                glBindTexture(GL_TEXTURE_2D, mat->texture_Kd.index);
+                GLStateCache::Instance()->BindTexture(0, GL_TEXTURE_2D, mat->texture_Kd.index);
                 glUniform1i(glGetUniformLocation(programId, "material.dTexture"), 0);
                 glUniform1i(glGetUniformLocation(programId, "material.dTextureSet"), 1);
             }
@@ -144,8 +156,7 @@ namespace sg {
                 glUniform1i(glGetUniformLocation(programId, "material.dTextureSet"), 0);
             }
             if (mat->texture_Ks.isPresent) {
-                glActiveTexture(GL_TEXTURE1);
-                glBindTexture(GL_TEXTURE_2D, mat->texture_Ks.index);
+                GLStateCache::Instance()->BindTexture(1, GL_TEXTURE_2D, mat->texture_Ks.index);
                 glUniform1i(glGetUniformLocation(programId, "material.sTexture"), 1);
                 glUniform1i(glGetUniformLocation(programId, "material.sTextureSet"), 1);
             }
@@ -155,7 +166,7 @@ namespace sg {
         }
 
         void SetMaterialData(GLuint programId) {
-            glUseProgram(programId);
+            GLStateCache::Instance()->UseProgram(programId);
             glUniform3f(glGetUniformLocation(programId, "material.Kd"), 1, 1, 1);
             glUniform3f(glGetUniformLocation(programId, "material.Ks"), 0.4, 0.4, 0.4);
             glUniform1f(glGetUniformLocation(programId, "material.Ns"), 20);
@@ -167,7 +178,7 @@ namespace sg {
 
         ~TextureManager() {
             for (int i = 0; i < _loadedTextures.size(); i++) {
-                glDeleteTextures(1, &_loadedTextures[i].index);
+                GLStateCache::Instance()->DeleteTextures(1, &_loadedTextures[i].index);
             }
         }
 	};
@@ -1,23 +1,25 @@
 #pragma once
 #include <glm/glm/glm.hpp>
+#include <glm/glm/gtc/quaternion.hpp>
 
 namespace sg {
+	// Translation, rotation and scale. The rotation takes the rest axes (right = x, up = y, forward = -z) to the current ones
 	struct Transform {
 	public:
 		glm::vec3 position;
+		glm::quat rotation;
 		glm::vec3 scale;
-		glm::vec3 forward;
-		glm::vec3 right;
-		glm::vec3 up;
 
 		Transform() {
 			position = glm::vec3(0);
+			rotation = glm::quat(1, 0, 0, 0);
 			scale = glm::vec3(1, 1, 1);
-			forward = glm::vec3(0, 0, -1);
-			right = glm::vec3(1, 0, 0);
-			up = glm::vec3(0, 1, 0);
 		}
 
+		glm::vec3 Forward() const { return rotation * glm::vec3(0, 0, -1); }
+		glm::vec3 Right() const { return rotation * glm::vec3(1, 0, 0); }
+		glm::vec3 Up() const { return rotation * glm::vec3(0, 1, 0); }
+
 		void Translate(float x, float y, float z);
 		void Translate(glm::vec3 vec);
 
@@ -47,9 +49,7 @@ namespace sg {
 	#pragma region Rotation
 
 	inline void Transform::ResetRotation() {
-		forward = glm::vec3(0, 0, -1);
-		right = glm::vec3(1, 0, 0);
-		up = glm::vec3(0, 1, 0);
+		rotation = glm::quat(1, 0, 0, 0);
 	}
 
 	inline void Transform::Rotate(float x, float y, float z) {
@@ -58,51 +58,21 @@ namespace sg {
 		Rotate(glm::vec3(0, 0, 1), z);
 	}
 
+	// Around an axis of the space the transform lives in, renormalized so the error of many small steps doesn't build up
 	inline void Transform::Rotate(glm::vec3 axis, float angle) {
-		float axisComponent = glm::dot(axis, forward);
-		float newXComponent = glm::sqrt((glm::length2(forward) - axisComponent * axisComponent));
-		glm::vec3 newY = glm::cross(axis, forward);
-		if (glm::length2(newY) > 0.0001f) {
-			newY = glm::normalize(newY);
-			glm::vec3 newX = glm::cross(newY, axis);
-			forward = (newX * cos(angle) + newY * sin(angle)) * newXComponent + axis * axisComponent;
-		}
-
-		axisComponent = glm::dot(axis, up);
-		newXComponent = glm::sqrt((glm::length2(up) - axisComponent * axisComponent));
-		newY = glm::cross(axis, up);
-		if (glm::length2(newY) > 0.0001f) {
-			newY = glm::normalize(newY);
-			glm::vec3 newX = glm::cross(newY, axis);
-			up = (newX * cos(angle) + newY * sin(angle)) * newXComponent + axis * axisComponent;
-		}
-
-		forward = glm::normalize(forward);
-		up = glm::normalize(up);
-
-		right = glm::normalize(glm::cross(forward, up));
+		rotation = glm::normalize(glm::angleAxis(angle, glm::normalize(axis)) * rotation);
 	}
 
 	inline void Transform::RotateAround(glm::vec3 axis, glm::vec3 point, float angle) {
-		axis = glm::normalize(axis);
-		glm::vec3 temp = position - point;
-		float axisComponent = glm::dot(axis, temp);
-		float newXComponent = glm::sqrt((glm::length2(temp) - axisComponent * axisComponent));
-		glm::vec3 newY = glm::cross(axis, temp);
-		if (glm::length2(newY) > 0.0001f) {
-			newY = glm::normalize(newY);
-			glm::vec3 newX = glm::cross(newY, axis);
-			position = (newX * cos(angle) + newY * sin(angle)) * newXComponent + axis * axisComponent;
-		}
-		position  = position + point;
-		Rotate(axis, angle);
+		glm::quat turn = glm::angleAxis(angle, glm::normalize(axis));
+		position = point + turn * (position - point);
+		rotation = glm::normalize(turn * rotation);
 	}
 
 	inline void Transform::LookAt(glm::vec3 target, glm::vec3 up) {
-		forward = glm::normalize(target - position);;
-		glm::vec3 tempAxis = glm::cross(up, forward);
-		this->up = glm::normalize(glm::cross(forward, tempAxis));
-		right = glm::normalize(glm::cross(forward, up));
+		glm::vec3 forward = glm::normalize(target - position);
+		glm::vec3 right = glm::normalize(glm::cross(forward, up));
+		rotation = glm::normalize(glm::quat_cast(glm::mat3(right, glm::cross(right, forward), -forward)));
 	}
 
 	#pragma endregion
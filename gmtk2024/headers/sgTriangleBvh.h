@@ -0,0 +1,181 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cfloat>
+#include <glm/glm/glm.hpp>
+#include <sgObject3D.h>
+
+namespace sg {
+	// World space triangles for the offline passes that trace rays through the level. Queries only tell whether anything
+	// is in the way, both faces block. Build runs once all the triangles are in, the queries can then come from any thread
+	class TriangleBvh {
+	private:
+		static const int LeafSize = 4;
+
+		struct Node {
+			glm::vec3 boundsMin;
+			glm::vec3 boundsMax;
+			// leaves hold count triangles from first, inner nodes have count 0 and first is the right child, the left one follows the node
+			int first;
+			int count;
+		};
+
+		// a corner and two edges per triangle, sorted by leaf once built
+		std::vector<glm::vec3> _v0;
+		std::vector<glm::vec3> _e1;
+		std::vector<glm::vec3> _e2;
+		std::vector<Node> _nodes;
+		bool _built;
+
+		int BuildNode(std::vector<int>& order, const std::vector<glm::vec3>& centroids, int first, int count) {
+			int index = (int)_nodes.size();
+			_nodes.push_back(Node());
+			glm::vec3 boundsMin = glm::vec3(FLT_MAX), boundsMax = glm::vec3(-FLT_MAX);
+			glm::vec3 centroidMin = glm::vec3(FLT_MAX), centroidMax = glm::vec3(-FLT_MAX);
+			for (int i = first; i < first + count; i++) {
+				int t = order[i];
+				boundsMin = glm::min(boundsMin, glm::min(_v0[t], glm::min(_v0[t] + _e1[t], _v0[t] + _e2[t])));
+				boundsMax = glm::max(boundsMax, glm::max(_v0[t], glm::max(_v0[t] + _e1[t], _v0[t] + _e2[t])));
+				centroidMin = glm::min(centroidMin, centroids[t]);
+				centroidMax = glm::max(centroidMax, centroids[t]);
+			}
+			_nodes[index].boundsMin = boundsMin;
+			_nodes[index].boundsMax = boundsMax;
+			if (count <= LeafSize) {
+				_nodes[index].first = first;
+				_nodes[index].count = count;
+				return index;
+			}
+
+			// median split along the widest spread of the centroids
+			glm::vec3 spread = centroidMax - centroidMin;
+			int axis = spread.x > spread.y ? (spread.x > spread.z ? 0 : 2) : (spread.y > spread.z ? 1 : 2);
+			int middle = first + count / 2;
+			std::nth_element(order.begin() + first, order.begin() + middle, order.begin() + first + count,
+				[&](int a, int b) { return centroids[a][axis] < centroids[b][axis]; });
+			BuildNode(order, centroids, first, middle - first);
+			int right = BuildNode(order, centroids, middle, first + count - middle);
+			_nodes[index].first = right;
+			_nodes[index].count = 0;
+			return index;
+		}
+
+		bool HitsBox(const Node& node, glm::vec3 origin, glm::vec3 inverseDirection, float maxDistance) const {
+			glm::vec3 t0 = (node.boundsMin - origin) * inverseDirection;
+			glm::vec3 t1 = (node.boundsMax - origin) * inverseDirection;
+			glm::vec3 tMin = glm::min(t0, t1);
+			glm::vec3 tMax = glm::max(t0, t1);
+			float enter = glm::max(glm::max(tMin.x, tMin.y), glm::max(tMin.z, 0.0f));
+			float exit = glm::min(glm::min(tMax.x, tMax.y), glm::min(tMax.z, maxDistance));
+			return enter <= exit;
+		}
+
+		// Moller-Trumbore
+		bool HitsTriangle(int t, glm::vec3 origin, glm::vec3 direction, float maxDistance) const {
+			glm::vec3 p = glm::cross(direction, _e2[t]);
+			float determinant = glm::dot(_e1[t], p);
+			if (glm::abs(determinant) < 1e-9f) return false;
+			float inverse = 1.0f / determinant;
+			glm::vec3 s = origin - _v0[t];
+			float u = glm::dot(s, p) * inverse;
+			if (u < 0 || u > 1) return false;
+			glm::vec3 q = glm::cross(s, _e1[t]);
+			float v = glm::dot(direction, q) * inverse;
+			if (v < 0 || u + v > 1) return false;
+			float distance = glm::dot(_e2[t], q) * inverse;
+			return distance > 0 && distance < maxDistance;
+		}
+
+	public:
+		TriangleBvh() {
+			_built = false;
+		}
+
+		// FNV-1a, for the fingerprints of the baked caches
+		static unsigned long long HashBytes(unsigned long long hash, const void* data, size_t size) {
+			const unsigned char* bytes = (const unsigned char*)data;
+			for (size_t i = 0; i < size; i++) hash = (hash ^ bytes[i]) * 1099511628211ull;
+			return hash;
+		}
+
+		void AddTriangle(glm::vec3 a, glm::vec3 b, glm::vec3 c) {
+			_v0.push_back(a);
+			_e1.push_back(b - a);
+			_e2.push_back(c - a);
+			_built = false;
+		}
+
+		// Every triangle of the model with the current transform of the object
+		void AddObject(Object3D* object) {
+			Model* model = object->GetModel();
+			if (model == NULL) return;
+			glm::mat4 modelMatrix = object->GetModelMatrix();
+			Vertex* vertices = model->GetVertices();
+			for (int i = 0; i < model->GetNMeshes(); i++) {
+				Mesh mesh = model->GetMeshAt(i);
+				for (int t = 0; t < mesh.nTriangles; t++) {
+					glm::vec3 a = glm::vec3(modelMatrix * glm::vec4(vertices[mesh.triangles[t].index[0]].coord, 1));
+					glm::vec3 b = glm::vec3(modelMatrix * glm::vec4(vertices[mesh.triangles[t].index[1]].coord, 1));
+					glm::vec3 c = glm::vec3(modelMatrix * glm::vec4(vertices[mesh.triangles[t].index[2]].coord, 1));
+					AddTriangle(a, b, c);
+				}
+			}
+		}
+
+		void Build() {
+			if (_built) return;
+			int nTriangles = (int)_v0.size();
+			std::vector<int> order(nTriangles);
+			std::vector<glm::vec3> centroids(nTriangles);
+			for (int t = 0; t < nTriangles; t++) {
+				order[t] = t;
+				centroids[t] = _v0[t] + (_e1[t] + _e2[t]) / 3.0f;
+			}
+			_nodes.clear();
+			if (nTriangles > 0) BuildNode(order, centroids, 0, nTriangles);
+
+			// leaves point at contiguous ranges once the triangles follow the tree order
+			std::vector<glm::vec3> v0(nTriangles), e1(nTriangles), e2(nTriangles);
+			for (int i = 0; i < nTriangles; i++) {
+				v0[i] = _v0[order[i]];
+				e1[i] = _e1[order[i]];
+				e2[i] = _e2[order[i]];
+			}
+			_v0.swap(v0);
+			_e1.swap(e1);
+			_e2.swap(e2);
+			_built = true;
+		}
+
+		bool Occluded(glm::vec3 origin, glm::vec3 direction, float maxDistance) const {
+			if (_nodes.empty()) return false;
+			glm::vec3 inverseDirection = 1.0f / direction;
+			int stack[64];
+			int top = 0;
+			stack[top++] = 0;
+			while (top > 0) {
+				int index = stack[--top];
+				const Node& node = _nodes[index];
+				if (!HitsBox(node, origin, inverseDirection, maxDistance)) continue;
+				if (node.count > 0) {
+					for (int t = node.first; t < node.first + node.count; t++) {
+						if (HitsTriangle(t, origin, direction, maxDistance)) return true;
+					}
+				} else {
+					stack[top++] = node.first;
+					stack[top++] = index + 1;
+				}
+			}
+			return false;
+		}
+
+		// Folds the triangles into a fingerprint. Their order changes when the tree is built
+		unsigned long long Hash(unsigned long long hash) const {
+			if (_v0.empty()) return hash;
+			hash = HashBytes(hash, _v0.data(), sizeof(glm::vec3) * _v0.size());
+			hash = HashBytes(hash, _e1.data(), sizeof(glm::vec3) * _e1.size());
+			return HashBytes(hash, _e2.data(), sizeof(glm::vec3) * _e2.size());
+		}
+	};
+}
\ No newline at end of file
@@ -9,6 +9,7 @@
 #include <sgSpotLight3D.h>
 #include <sgPointLight3D.h>
 #include <sgDirectionalLight3D.h>
+#include <sgRenderSnapshot.h>
 
 namespace sg {
 
@@ -73,7 +74,7 @@ namespace sg {
             std::cout << "ERROR: " << compilerMessage.data() << std::endl;
         }
 
-        glUseProgram(programID);
+        GLStateCache::Instance()->UseProgram(programID);
 
         glDeleteShader(vsID);
         glDeleteShader(fsID);
@@ -102,7 +103,7 @@ namespace sg {
             std::cout << "ERROR: " << compilerMessage.data() << std::endl;
         }
 
-        glUseProgram(programID);
+        GLStateCache::Instance()->UseProgram(programID);
 
         glDeleteShader(vsID);
         glDeleteShader(fsID);
@@ -134,7 +135,7 @@ namespace sg {
             std::cout << "ERROR: " << compilerMessage.data() << std::endl;
         }
 
-        glUseProgram(programID);
+        GLStateCache::Instance()->UseProgram(programID);
 
         glDeleteShader(vsID);
         glDeleteShader(fsID);
@@ -169,7 +170,7 @@ namespace sg {
             std::cout << "ERROR: " << compilerMessage.data() << std::endl;
         }
 
-        glUseProgram(programID);
+        GLStateCache::Instance()->UseProgram(programID);
 
         glDeleteShader(vsID);
         glDeleteShader(fsID);
@@ -180,76 +181,74 @@ namespace sg {
         return programID;
     }
 
-    void UpdateSpotLights(GLuint program, std::vector<sg::SpotLight3D*> spotLights, glm::mat4 mv, int textureUnit) {
-        if (program <= 0) return;
-        glUseProgram(program);
-        glUniform1i(glGetUniformLocation(program, "nSpotLights"), spotLights.size());
-        for (int i = 0; i < spotLights.size(); i++) {
-            glm::vec3 lightPos = glm::vec3(mv * glm::vec4(spotLights[i]->GetGlobalPosition(), 1));
+    // Returns the first texture unit left free by the projected maps
+    int UpdateSpotLights(GLuint program, const std::vector<sg::SpotLightSnapshot>& spotLights, glm::mat4 mv, int textureUnit) {
+        if (program <= 0) return textureUnit;
+        GLStateCache::Instance()->UseProgram(program);
+        int nLights = glm::min((int)spotLights.size(), SG_MAX_LIGHTS);
+        glUniform1i(glGetUniformLocation(program, "nSpotLights"), nLights);
+        for (int i = 0; i < nLights; i++) {
+            glm::vec3 lightPos = glm::vec3(mv * glm::vec4(spotLights[i].position, 1));
             std::string baseString = std::string("spotLights[").append(std::to_string(i)).append("].");
             glUniform3fv(glGetUniformLocation(program, (baseString + "pos").c_str()), 1, glm::value_ptr(lightPos));
-            glUniform3fv(glGetUniformLocation(program, (baseString + "color").c_str()), 1, glm::value_ptr(spotLights[i]->GetColor()));
-            glUniform1f(glGetUniformLocation(program, (baseString + "range").c_str()), spotLights[i]->GetRange());
-            glUniform1f(glGetUniformLocation(program, (baseString + "intensity").c_str()), spotLights[i]->GetIntensity());
-            glActiveTexture(GL_TEXTURE0 + textureUnit);
-            glBindTexture(GL_TEXTURE_2D, spotLights[i]->GetShadowTexture()); //variare se la texture pu essere un rettangolo
-            glUniform1i(glGetUniformLocation(program, (baseString + "shadowTexture").c_str()), textureUnit);
-            textureUnit++;
-            if (spotLights[i]->GetMapTexture().isPresent) {
-                glActiveTexture(GL_TEXTURE0 + textureUnit);
-                glBindTexture(GL_TEXTURE_2D, spotLights[i]->GetMapTexture().index); //variare se la texture pu essere un rettangolo
+            glUniform3fv(glGetUniformLocation(program, (baseString + "color").c_str()), 1, glm::value_ptr(spotLights[i].color));
+            glUniform1f(glGetUniformLocation(program, (baseString + "range").c_str()), spotLights[i].range);
+            glUniform1f(glGetUniformLocation(program, (baseString + "intensity").c_str()), spotLights[i].intensity);
+            glUniformMatrix4fv(glGetUniformLocation(program, (baseString + "shadowMatrix").c_str()), 1, false, glm::value_ptr(spotLights[i].shadowMatrix));
+            glUniform4fv(glGetUniformLocation(program, (baseString + "shadowRect").c_str()), 1, glm::value_ptr(spotLights[i].shadowRect));
+            if (spotLights[i].mapTexture.isPresent) {
+                GLStateCache::Instance()->BindTexture(textureUnit, GL_TEXTURE_2D, spotLights[i].mapTexture.index); //variare se la texture pu essere un rettangolo
                 glUniform1i(glGetUniformLocation(program, (baseString + "mapTexture").c_str()), textureUnit);
                 glUniform1i(glGetUniformLocation(program, (baseString + "mapTextureSet").c_str()), 1);
                 textureUnit++;
             }
         }
+        return textureUnit;
     }
 
-    void UpdatePointLights(GLuint program, std::vector<sg::PointLight3D*> pointLights, glm::mat4 mv, int textureUnit) {
+    // The point lights themselves go through the light clusters, only their shadow cubemaps are bound here.
+    // Every slot gets its own unit, empty ones included, so no cube sampler shares a unit with a 2D one
+    void UpdatePointShadowMaps(GLuint program, const std::vector<sg::PointLightSnapshot>& pointLights, int textureUnit) {
         if (program <= 0) return;
-        glUseProgram(program);
-        glUniform1i(glGetUniformLocation(program, "nPointLights"), pointLights.size());
+        GLStateCache::Instance()->UseProgram(program);
+        GLuint textures[SG_MAX_POINT_SHADOWS] = {};
         for (int i = 0; i < pointLights.size(); i++) {
-            glm::vec3 lightPos = glm::vec3(mv * glm::vec4(pointLights[i]->GetGlobalPosition(), 1));
-            std::string baseString = std::string("pointLights[").append(std::to_string(i)).append("].");
-            glUniform3fv(glGetUniformLocation(program, (baseString + "pos").c_str()), 1, glm::value_ptr(lightPos));
-            glUniform3fv(glGetUniformLocation(program, (baseString + "worldPos").c_str()), 1, glm::value_ptr(pointLights[i]->GetGlobalPosition()));
-            glUniform3fv(glGetUniformLocation(program, (baseString + "color").c_str()), 1, glm::value_ptr(pointLights[i]->GetColor()));
-            glUniform1f(glGetUniformLocation(program, (baseString + "range").c_str()), pointLights[i]->GetRange());
-            glUniform1f(glGetUniformLocation(program, (baseString + "intensity").c_str()), pointLights[i]->GetIntensity());
-            glUniform1f(glGetUniformLocation(program, (baseString + "far_plane").c_str()), pointLights[i]->GetFarPlane());
-            glActiveTexture(GL_TEXTURE0 + textureUnit);
-            glBindTexture(GL_TEXTURE_CUBE_MAP, pointLights[i]->GetShadowTexture());
-            glUniform1i(glGetUniformLocation(program, (baseString + "shadowTexture").c_str()), textureUnit);
-            textureUnit++;
+            if (pointLights[i].shadowSlot >= 0) textures[pointLights[i].shadowSlot] = pointLights[i].shadowTexture;
+        }
+        for (int slot = 0; slot < SG_MAX_POINT_SHADOWS; slot++) {
+            GLStateCache::Instance()->BindTexture(textureUnit + slot, GL_TEXTURE_CUBE_MAP, textures[slot]);
+            std::string name = std::string("pointShadowMaps[").append(std::to_string(slot)).append("]");
+            glUniform1i(glGetUniformLocation(program, name.c_str()), textureUnit + slot);
         }
     }
 
-    void UpdateDirectionalLights(GLuint program, std::vector<sg::DirectionalLight3D*> dirLights, glm::mat4 mv, int textureUnit) {
+    void UpdateDirectionalLights(GLuint program, const std::vector<sg::DirectionalLightSnapshot>& dirLights, glm::mat4 mv) {
         if (program <= 0) return;
-        glUseProgram(program);
-        glUniform1i(glGetUniformLocation(program, "nDirLights"), dirLights.size());
-        for (int i = 0; i < dirLights.size(); i++) {
-            glm::vec3 lightDir = glm::vec3(mv * glm::vec4(dirLights[i]->GlobalForward(), 0));
+        GLStateCache::Instance()->UseProgram(program);
+        int nLights = glm::min((int)dirLights.size(), SG_MAX_DIR_LIGHTS);
+        glUniform1i(glGetUniformLocation(program, "nDirLights"), nLights);
+        for (int i = 0; i < nLights; i++) {
+            glm::vec3 lightDir = glm::vec3(mv * glm::vec4(dirLights[i].direction, 0));
             std::string baseString = std::string("dirLights[").append(std::to_string(i)).append("].");
             glUniform3fv(glGetUniformLocation(program, (baseString + "dir").c_str()), 1, glm::value_ptr(lightDir));
-            glUniform3fv(glGetUniformLocation(program, (baseString + "color").c_str()), 1, glm::value_ptr(dirLights[i]->GetColor()));
-            glUniform1f(glGetUniformLocation(program, (baseString + "intensity").c_str()), dirLights[i]->GetIntensity());
-            glActiveTexture(GL_TEXTURE0 + textureUnit);
-            glBindTexture(GL_TEXTURE_2D, dirLights[i]->GetShadowTexture()); //variare se la texture pu essere un rettangolo
-            glUniform1i(glGetUniformLocation(program, (baseString + "shadowTexture").c_str()), textureUnit);
-            textureUnit++;
+            glUniform3fv(glGetUniformLocation(program, (baseString + "color").c_str()), 1, glm::value_ptr(dirLights[i].color));
+            glUniform1f(glGetUniformLocation(program, (baseString + "intensity").c_str()), dirLights[i].intensity);
+            glUniform1i(glGetUniformLocation(program, (baseString + "nCascades").c_str()), dirLights[i].nCascades);
+            glUniform4fv(glGetUniformLocation(program, (baseString + "cascadeSplits").c_str()), 1, glm::value_ptr(dirLights[i].cascadeSplits));
+            glUniformMatrix4fv(glGetUniformLocation(program, (baseString + "shadowMatrices").c_str()), dirLights[i].nCascades, false, glm::value_ptr(dirLights[i].shadowMatrices[0]));
+            glUniform4fv(glGetUniformLocation(program, (baseString + "shadowRects").c_str()), dirLights[i].nCascades, glm::value_ptr(dirLights[i].shadowRects[0]));
         }
     }
 
-    void UpdateAmbientLights(GLuint program, std::vector<sg::AmbientLight*> ambientLights) {
+    void UpdateAmbientLights(GLuint program, const std::vector<sg::AmbientLightSnapshot>& ambientLights) {
         if (program <= 0) return;
-        glUseProgram(program);
-        glUniform1i(glGetUniformLocation(program, "nAmbientLights"), ambientLights.size());
-        for (int i = 0; i < ambientLights.size(); i++) {
+        GLStateCache::Instance()->UseProgram(program);
+        int nLights = glm::min((int)ambientLights.size(), SG_MAX_LIGHTS);
+        glUniform1i(glGetUniformLocation(program, "nAmbientLights"), nLights);
+        for (int i = 0; i < nLights; i++) {
             std::string baseString = std::string("ambientLights[").append(std::to_string(i)).append("].");
-            glUniform3fv(glGetUniformLocation(program, (baseString + "color").c_str()), 1, glm::value_ptr(ambientLights[i]->GetColor()));
-            glUniform1f(glGetUniformLocation(program, (baseString + "intensity").c_str()), ambientLights[i]->GetIntensity());
+            glUniform3fv(glGetUniformLocation(program, (baseString + "color").c_str()), 1, glm::value_ptr(ambientLights[i].color));
+            glUniform1f(glGetUniformLocation(program, (baseString + "intensity").c_str()), ambientLights[i].intensity);
         }
     }
 
@@ -259,13 +258,13 @@ namespace sg {
 
     void SetMatrix(glm::mat4 matrix, GLuint program, char const* name) {
         GLint location = glGetUniformLocation(program, name);
-        glUseProgram(program);
+        GLStateCache::Instance()->UseProgram(program);
         glUniformMatrix4fv(location, 1, false, glm::value_ptr(matrix));
     }
 
     void SetMatrix(glm::mat3 matrix, GLuint program, char const* name) {
         GLint location = glGetUniformLocation(program, name);
-        glUseProgram(program);
+        GLStateCache::Instance()->UseProgram(program);
         glUniformMatrix3fv(location, 1, false, glm::value_ptr(matrix));
     }
 }
\ No newline at end of file
@@ -19,35 +19,52 @@ namespace sg {
 
 	protected:
 
-		void UpdateFrustum()
+		// Frustum and projection for arbitrary parameters, lights use them to narrow their shadow view
+		Frustum BuildFrustum(float fov, float aspectRatio, float nearPlane, float farPlane)
 		{
-			const glm::vec3 frontMultFar = _farPlane * GlobalForward();
-			_frustum.nearFace = { GetGlobalPosition() + _nearPlane * GlobalForward(), GlobalForward() };
-			_frustum.farFace = { GetGlobalPosition() + frontMultFar, -GlobalForward() };
+			Frustum frustum;
+			const glm::vec3 frontMultFar = farPlane * GlobalForward();
+			frustum.nearFace = { GetGlobalPosition() + nearPlane * GlobalForward(), GlobalForward() };
+			frustum.farFace = { GetGlobalPosition() + frontMultFar, -GlobalForward() };
 
 			if (!_orthographic) {
-				const float halfVSide = _farPlane * tanf(_fov * .5f);
-				const float halfHSide = halfVSide * _aspectRatio;
+				const float halfVSide = farPlane * tanf(fov * .5f);
+				const float halfHSide = halfVSide * aspectRatio;
 
-				_frustum.rightFace = { GetGlobalPosition(),
+				frustum.rightFace = { GetGlobalPosition(),
 										glm::cross(frontMultFar - GlobalRight() * halfHSide, GlobalUp()) };
-				_frustum.leftFace = { GetGlobalPosition(),
+				frustum.leftFace = { GetGlobalPosition(),
 										glm::cross(GlobalUp(),frontMultFar + GlobalRight() * halfHSide) };
-				_frustum.topFace = { GetGlobalPosition(),
+				frustum.topFace = { GetGlobalPosition(),
 										glm::cross(GlobalRight(), frontMultFar - GlobalUp() * halfVSide) };
-				_frustum.bottomFace = { GetGlobalPosition(),
+				frustum.bottomFace = { GetGlobalPosition(),
 										glm::cross(frontMultFar + GlobalUp() * halfVSide, GlobalRight()) };
 			}
 			else
 			{
-				const float halfVSide = 2 * _fov;
-				const float halfHSide = halfVSide * _aspectRatio;
+				const float halfVSide = 2 * fov;
+				const float halfHSide = halfVSide * aspectRatio;
 
-				_frustum.rightFace = { GetGlobalPosition() + GlobalRight() * halfHSide, -GlobalRight() };
-				_frustum.leftFace = { GetGlobalPosition() - GlobalRight() * halfHSide, GlobalRight() };
-				_frustum.topFace = { GetGlobalPosition() + GlobalUp() * halfVSide, -GlobalUp() };
-				_frustum.bottomFace = { GetGlobalPosition() - GlobalUp() * halfVSide, GlobalUp() };
+				frustum.rightFace = { GetGlobalPosition() + GlobalRight() * halfHSide, -GlobalRight() };
+				frustum.leftFace = { GetGlobalPosition() - GlobalRight() * halfHSide, GlobalRight() };
+				frustum.topFace = { GetGlobalPosition() + GlobalUp() * halfVSide, -GlobalUp() };
+				frustum.bottomFace = { GetGlobalPosition() - GlobalUp() * halfVSide, GlobalUp() };
 			}
+			return frustum;
+		}
+
+		glm::mat4 BuildProjection(float fov, float aspectRatio, float nearPlane, float farPlane) {
+			if (!_orthographic) return glm::perspective(fov, aspectRatio, nearPlane, farPlane);
+
+			glm::mat4 projection = glm::scale(glm::vec3(0.5 * aspectRatio, 0.5, -0.5));
+			projection = glm::translate(projection, glm::vec3(0, 0, 2));
+			projection = glm::scale(projection, glm::vec3(1 / fov, 1 / fov, 1 / (farPlane - nearPlane)));
+			return glm::translate(projection, glm::vec3(0, 0, nearPlane));
+		}
+
+		void UpdateFrustum()
+		{
+			_frustum = BuildFrustum(_fov, _aspectRatio, _nearPlane, _farPlane);
 		}
 
 		virtual void UpdateView() {
@@ -59,7 +76,7 @@ namespace sg {
 		void SetPerspective() {
 			_orthographic = false;
 
-			_projectionMatrix = glm::perspective(_fov, _aspectRatio, _nearPlane, _farPlane);
+			_projectionMatrix = BuildProjection(_fov, _aspectRatio, _nearPlane, _farPlane);
 			_viewProjectionMatrix = _projectionMatrix * _viewMatrix;
 			UpdateFrustum();
 		}
@@ -67,10 +84,7 @@ namespace sg {
 		void SetOrthographic() {
 			_orthographic = true;
 
-			_projectionMatrix = glm::scale(glm::vec3(0.5 * _aspectRatio, 0.5, -0.5));
-			_projectionMatrix = glm::translate(_projectionMatrix, glm::vec3(0, 0, 2));
-			_projectionMatrix = glm::scale(_projectionMatrix, glm::vec3(1 / _fov, 1 / _fov, 1 / (_farPlane - _nearPlane)));
-			_projectionMatrix = glm::translate(_projectionMatrix, glm::vec3(0, 0, _nearPlane));
+			_projectionMatrix = BuildProjection(_fov, _aspectRatio, _nearPlane, _farPlane);
 
 			_viewProjectionMatrix = _projectionMatrix * _viewMatrix;
 			UpdateFrustum();
@@ -79,10 +93,7 @@ namespace sg {
 		virtual void UpdateProjectionMatrix() {
 		}
 
-		void LocalRotationFromGlobal(bool updateChildren = true) override { Entity3D::LocalRotationFromGlobal(updateChildren); UpdateView(); }
-		void LocalPositionFromGlobal(bool updateChildren = true) override { Entity3D::LocalPositionFromGlobal(updateChildren); UpdateView(); }
-		void GlobalRotationFromLocal(bool updateChildren = true) override { Entity3D::GlobalRotationFromLocal(updateChildren); UpdateView(); }
-		void GlobalPositionFromLocal(bool updateChildren = true) override { Entity3D::GlobalPositionFromLocal(updateChildren); UpdateView(); }
+		void RebuildWorld() override { UpdateView(); }
 
 	public:
 		View3D(float fov, float aspectRatio, float nearPlane, float farPlane) : Entity3D() {
@@ -94,6 +105,7 @@ namespace sg {
 		}
 
 		sg::Frustum GetFrustum() {
+			UpdateWorld();
 			return _frustum;
 		}
 
@@ -138,6 +150,7 @@ namespace sg {
 		}
 
 		glm::mat4 GetViewProjection() {
+			UpdateWorld();
 			return _viewProjectionMatrix;
 		}
 
@@ -146,6 +159,7 @@ namespace sg {
 		}
 
 		glm::mat4 GetView() {
+			UpdateWorld();
 			return _viewMatrix;
 		}
 	};
@@ -1,5 +1,6 @@
 #include <sgEngine.h>
 #include <sstream>
+#include <cstring>
 #include <Player.h>
 #include <EnemyManager.h>
 #include <MapCreator.h>
@@ -76,6 +77,7 @@ private:
 
         renderer = new sg::Renderer();
         if (renderer->InitRenderer(window, resx, resy) < 0) return false;
+        renderer->StartRenderThread();
 
         glfwSetCursorPos(renderer->GetWindow(), resx / 2, resy / 2);
         prevx = resx / 2;
@@ -182,8 +184,9 @@ private:
         sg::InputManager::Instance()->BindInput(renderer->GetWindow(), cmd, callback);
     }
 
+    // Only ends the main loop, the window has to outlive cleanup() since the models free their buffers in its context
     static void onEscKeyPressed(int mods) {
-        renderer->DestroyWindow();
+        glfwSetWindowShouldClose(renderer->GetWindow(), GL_TRUE);
     }
 
     static void onWindowResize(int x, int y) {
@@ -236,6 +239,15 @@ private:
 };
 
 int main(int argc, char* argv[]) {
+    if (argc > 1 && strcmp(argv[1], "--cull-benchmark") == 0) {
+        sg::FrustumCuller::Benchmark();
+        return EXIT_SUCCESS;
+    }
+    if (argc > 1 && strcmp(argv[1], "--transform-benchmark") == 0) {
+        sg::Entity3D::Benchmark();
+        return EXIT_SUCCESS;
+    }
+
     sgGame game;
 
     try {
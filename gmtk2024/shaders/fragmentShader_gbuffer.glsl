@@ -0,0 +1,33 @@
+#version 330 core
+
+struct Material {
+	vec3 Kd;
+	vec3 Ks;
+	float Ns;
+	float d;
+	sampler2D dTexture;
+	int dTextureSet;
+	sampler2D sTexture;
+	int sTextureSet;
+};  
+uniform Material material;
+uniform int receivesShadows;
+
+in vec3 worldPosition;
+in vec3 viewPosition;
+in vec2 textureC;
+in vec3 fragNormal;
+
+// the lighting happens later in fragmentShader_deferred, here only the surface is stored
+layout(location=0) out vec4 albedoFlags;
+layout(location=1) out vec4 specularShininess;
+layout(location=2) out vec4 normal;
+
+void main() {
+	vec3 albedo = (material.dTextureSet == 1) ? texture(material.dTexture, textureC).xyz * material.Kd : material.Kd;
+	vec3 specular = (material.sTextureSet == 1) ? texture(material.sTexture, textureC).xyz * material.Ks : material.Ks;
+
+	albedoFlags = vec4(albedo, float(receivesShadows));
+	specularShininess = vec4(specular, material.Ns);
+	normal = vec4(normalize(fragNormal), 0.);
+}
\ No newline at end of file
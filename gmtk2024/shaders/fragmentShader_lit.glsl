@@ -1,33 +1,39 @@
 #version 330 core
 
-#define MAX_LIGHTS 5
+#define MAX_LIGHTS 8
+#define MAX_OBJECT_LIGHTS 4
+#define MAX_DIR_LIGHTS 4
 
 struct SpotLight {
 	vec3 pos;
 	vec3 color;
 	float intensity;
 	float range;
+	mat4 shadowMatrix;
 	sampler2D mapTexture;
 	int mapTextureSet;
 };
 uniform SpotLight spotLights[MAX_LIGHTS];
 uniform int nSpotLights;
-
-struct PointLight {
-	vec3 pos;
-	vec3 color;
-	float intensity;
-	float range;
-};
-uniform PointLight pointLights[MAX_LIGHTS];
-uniform int nPointLights;
+// the spot lights that matter most for the object being drawn, indices into spotLights
+uniform int objectSpotLights[MAX_OBJECT_LIGHTS];
+uniform int nObjectSpotLights;
+
+// point lights come from the light clusters, see LightClusters for the layout of clusterData
+uniform usamplerBuffer clusterData;
+uniform ivec3 clusterGrid;
+uniform vec2 clusterTileSize;
+// near plane and depth slices per unit of log depth
+uniform vec2 clusterDepth;
+uniform int clusterHeaders;
+uniform int clusterIndices;
 
 struct DirLight {
 	vec3 dir;
 	vec3 color;
 	float intensity;
 };
-uniform DirLight dirLights[MAX_LIGHTS];
+uniform DirLight dirLights[MAX_DIR_LIGHTS];
 uniform int nDirLights;
 
 struct AmbientLight {
@@ -49,10 +55,10 @@ struct Material {
 };  
 uniform Material material;
 
+in vec3 worldPosition;
 in vec3 viewPosition;
 in vec2 textureC;
 in vec3 fragNormal;
-in vec4 spotLightViewPositions[MAX_LIGHTS];
 
 out vec4 color;
 
@@ -64,7 +70,8 @@ vec3 CalcSpotLightComponent(int i, vec3 albedo, vec3 specular, vec3 camDir) {
 	vec3 bounceDir = normalize(lightDir + camDir);
 	float specularComponent = pow(max(0, dot(bounceDir, fragNormal)), material.Ns);
 
-	vec3 p = spotLightViewPositions[i].xyz / spotLightViewPositions[i].w;
+	vec4 lightPosition = spotLights[i].shadowMatrix * vec4(worldPosition, 1);
+	vec3 p = lightPosition.xyz / lightPosition.w;
 	if (p.x > 1 || p.x < 0 || p.y > 1 || p.y < 0 || p.z > 1.0 || p.z < 0.0) {
 		diffuseComponent = 0; specularComponent = 0;
 	} else {
@@ -80,21 +87,39 @@ vec3 CalcSpotLightComponent(int i, vec3 albedo, vec3 specular, vec3 camDir) {
 	return spotLights[i].intensity * shading;
 }
 
+// first index and count of the light list of the cluster holding this fragment
+uvec2 FindCluster() {
+	ivec2 tile = min(ivec2(gl_FragCoord.xy / clusterTileSize), clusterGrid.xy - 1);
+	float depth = max(-viewPosition.z, clusterDepth.x);
+	int slice = min(int(log(depth / clusterDepth.x) * clusterDepth.y), clusterGrid.z - 1);
+	return texelFetch(clusterData, clusterHeaders + (slice * clusterGrid.y + tile.y) * clusterGrid.x + tile.x).xy;
+}
+
+int ClusterLight(uint index) {
+	return int(texelFetch(clusterData, clusterIndices + int(index / 4u))[int(index % 4u)]);
+}
+
+vec4 PointLightData(int light, int field) {
+	return uintBitsToFloat(texelFetch(clusterData, light * 4 + field));
+}
+
 vec3 CalcPointLightComponent(int i, vec3 albedo, vec3 specular, vec3 camDir) {
-	vec3 toLight = pointLights[i].pos - viewPosition;
+	vec4 posRange = PointLightData(i, 0);
+	vec4 colorIntensity = PointLightData(i, 1);
+	vec3 toLight = posRange.xyz - viewPosition;
 	vec3 lightDir = normalize(toLight);
 	float diffuseComponent = max(0, dot(lightDir, normalize(fragNormal)));
 	
 	vec3 bounceDir = normalize(lightDir + camDir);
 	float specularComponent = pow(max(0, dot(bounceDir, fragNormal)), material.Ns);
 
-	float coefficient = max(0., (1 - length(toLight) / pointLights[i].range));
+	float coefficient = max(0., (1 - length(toLight) / posRange.w));
 	diffuseComponent *= coefficient;
 	specularComponent *= coefficient;
 
 	// blinn-phong
-	vec3 shading = pointLights[i].color * (diffuseComponent * albedo) + specular * specularComponent;
-	return pointLights[i].intensity * shading;
+	vec3 shading = colorIntensity.rgb * (diffuseComponent * albedo) + specular * specularComponent;
+	return colorIntensity.a * shading;
 }
 
 vec3 CalcDirLightComponent(int i, vec3 albedo, vec3 specular, vec3 camDir) {
@@ -119,11 +144,12 @@ void main() {
 	
 	vec3 camDir = -normalize(viewPosition);
 	vec3 shading = vec3(0.);
-	for(int i=0; i<nSpotLights; i++) {
-		shading += CalcSpotLightComponent(i, albedo, specular, camDir);
+	for(int k=0; k<nObjectSpotLights; k++) {
+		shading += CalcSpotLightComponent(objectSpotLights[k], albedo, specular, camDir);
 	}
-	for(int i=0; i<nPointLights; i++) {
-		shading += CalcPointLightComponent(i, albedo, specular, camDir);
+	uvec2 cluster = FindCluster();
+	for(uint k=0u; k<cluster.y; k++) {
+		shading += CalcPointLightComponent(ClusterLight(cluster.x + k), albedo, specular, camDir);
 	}
 	for(int i=0; i<nDirLights; i++) {
 		shading += CalcDirLightComponent(i, albedo, specular, camDir);
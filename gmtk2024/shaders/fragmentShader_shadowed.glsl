@@ -1,38 +1,49 @@
 #version 330 core
 
-#define MAX_LIGHTS 5
+#define MAX_LIGHTS 8
+#define MAX_OBJECT_LIGHTS 4
+#define MAX_POINT_SHADOWS 5
+#define MAX_DIR_LIGHTS 4
+#define MAX_CASCADES 4
 
 struct SpotLight {
 	vec3 pos;
 	vec3 color;
 	float intensity;
 	float range;
-	sampler2DShadow shadowTexture;
+	mat4 shadowMatrix;
+	vec4 shadowRect;
 	sampler2D mapTexture;
 	int mapTextureSet;
 };
 uniform SpotLight spotLights[MAX_LIGHTS];
 uniform int nSpotLights;
-
-struct PointLight {
-	vec3 pos;
-	vec3 worldPos;
-	vec3 color;
-	float intensity;
-	float range;
-	samplerCube shadowTexture;
-	float far_plane;
-};
-uniform PointLight pointLights[MAX_LIGHTS];
-uniform int nPointLights;
+// the spot lights that matter most for the object being drawn, indices into spotLights
+uniform int objectSpotLights[MAX_OBJECT_LIGHTS];
+uniform int nObjectSpotLights;
+
+// point lights come from the light clusters, see LightClusters for the layout of clusterData
+uniform usamplerBuffer clusterData;
+uniform ivec3 clusterGrid;
+uniform vec2 clusterTileSize;
+// near plane and depth slices per unit of log depth
+uniform vec2 clusterDepth;
+uniform int clusterHeaders;
+uniform int clusterIndices;
+// cubemaps of the point lights with a shadow slot
+uniform samplerCube pointShadowMaps[MAX_POINT_SHADOWS];
 
 struct DirLight {
 	vec3 dir;
 	vec3 color;
 	float intensity;
-	sampler2DShadow shadowTexture;
+	// cascade c covers view depths up to cascadeSplits[c]
+	int nCascades;
+	vec4 cascadeSplits;
+	mat4 shadowMatrices[MAX_CASCADES];
+	vec4 shadowRects[MAX_CASCADES];
 };
-uniform DirLight dirLights[MAX_LIGHTS];
+uniform DirLight dirLights[MAX_DIR_LIGHTS];
 uniform int nDirLights;
 
 struct AmbientLight {
@@ -42,6 +53,9 @@ struct AmbientLight {
 uniform AmbientLight ambientLights[MAX_LIGHTS];
 uniform int nAmbientLights;
 
+// spot and directional shadow maps are tiles of this texture
+uniform sampler2DShadow shadowAtlas;
+
 struct Material {
 	vec3 Kd;
 	vec3 Ks;
@@ -58,11 +72,18 @@ in vec3 worldPosition;
 in vec3 viewPosition;
 in vec2 textureC;
 in vec3 fragNormal;
-in vec4 spotLightViewPositions[MAX_LIGHTS];
-in vec4 dirLightViewPositions[MAX_LIGHTS];
 
 out vec4 color;
 
+// rect is the tile of the light in the atlas, an empty one means the light got no tile and is unshadowed
+float SampleShadowAtlas(vec4 rect, vec3 p) {
+	if (rect.z <= 0.) return 1.;
+	// keep the filter footprint inside the tile so neighbouring maps don't bleed in
+	vec2 halfTexel = 0.5 / vec2(textureSize(shadowAtlas, 0));
+	vec2 uv = clamp(rect.xy + p.xy * rect.zw, rect.xy + halfTexel, rect.xy + rect.zw - halfTexel);
+	return texture(shadowAtlas, vec3(uv, p.z));
+}
+
 vec3 CalcSpotLightComponent(int i, vec3 albedo, vec3 specular, vec3 camDir) {
 	vec3 toLight = spotLights[i].pos - viewPosition;
 	vec3 lightDir = normalize(toLight);
@@ -71,13 +92,14 @@ vec3 CalcSpotLightComponent(int i, vec3 albedo, vec3 specular, vec3 camDir) {
 	vec3 bounceDir = normalize(lightDir + camDir);
 	float specularComponent = pow(max(0, dot(bounceDir, normalize(fragNormal))), material.Ns);
 
-	vec3 p = spotLightViewPositions[i].xyz;
+	vec4 lightPosition = spotLights[i].shadowMatrix * vec4(worldPosition, 1);
+	vec3 p = lightPosition.xyz;
 	p.z *= 0.99999;
-	p /= spotLightViewPositions[i].w;
+	p /= lightPosition.w;
 	if (p.x > 1 || p.x < 0 || p.y > 1 || p.y < 0 || p.z > 1.0 || p.z < 0.0) {
 		diffuseComponent = 0; specularComponent = 0;
 	} else {
-		float litValue = texture(spotLights[i].shadowTexture, p);
+		float litValue = SampleShadowAtlas(spotLights[i].shadowRect, p);
 		if (spotLights[i].mapTextureSet == 1) litValue *= texture(spotLights[i].mapTexture, p.xy).x;
 		float coefficient = litValue * max(0., (1 - length(toLight) / spotLights[i].range));
 		diffuseComponent *= coefficient;
@@ -89,29 +111,60 @@ vec3 CalcSpotLightComponent(int i, vec3 albedo, vec3 specular, vec3 camDir) {
 	return spotLights[i].intensity * shading;
 }
 
+// first index and count of the light list of the cluster holding this fragment
+uvec2 FindCluster() {
+	ivec2 tile = min(ivec2(gl_FragCoord.xy / clusterTileSize), clusterGrid.xy - 1);
+	float depth = max(-viewPosition.z, clusterDepth.x);
+	int slice = min(int(log(depth / clusterDepth.x) * clusterDepth.y), clusterGrid.z - 1);
+	return texelFetch(clusterData, clusterHeaders + (slice * clusterGrid.y + tile.y) * clusterGrid.x + tile.x).xy;
+}
+
+int ClusterLight(uint index) {
+	return int(texelFetch(clusterData, clusterIndices + int(index / 4u))[int(index % 4u)]);
+}
+
+vec4 PointLightData(int light, int field) {
+	return uintBitsToFloat(texelFetch(clusterData, light * 4 + field));
+}
+
+// sampler arrays only take constant indices in GLSL 3.30
+float SamplePointShadow(int slot, vec3 direction) {
+	if (slot == 0) return texture(pointShadowMaps[0], direction).x;
+	if (slot == 1) return texture(pointShadowMaps[1], direction).x;
+	if (slot == 2) return texture(pointShadowMaps[2], direction).x;
+	if (slot == 3) return texture(pointShadowMaps[3], direction).x;
+	return texture(pointShadowMaps[4], direction).x;
+}
+
 vec3 CalcPointLightComponent(int i, vec3 albedo, vec3 specular, vec3 camDir) {
-	vec3 toLight = pointLights[i].pos - viewPosition;
+	vec4 posRange = PointLightData(i, 0);
+	vec4 colorIntensity = PointLightData(i, 1);
+	vec4 worldFar = PointLightData(i, 2);
+	int shadowSlot = int(texelFetch(clusterData, i * 4 + 3).x);
+	vec3 toLight = posRange.xyz - viewPosition;
 	vec3 lightDir = normalize(toLight);
 	float diffuseComponent = max(0, dot(lightDir, normalize(fragNormal)));
 	
 	vec3 bounceDir = normalize(lightDir + camDir);
 	float specularComponent = pow(max(0, dot(bounceDir, fragNormal)), material.Ns);
 
-	vec3 toLightWorld = pointLights[i].worldPos - worldPosition;
-	float sampledDistance = texture(pointLights[i].shadowTexture, -toLightWorld).x;
-	sampledDistance *= pointLights[i].far_plane;
-	bool inShadow = (length(toLightWorld) - sampledDistance) >= 0.01;
+	vec3 toLightWorld = worldFar.xyz - worldPosition;
+	bool inShadow = false;
+	if (shadowSlot >= 0) {
+		float sampledDistance = SamplePointShadow(shadowSlot, -toLightWorld) * worldFar.w;
+		inShadow = (length(toLightWorld) - sampledDistance) >= 0.01;
+	}
 	if (inShadow) {
 		diffuseComponent = 0; specularComponent = 0;
 	} else {
-		float coefficient = max(0., (1 - length(toLightWorld) / pointLights[i].range));
+		float coefficient = max(0., (1 - length(toLightWorld) / posRange.w));
 		diffuseComponent *= coefficient;
 		specularComponent *= coefficient;
 	}
 
 	// blinn-phong
-	vec3 shading = pointLights[i].color * (diffuseComponent * albedo) + specular * specularComponent;
-	return pointLights[i].intensity * shading;
+	vec3 shading = colorIntensity.rgb * (diffuseComponent * albedo) + specular * specularComponent;
+	return colorIntensity.a * shading;
 }
 
 vec3 CalcDirLightComponent(int i, vec3 albedo, vec3 specular, vec3 camDir) {
@@ -121,13 +174,23 @@ vec3 CalcDirLightComponent(int i, vec3 albedo, vec3 specular, vec3 camDir) {
 	vec3 bounceDir = normalize(lightDir + camDir);
 	float specularComponent = pow(max(0, dot(bounceDir, fragNormal)), material.Ns);
 
-	vec3 p = dirLightViewPositions[i].xyz;
+	// first cascade whose slice contains the fragment, past the last one nothing is shadowed
+	float depth = -viewPosition.z;
+	int cascade = 0;
+	while (cascade < dirLights[i].nCascades && depth > dirLights[i].cascadeSplits[cascade]) cascade++;
+	if (cascade == dirLights[i].nCascades) {
+		vec3 shading = dirLights[i].color * (diffuseComponent * albedo) + specular * specularComponent;
+		return dirLights[i].intensity * shading;
+	}
+
+	vec4 lightPosition = dirLights[i].shadowMatrices[cascade] * vec4(worldPosition, 1);
+	vec3 p = lightPosition.xyz;
 	p.z *= 0.99;
-	p /= dirLightViewPositions[i].w;
+	p /= lightPosition.w;
 	if (p.x > 1 || p.x < 0 || p.y > 1 || p.y < 0 || p.z > 1.0 || p.z < 0.0) {
 		diffuseComponent = 0; specularComponent = 0;
 	} else {
-		float litValue = texture(dirLights[i].shadowTexture, p);
+		float litValue = SampleShadowAtlas(dirLights[i].shadowRects[cascade], p);
 		diffuseComponent *= litValue;
 		specularComponent *= litValue;
 	}
@@ -147,11 +210,12 @@ void main() {
 	
 	vec3 camDir = -normalize(viewPosition);
 	vec3 shading = vec3(0.);
-	for(int i=0; i<nSpotLights; i++) {
-		shading += CalcSpotLightComponent(i, albedo, specular, camDir);
+	for(int k=0; k<nObjectSpotLights; k++) {
+		shading += CalcSpotLightComponent(objectSpotLights[k], albedo, specular, camDir);
 	}
-	for(int i=0; i<nPointLights; i++) {
-		shading += CalcPointLightComponent(i, albedo, specular, camDir);
+	uvec2 cluster = FindCluster();
+	for(uint k=0u; k<cluster.y; k++) {
+		shading += CalcPointLightComponent(ClusterLight(cluster.x + k), albedo, specular, camDir);
 	}
 	for(int i=0; i<nDirLights; i++) {
 		shading += CalcDirLightComponent(i, albedo, specular, camDir);
@@ -0,0 +1,33 @@
+#version 330 core
+
+// Renders the six faces of a point light cubemap in one pass, the depth attachment is layered
+layout ( triangles ) in;
+layout ( triangle_strip, max_vertices = 18 ) out;
+
+uniform mat4 shadowMatrices[6];
+
+out vec3 fragPos;
+
+bool OutsideView(vec4 clip[3]) {
+	for (int axis = 0; axis < 3; axis++) {
+		if (clip[0][axis] > clip[0].w && clip[1][axis] > clip[1].w && clip[2][axis] > clip[2].w) return true;
+		if (clip[0][axis] < -clip[0].w && clip[1][axis] < -clip[1].w && clip[2][axis] < -clip[2].w) return true;
+	}
+	return false;
+}
+
+void main() {
+	for (int face = 0; face < 6; face++) {
+		vec4 clip[3];
+		for (int i = 0; i < 3; i++) clip[i] = shadowMatrices[face] * gl_in[i].gl_Position;
+		if (OutsideView(clip)) continue;
+
+		for (int i = 0; i < 3; i++) {
+			gl_Layer = face;
+			fragPos = gl_in[i].gl_Position.xyz;
+			gl_Position = clip[i];
+			EmitVertex();
+		}
+		EndPrimitive();
+	}
+}
\ No newline at end of file
@@ -0,0 +1,34 @@
+#version 330 core
+#extension GL_ARB_viewport_array : require
+
+#define MAX_VIEWS 4
+
+// Renders the shadow maps of a group of spot lights in one pass, each light owns a viewport of the same depth texture
+layout ( triangles ) in;
+layout ( triangle_strip, max_vertices = 12 ) out;
+
+uniform mat4 viewProjections[MAX_VIEWS];
+uniform int nViews;
+
+bool OutsideView(vec4 clip[3]) {
+	for (int axis = 0; axis < 3; axis++) {
+		if (clip[0][axis] > clip[0].w && clip[1][axis] > clip[1].w && clip[2][axis] > clip[2].w) return true;
+		if (clip[0][axis] < -clip[0].w && clip[1][axis] < -clip[1].w && clip[2][axis] < -clip[2].w) return true;
+	}
+	return false;
+}
+
+void main() {
+	for (int view = 0; view < nViews; view++) {
+		vec4 clip[3];
+		for (int i = 0; i < 3; i++) clip[i] = viewProjections[view] * gl_in[i].gl_Position;
+		if (OutsideView(clip)) continue;
+
+		for (int i = 0; i < 3; i++) {
+			gl_ViewportIndex = view;
+			gl_Position = clip[i];
+			EmitVertex();
+		}
+		EndPrimitive();
+	}
+}
\ No newline at end of file
@@ -3,6 +3,8 @@
 layout(location=0) in vec3 position;
 
 uniform mat4 mvp;
+// the lit and unlit vertex shaders are invariant too: after the depth pre-pass they are tested with GL_EQUAL
+invariant gl_Position;
 
 
 void main() {
@@ -3,11 +3,8 @@
 layout(location=0) in vec3 position;
 
 uniform mat4 model;
-uniform mat4 mvp;
-
-out vec3 fragPos;
 
 void main() {
-	fragPos = (model * vec4(position, 1)).xyz;
-	gl_Position = mvp * vec4(position, 1);
+	// world space, the geometry shader projects it into every view
+	gl_Position = model * vec4(position, 1);
 }
\ No newline at end of file
@@ -0,0 +1,29 @@
+#version 330 core
+
+layout(std140) uniform ObjectData {
+	mat4 mvp;
+	mat4 mv;
+	mat4 modelMat;
+	mat4 mvt;
+};
+
+layout(location=0) in vec3 position;
+layout(location=1) in vec2 textureCoord;
+layout(location=2) in vec3 normal;
+layout(location=3) in vec2 lightmapCoord;
+
+out vec3 worldPosition;
+out vec3 viewPosition;
+out vec2 textureC;
+out vec3 fragNormal;
+out vec2 lightmapC;
+invariant gl_Position;
+
+void main() {
+	gl_Position = mvp * vec4(position, 1);
+	worldPosition = (modelMat * vec4(position, 1)).xyz;
+	viewPosition = (mv * vec4(position, 1)).xyz;
+	fragNormal = mat3(mvt) * normal;
+	textureC = textureCoord;
+	lightmapC = lightmapCoord;
+}
\ No newline at end of file
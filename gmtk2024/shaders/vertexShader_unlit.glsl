@@ -1,6 +1,7 @@
 #version 330 core
 
 uniform mat4 mvp;
+invariant gl_Position;
 layout(location=0) in vec3 position;
 layout(location=1) in vec2 textureCoord;
 layout(location=2) in vec3 normal;